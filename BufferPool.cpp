@@ -0,0 +1,326 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "BufferPool.h"
+#include "Thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define NUM_CLASSES 3
+
+static const size_t sClassSizes[NUM_CLASSES] = {
+  BufferPool::SMALL, BufferPool::MEDIUM, BufferPool::LARGE
+};
+
+// Most free buffers of each class a thread keeps to itself.
+static const unsigned sThreadLimit[NUM_CLASSES] = { 32, 8, 2 };
+
+// Most free buffers of each class kept in the shared list; beyond this
+// they're returned to the heap.
+static const unsigned sSharedLimit[NUM_CLASSES] = { 1024, 64, 8 };
+
+// Singly linked list of free buffers, threaded through their first bytes.
+struct FreeList {
+  char* mHead;
+  unsigned mCount;
+
+  void Push(char* aBuffer) {
+    memcpy(aBuffer, &mHead, sizeof(mHead));
+    mHead = aBuffer;
+    mCount++;
+  }
+
+  char* Pop() {
+    char* buffer = mHead;
+    memcpy(&mHead, buffer, sizeof(mHead));
+    mCount--;
+    return buffer;
+  }
+};
+
+struct ThreadCache {
+  FreeList mLists[NUM_CLASSES];
+};
+
+static Monitor* sMonitor = 0;
+static FreeList sShared[NUM_CLASSES];
+
+static int ClassOf(size_t aSize) {
+  for (int c = 0; c < NUM_CLASSES; c++) {
+    if (aSize <= sClassSizes[c]) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+// Moves up to aCount buffers from aFrom to aTo.
+static void Transfer(FreeList& aFrom, FreeList& aTo, unsigned aCount) {
+  while (aCount-- > 0 && aFrom.mHead) {
+    aTo.Push(aFrom.Pop());
+  }
+}
+
+// Hands buffers in excess of aKeep back to the shared list, or to the
+// heap once the shared list is full.
+static void Drain(FreeList& aList, int aClass, unsigned aKeep) {
+  MonitorAutoLock lock(sMonitor);
+  FreeList& shared = sShared[aClass];
+  while (aList.mCount > aKeep) {
+    char* buffer = aList.Pop();
+    if (shared.mCount < sSharedLimit[aClass]) {
+      shared.Push(buffer);
+    } else {
+      delete[] buffer;
+    }
+  }
+}
+
+static void ReleaseThreadCache(ThreadCache* aCache) {
+  for (int c = 0; c < NUM_CLASSES; c++) {
+    Drain(aCache->mLists[c], c, 0);
+  }
+  delete aCache;
+}
+
+#ifdef _WIN32
+
+// Fiber local storage, rather than TLS, so we're told when threads exit.
+static DWORD sCacheKey = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI ThreadCacheDestructor(PVOID aCache) {
+  if (aCache) {
+    ReleaseThreadCache(static_cast<ThreadCache*>(aCache));
+  }
+}
+
+static bool CreateCacheKey() {
+  sCacheKey = FlsAlloc(ThreadCacheDestructor);
+  return sCacheKey != FLS_OUT_OF_INDEXES;
+}
+
+static void DeleteCacheKey() {
+  FlsFree(sCacheKey);
+  sCacheKey = FLS_OUT_OF_INDEXES;
+}
+
+static ThreadCache* GetCache() {
+  return static_cast<ThreadCache*>(FlsGetValue(sCacheKey));
+}
+
+static void SetCache(ThreadCache* aCache) {
+  FlsSetValue(sCacheKey, aCache);
+}
+
+#else
+
+static pthread_key_t sCacheKey;
+
+static void ThreadCacheDestructor(void* aCache) {
+  ReleaseThreadCache(static_cast<ThreadCache*>(aCache));
+}
+
+static bool CreateCacheKey() {
+  return pthread_key_create(&sCacheKey, ThreadCacheDestructor) == 0;
+}
+
+static void DeleteCacheKey() {
+  pthread_key_delete(sCacheKey);
+}
+
+static ThreadCache* GetCache() {
+  return static_cast<ThreadCache*>(pthread_getspecific(sCacheKey));
+}
+
+static void SetCache(ThreadCache* aCache) {
+  pthread_setspecific(sCacheKey, aCache);
+}
+
+#endif
+
+// Returns the calling thread's cache, creating it if need be, or null if
+// the pool isn't initialized.
+static ThreadCache* GetThreadCache() {
+  if (!sMonitor) {
+    return 0;
+  }
+  ThreadCache* cache = GetCache();
+  if (!cache) {
+    cache = new ThreadCache();
+    memset(cache, 0, sizeof(*cache));
+    SetCache(cache);
+  }
+  return cache;
+}
+
+void BufferPool::Init() {
+  if (sMonitor || !CreateCacheKey()) {
+    return;
+  }
+  sMonitor = Monitor::Create();
+}
+
+void BufferPool::Shutdown() {
+  if (!sMonitor) {
+    return;
+  }
+  // Other threads should have exited by now, and so have released their
+  // caches; anything they still hold is leaked.
+  ThreadCache* cache = GetCache();
+  if (cache) {
+    SetCache(0);
+    ReleaseThreadCache(cache);
+  }
+  DeleteCacheKey();
+  for (int c = 0; c < NUM_CLASSES; c++) {
+    while (sShared[c].mHead) {
+      delete[] sShared[c].Pop();
+    }
+  }
+  delete sMonitor;
+  sMonitor = 0;
+}
+
+char* BufferPool::Allocate(size_t aSize, size_t& aCapacity) {
+  int c = ClassOf(aSize);
+  if (c < 0) {
+    aCapacity = aSize;
+    return new char[aSize];
+  }
+  aCapacity = sClassSizes[c];
+  ThreadCache* cache = GetThreadCache();
+  if (!cache) {
+    return new char[aCapacity];
+  }
+  FreeList& list = cache->mLists[c];
+  if (!list.mHead) {
+    // Take a batch from the shared list, so the next few allocations
+    // needn't lock.
+    MonitorAutoLock lock(sMonitor);
+    Transfer(sShared[c], list, (sThreadLimit[c] + 1) / 2);
+  }
+  if (list.mHead) {
+    return list.Pop();
+  }
+  return new char[aCapacity];
+}
+
+void BufferPool::Free(char* aBuffer, size_t aCapacity) {
+  if (!aBuffer) {
+    return;
+  }
+  int c = ClassOf(aCapacity);
+  ThreadCache* cache = GetThreadCache();
+  if (c < 0 || aCapacity != sClassSizes[c] || !cache) {
+    delete[] aBuffer;
+    return;
+  }
+  FreeList& list = cache->mLists[c];
+  if (list.mCount >= sThreadLimit[c]) {
+    // Keep half, so alternating frees and allocations don't lock each
+    // time.
+    Drain(list, c, sThreadLimit[c] / 2);
+  }
+  list.Push(aBuffer);
+}
+
+#ifdef _DEBUG
+
+class BufferChurn : public Runnable {
+public:
+  BufferChurn(char* aForeign, size_t aCapacity)
+    : mForeign(aForeign), mCapacity(aCapacity) {}
+
+  virtual void Run() {
+    // Free a buffer allocated on another thread.
+    BufferPool::Free(mForeign, mCapacity);
+    Buffer held[16];
+    for (unsigned i = 0; i < 20000; i++) {
+      Buffer& b = held[(i * 7) % 16];
+      size_t size = (i * 2654435761u) % (2 * BufferPool::MEDIUM);
+      b.Allocate(size);
+      assert(b.Capacity() >= size);
+      memset(b.Data(), i & 0xff, size < 64 ? size : 64);
+    }
+  }
+
+private:
+  char* mForeign;
+  size_t mCapacity;
+};
+
+void BufferPool::Test() {
+  size_t capacity = 0;
+  char* a = Allocate(1, capacity);
+  assert(capacity == SMALL);
+  Free(a, capacity);
+  if (sMonitor) {
+    // Freed buffers are reused by the same thread.
+    char* b = Allocate(SMALL, capacity);
+    assert(b == a && capacity == SMALL);
+    Free(b, capacity);
+  }
+
+  {
+    Buffer medium(SMALL + 1);
+    assert(medium.Capacity() == MEDIUM);
+    Buffer large(LARGE);
+    assert(large.Capacity() == LARGE);
+    Buffer huge(LARGE + 1);
+    assert(huge.Capacity() == LARGE + 1);
+    memset(huge.Data(), 0, huge.Capacity());
+  }
+
+  const unsigned numThreads = 4;
+  Runnable* jobs[numThreads];
+  Thread* threads[numThreads];
+  for (unsigned i = 0; i < numThreads; i++) {
+    size_t c = 0;
+    char* foreign = Allocate(MEDIUM, c);
+    jobs[i] = new BufferChurn(foreign, c);
+    threads[i] = Thread::Create(jobs[i]);
+    threads[i]->Start();
+  }
+  for (unsigned i = 0; i < numThreads; i++) {
+    threads[i]->Join();
+    delete threads[i];
+    delete jobs[i];
+  }
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include "Utils.h"
+
+// Pool of reusable I/O buffers in a few fixed size classes. Each thread
+// keeps a small cache of free buffers of each class, so most allocations
+// and frees take no lock; threads exchange surplus buffers through a
+// shared, locked free list. Requests larger than the largest class are
+// served directly from the heap.
+class BufferPool {
+public:
+  enum {
+    SMALL = 4 * 1024,
+    MEDIUM = 64 * 1024,
+    LARGE = 1024 * 1024
+  };
+
+  // Sets up the shared free list and per-thread caches. Until Init() is
+  // called, and after Shutdown(), buffers come straight from the heap.
+  static void Init();
+  static void Shutdown();
+
+  // Returns a buffer of at least aSize bytes, and sets aCapacity to its
+  // actual size, which must be passed back to Free().
+  static char* Allocate(size_t aSize, size_t& aCapacity);
+  static void Free(char* aBuffer, size_t aCapacity);
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+};
+
+// Owns a buffer borrowed from the BufferPool, returning it on destruction.
+class Buffer {
+public:
+  Buffer() : mData(0), mCapacity(0) {}
+  explicit Buffer(size_t aSize) : mData(0), mCapacity(0) {
+    Allocate(aSize);
+  }
+  ~Buffer() {
+    Release();
+  }
+
+  // Replaces the current buffer, if any, with one of at least aSize bytes.
+  void Allocate(size_t aSize) {
+    Release();
+    mData = BufferPool::Allocate(aSize, mCapacity);
+  }
+
+  void Release() {
+    if (mData) {
+      BufferPool::Free(mData, mCapacity);
+      mData = 0;
+      mCapacity = 0;
+    }
+  }
+
+  char* Data() const {
+    return mData;
+  }
+
+  size_t Capacity() const {
+    return mCapacity;
+  }
+
+private:
+  Buffer(const Buffer&);
+  Buffer& operator=(const Buffer&);
+
+  char* mData;
+  size_t mCapacity;
+};
+
+#endif
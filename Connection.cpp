@@ -0,0 +1,153 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <iostream>
+
+#include "BufferPool.h"
+#include "Connection.h"
+#include "Log.h"
+#include "Stats.h"
+
+#define DEFAULT_BUFLEN BufferPool::SMALL
+
+Connection::Connection(Socket* aSocket)
+  : mSocket(aSocket),
+    mResponse(0),
+    mState(READING_REQUEST),
+    mIdleDeadline(GetMonotonicTime() + IDLE_TIMEOUT)
+{
+  Stats::Increment(Stats::CONNECTIONS_OPENED);
+}
+
+Connection::~Connection() {
+  delete mResponse;
+  delete mSocket;
+  Stats::Increment(Stats::CONNECTIONS_CLOSED);
+}
+
+int64_t Connection::GetWakeTime() const {
+  if (mState == READING_REQUEST) {
+    return mIdleDeadline;
+  }
+  return mResponse ? mResponse->GetWakeTime() : 0;
+}
+
+Connection::eWait Connection::Close() {
+  if (mResponse) {
+    // Does nothing if the response already completed.
+    mResponse->Finish(false);
+  }
+  mSocket->Close();
+  mState = FINISHED;
+  return CLOSED;
+}
+
+void Connection::NextRequest() {
+  delete mResponse;
+  mResponse = 0;
+  mParser.Reset();
+  if (mParser.IsComplete()) {
+    // The next request was pipelined behind the last one.
+    StartResponse();
+  } else {
+    mState = READING_REQUEST;
+    mIdleDeadline = GetMonotonicTime() + IDLE_TIMEOUT;
+  }
+}
+
+void Connection::StartResponse() {
+  mResponse = new Response(mParser);
+  mState = SENDING_HEADERS;
+}
+
+Connection::eWait Connection::Process() {
+  while (true) {
+    switch (mState) {
+      case READING_REQUEST: {
+        Buffer recvbuf(DEFAULT_BUFLEN);
+        int r = mSocket->Receive(recvbuf.Data(), DEFAULT_BUFLEN);
+        if (r == Socket::WOULD_BLOCK) {
+          if (GetMonotonicTime() >= mIdleDeadline) {
+            // Client is idle, or is taking too long to send its request.
+            return Close();
+          }
+          return WAIT_READABLE;
+        }
+        if (r == 0) {
+          LOG(LOG_DEBUG, "Connection closing...");
+        }
+        if (r <= 0) {
+          return Close();
+        }
+        mParser.Add(recvbuf.Data(), r);
+        if (mParser.IsComplete()) {
+          StartResponse();
+        }
+        break;
+      }
+
+      case SENDING_HEADERS:
+      case SENDING_BODY: {
+        Response::eStatus status = (mState == SENDING_HEADERS)
+          ? mResponse->SendHeaders(mSocket)
+          : mResponse->SendBody(mSocket);
+        switch (status) {
+          case Response::SEND_MORE:
+            break;
+          case Response::SEND_BLOCKED:
+            return WAIT_WRITABLE;
+          case Response::SEND_WAITING:
+            return WAIT_TIMER;
+          case Response::SEND_DONE:
+            if (mState == SENDING_HEADERS) {
+              mState = SENDING_BODY;
+              break;
+            }
+            mResponse->Finish(true);
+            if (mResponse->KeepAlive()) {
+              NextRequest();
+            } else {
+              mState = FINISHED;
+            }
+            break;
+          case Response::SEND_FAILED:
+          default:
+            return Close();
+        }
+        break;
+      }
+
+      case FINISHED:
+      default:
+        return Close();
+    }
+  }
+}
@@ -0,0 +1,95 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __CONNECTION_H__
+#define __CONNECTION_H__
+
+#include "RequestParser.h"
+#include "Response.h"
+#include "Sockets.h"
+
+// A single client connection: reads requests and sends their responses,
+// keeping the connection open between them when the client allows it.
+// Process() advances the exchange as far as the socket allows without
+// blocking, so the same state machine can be driven either by a dedicated
+// thread on a blocking socket, or by an event loop on a non-blocking one.
+class Connection {
+public:
+  // Microseconds we wait for a complete request before dropping the
+  // connection.
+  static const int64_t IDLE_TIMEOUT = 15000000;
+
+  // What the connection is waiting for after a call to Process().
+  enum eWait {
+    // Waiting for a request. Call Process() again when the socket is
+    // readable, or at GetWakeTime() so that idle connections are dropped.
+    WAIT_READABLE,
+    WAIT_WRITABLE,
+    // Paced output; call Process() again at GetWakeTime().
+    WAIT_TIMER,
+    // The connection is finished and its socket closed.
+    CLOSED
+  };
+
+  Connection(Socket* aSocket);
+  ~Connection();
+
+  eWait Process();
+
+  int64_t GetWakeTime() const;
+
+  Socket* GetSocket() const {
+    return mSocket;
+  }
+
+private:
+  enum eState {
+    READING_REQUEST,
+    SENDING_HEADERS,
+    SENDING_BODY,
+    FINISHED
+  };
+
+  eWait Close();
+
+  void StartResponse();
+
+  // Finishes the current response and starts on the next request.
+  void NextRequest();
+
+  Socket* mSocket;
+  RequestParser mParser;
+  Response* mResponse;
+  eState mState;
+  int64_t mIdleDeadline;
+};
+
+#endif
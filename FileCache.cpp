@@ -0,0 +1,298 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "FileCache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Files up to this size are read ahead in full when mapped; larger files
+// are read ahead as they're sent.
+#define WILLNEED_LIMIT (16 * 1024 * 1024)
+
+FileCache* FileCache::sInstance = 0;
+
+FileCache::FileCache(int64_t aBudget)
+  : mBudget(aBudget),
+    mMonitor(Monitor::Create()),
+    mSize(0)
+{
+}
+
+FileCache::~FileCache() {
+  // Outstanding references are leaked, rather than left dangling.
+  while (!mLRU.empty()) {
+    Remove(mLRU.front());
+  }
+  delete mMonitor;
+}
+
+void FileCache::Init(int64_t aBudget) {
+  if (!sInstance && aBudget > 0) {
+    sInstance = new FileCache(aBudget);
+  }
+}
+
+void FileCache::Shutdown() {
+  delete sInstance;
+  sInstance = 0;
+}
+
+#ifdef _WIN32
+
+FileCache::Mapping* FileCache::Map(const string& aPath, int64_t aLength) {
+  if ((uint64_t)aLength > (SIZE_T)-1) {
+    return 0;
+  }
+  HANDLE file = CreateFileA(aPath.c_str(), GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                              FILE_SHARE_DELETE,
+                            0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == INVALID_HANDLE_VALUE) {
+    return 0;
+  }
+  LARGE_INTEGER size;
+  HANDLE section = 0;
+  if (GetFileSizeEx(file, &size) && size.QuadPart == aLength) {
+    section = CreateFileMapping(file, 0, PAGE_READONLY, 0, 0, 0);
+  }
+  CloseHandle(file);
+  if (!section) {
+    return 0;
+  }
+  void* data = MapViewOfFile(section, FILE_MAP_READ, 0, 0, (SIZE_T)aLength);
+  CloseHandle(section);
+  if (!data) {
+    return 0;
+  }
+  Mapping* m = new Mapping();
+  m->mPath = aPath;
+  m->mData = static_cast<const char*>(data);
+  m->mLength = aLength;
+  return m;
+}
+
+void FileCache::Unmap(Mapping* aMapping) {
+  UnmapViewOfFile(aMapping->mData);
+  delete aMapping;
+}
+
+#else
+
+FileCache::Mapping* FileCache::Map(const string& aPath, int64_t aLength) {
+  if ((uint64_t)aLength > (size_t)-1) {
+    return 0;
+  }
+#ifdef O_CLOEXEC
+  int fd = open(aPath.c_str(), O_RDONLY | O_CLOEXEC);
+#else
+  int fd = open(aPath.c_str(), O_RDONLY);
+#endif
+  if (fd < 0) {
+    return 0;
+  }
+  // The file may have changed since the caller stat()ed it. Mapping past
+  // its end would fault when the response reached that point.
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == aLength) {
+    data = mmap(0, (size_t)aLength, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return 0;
+  }
+  madvise(data, (size_t)aLength,
+          aLength <= WILLNEED_LIMIT ? MADV_WILLNEED : MADV_SEQUENTIAL);
+  Mapping* m = new Mapping();
+  m->mPath = aPath;
+  m->mData = static_cast<const char*>(data);
+  m->mLength = aLength;
+  return m;
+}
+
+void FileCache::Unmap(Mapping* aMapping) {
+  munmap(const_cast<char*>(aMapping->mData), (size_t)aMapping->mLength);
+  delete aMapping;
+}
+
+#endif
+
+FileCache::Mapping* FileCache::Acquire(const string& aPath,
+                                       int64_t aLength,
+                                       int64_t aModified)
+{
+  if (aLength <= 0 || aLength > mBudget) {
+    return 0;
+  }
+  {
+    MonitorAutoLock lock(mMonitor);
+    std::map<string, Mapping*>::iterator itr = mMappings.find(aPath);
+    if (itr != mMappings.end()) {
+      Mapping* m = itr->second;
+      if (m->mLength == aLength && m->mModified == aModified) {
+        m->mRefCount++;
+        mLRU.splice(mLRU.begin(), mLRU, m->mLRU);
+        return m;
+      }
+      Remove(m);
+    }
+  }
+
+  // Map outside the lock, so a cold file doesn't stall hits on others.
+  Mapping* m = Map(aPath, aLength);
+  if (!m) {
+    return 0;
+  }
+  m->mModified = aModified;
+  m->mRefCount = 1;
+
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Mapping*>::iterator itr = mMappings.find(aPath);
+  if (itr != mMappings.end()) {
+    Mapping* other = itr->second;
+    if (other->mLength == aLength && other->mModified == aModified) {
+      // Another thread mapped it first.
+      Unmap(m);
+      other->mRefCount++;
+      mLRU.splice(mLRU.begin(), mLRU, other->mLRU);
+      return other;
+    }
+    Remove(other);
+  }
+  m->mCached = true;
+  mLRU.push_front(m);
+  m->mLRU = mLRU.begin();
+  mMappings[aPath] = m;
+  mSize += aLength;
+  Evict();
+  return m;
+}
+
+void FileCache::Release(Mapping* aMapping) {
+  MonitorAutoLock lock(mMonitor);
+  assert(aMapping->mRefCount > 0);
+  if (--aMapping->mRefCount > 0) {
+    return;
+  }
+  if (!aMapping->mCached) {
+    Unmap(aMapping);
+  } else if (mSize > mBudget) {
+    Evict();
+  }
+}
+
+void FileCache::Remove(Mapping* aMapping) {
+  assert(aMapping->mCached);
+  mMappings.erase(aMapping->mPath);
+  mLRU.erase(aMapping->mLRU);
+  mSize -= aMapping->mLength;
+  aMapping->mCached = false;
+  if (aMapping->mRefCount == 0) {
+    Unmap(aMapping);
+  }
+}
+
+void FileCache::Evict() {
+  std::list<Mapping*>::iterator itr = mLRU.end();
+  while (mSize > mBudget && itr != mLRU.begin()) {
+    Mapping* m = *--itr;
+    if (m->mRefCount == 0) {
+      // Step past m before its list node is erased.
+      itr++;
+      Remove(m);
+    }
+  }
+}
+
+#ifdef _DEBUG
+
+static void WriteTestFile(const char* aPath, const char* aContents) {
+  FILE* f = fopen(aPath, "wb");
+  assert(f);
+  fwrite(aContents, 1, strlen(aContents), f);
+  fclose(f);
+}
+
+void FileCache::Test() {
+  const char* a = "FileCacheTestA.tmp";
+  const char* b = "FileCacheTestB.tmp";
+  WriteTestFile(a, "0123456789");
+  WriteTestFile(b, "abcdefghij");
+
+  {
+    FileCache cache(15);
+    Mapping* m1 = cache.Acquire(a, 10, 1);
+    assert(m1 && m1->Length() == 10);
+    assert(memcmp(m1->Data(), "0123456789", 10) == 0);
+    // Concurrent users share the mapping.
+    Mapping* m2 = cache.Acquire(a, 10, 1);
+    assert(m2 == m1 && m1->mRefCount == 2);
+
+    // Files which don't match their stat, or exceed the budget, aren't
+    // mapped.
+    assert(!cache.Acquire(b, 11, 1));
+    assert(!cache.Acquire(b, 16, 1));
+    assert(!cache.Acquire("FileCacheTestMissing.tmp", 10, 1));
+
+    // Over budget, but a is in use, so both stay mapped.
+    Mapping* m3 = cache.Acquire(b, 10, 1);
+    assert(m3 && memcmp(m3->Data(), "abcdefghij", 10) == 0);
+    assert(cache.mSize == 20);
+    cache.Release(m1);
+    cache.Release(m2);
+    // a was least recently used, and is now unreferenced, so goes.
+    assert(cache.mSize == 10 && cache.mMappings.size() == 1);
+
+    // A changed modification time replaces the mapping; the stale one
+    // lives until it's released.
+    Mapping* m4 = cache.Acquire(b, 10, 2);
+    assert(m4 && m4 != m3 && !m3->mCached);
+    assert(cache.mSize == 10);
+    cache.Release(m3);
+    cache.Release(m4);
+  }
+
+  remove(a);
+  remove(b);
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <list>
+#include <map>
+
+#include "Thread.h"
+#include "Utils.h"
+
+// Process-wide cache of read-only memory mappings of whole files, so
+// concurrent responses for the same file share one mapping and are served
+// from the page cache without opening or reading the file themselves.
+// Mappings are reference counted; unreferenced mappings are kept until
+// the total mapped size exceeds the budget, and are then unmapped least
+// recently used first. Thread safe.
+class FileCache {
+public:
+  // A mapping of a file's entire contents.
+  class Mapping {
+  public:
+    const char* Data() const {
+      return mData;
+    }
+    int64_t Length() const {
+      return mLength;
+    }
+  private:
+    friend class FileCache;
+    Mapping() : mData(0), mLength(0), mModified(0), mRefCount(0),
+                mCached(false) {}
+    string mPath;
+    const char* mData;
+    int64_t mLength;
+    int64_t mModified;
+    unsigned mRefCount;
+    // False once evicted or replaced; the mapping is then destroyed when
+    // its last reference is released.
+    bool mCached;
+    std::list<Mapping*>::iterator mLRU;
+  };
+
+  // aBudget is the most bytes kept mapped by unreferenced entries.
+  FileCache(int64_t aBudget);
+  ~FileCache();
+
+  // Creates the cache used by Get(), unless aBudget is 0.
+  static void Init(int64_t aBudget);
+  static void Shutdown();
+
+  // Returns the process-wide cache, or null if caching is disabled.
+  static FileCache* Get() {
+    return sInstance;
+  }
+
+  // Returns a mapping of aPath with a reference held, or null if the file
+  // can't be mapped (e.g. it's empty, or larger than the budget). aLength
+  // and aModified come from a recent stat() of the file; a cached mapping
+  // which doesn't match them is stale, and is replaced.
+  Mapping* Acquire(const string& aPath, int64_t aLength, int64_t aModified);
+
+  void Release(Mapping* aMapping);
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  static Mapping* Map(const string& aPath, int64_t aLength);
+  static void Unmap(Mapping* aMapping);
+
+  // Removes aMapping from the cache, destroying it if it's unreferenced.
+  // Called with the lock held.
+  void Remove(Mapping* aMapping);
+
+  // Unmaps unreferenced mappings until the budget is met. Called with the
+  // lock held.
+  void Evict();
+
+  static FileCache* sInstance;
+
+  const int64_t mBudget;
+  Monitor* mMonitor;
+  std::map<string, Mapping*> mMappings;
+  // Cached mappings, most recently used first.
+  std::list<Mapping*> mLRU;
+  // Total size of cached mappings.
+  int64_t mSize;
+};
+
+#endif
@@ -0,0 +1,482 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "GzipCache.h"
+
+// Memory budget for compressed files.
+#define GZIP_CACHE_BUDGET (32 * 1024 * 1024)
+
+// Most files waiting to be compressed; requests for others beyond that are
+// sent as they are without queueing them.
+#define MAX_QUEUED 64
+
+#define WINDOW_SIZE 32768
+#define HASH_BITS 15
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+// Most earlier occurrences of a string examined when looking for a match.
+#define MAX_CHAIN 32
+
+static const unsigned gLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned gLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned gDistanceBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577
+};
+
+static const unsigned gDistanceExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// CRC-32 lookup table, filled in before main() runs.
+class Crc32Table {
+public:
+  Crc32Table() {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      mTable[n] = c;
+    }
+  }
+
+  uint32_t Compute(const char* aData, size_t aLength) const {
+    uint32_t c = 0xffffffff;
+    for (size_t i = 0; i < aLength; i++) {
+      c = mTable[(c ^ (unsigned char)aData[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffff;
+  }
+
+private:
+  uint32_t mTable[256];
+};
+
+static const Crc32Table gCrc32;
+
+// Writes deflate's bit stream, which packs values least significant bit
+// first.
+class BitWriter {
+public:
+  BitWriter(string& aOut) : mOut(aOut), mBits(0), mCount(0) {}
+
+  void Write(uint32_t aValue, unsigned aCount) {
+    mBits |= (uint64_t)aValue << mCount;
+    mCount += aCount;
+    while (mCount >= 8) {
+      mOut += (char)(mBits & 0xff);
+      mBits >>= 8;
+      mCount -= 8;
+    }
+  }
+
+  // Huffman codes are packed most significant bit first.
+  void WriteCode(uint32_t aCode, unsigned aLength) {
+    uint32_t reversed = 0;
+    for (unsigned i = 0; i < aLength; i++) {
+      reversed = (reversed << 1) | ((aCode >> i) & 1);
+    }
+    Write(reversed, aLength);
+  }
+
+  void Flush() {
+    if (mCount > 0) {
+      mOut += (char)(mBits & 0xff);
+      mBits = 0;
+      mCount = 0;
+    }
+  }
+
+private:
+  string& mOut;
+  uint64_t mBits;
+  unsigned mCount;
+};
+
+// Writes literal/length symbol aSymbol in the fixed Huffman code.
+static void WriteSymbol(BitWriter& aWriter, unsigned aSymbol) {
+  if (aSymbol < 144) {
+    aWriter.WriteCode(0x30 + aSymbol, 8);
+  } else if (aSymbol < 256) {
+    aWriter.WriteCode(0x190 + aSymbol - 144, 9);
+  } else if (aSymbol < 280) {
+    aWriter.WriteCode(aSymbol - 256, 7);
+  } else {
+    aWriter.WriteCode(0xc0 + aSymbol - 280, 8);
+  }
+}
+
+static void WriteMatch(BitWriter& aWriter, unsigned aLength,
+                       unsigned aDistance)
+{
+  unsigned i = 28;
+  while (gLengthBase[i] > aLength) {
+    i--;
+  }
+  WriteSymbol(aWriter, 257 + i);
+  aWriter.Write(aLength - gLengthBase[i], gLengthExtra[i]);
+  unsigned d = 29;
+  while (gDistanceBase[d] > aDistance) {
+    d--;
+  }
+  aWriter.WriteCode(d, 5);
+  aWriter.Write(aDistance - gDistanceBase[d], gDistanceExtra[d]);
+}
+
+static unsigned Hash(const unsigned char* aData) {
+  return ((aData[0] << 10) ^ (aData[1] << 5) ^ aData[2]) &
+         ((1 << HASH_BITS) - 1);
+}
+
+static void AppendLittleEndian(string& aOut, uint32_t aValue) {
+  for (int i = 0; i < 4; i++) {
+    aOut += (char)((aValue >> (8 * i)) & 0xff);
+  }
+}
+
+void GzipCache::Compress(const char* aData, size_t aLength, string& aOut) {
+  // Header: magic, deflate, no flags, no time, unknown OS.
+  static const char header[10] = {
+    '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff'
+  };
+  aOut.append(header, sizeof(header));
+
+  BitWriter writer(aOut);
+  // A single, final block with fixed Huffman codes.
+  writer.Write(1, 1);
+  writer.Write(1, 2);
+
+  // Greedy LZ77. head holds the latest position with each hash, and prev
+  // the previous position with the same hash as each position in the
+  // window.
+  const unsigned char* data = (const unsigned char*)aData;
+  vector<int> head(1 << HASH_BITS, -1);
+  vector<int> prev(WINDOW_SIZE, -1);
+  size_t i = 0;
+  while (i < aLength) {
+    size_t best = 0;
+    size_t bestDistance = 0;
+    if (i + MIN_MATCH <= aLength) {
+      size_t limit = std::min((size_t)MAX_MATCH, aLength - i);
+      int candidate = head[Hash(data + i)];
+      for (int chain = MAX_CHAIN;
+           candidate >= 0 && i - candidate <= WINDOW_SIZE && chain > 0;
+           chain--) {
+        const unsigned char* a = data + candidate;
+        size_t length = 0;
+        while (length < limit && a[length] == data[i + length]) {
+          length++;
+        }
+        if (length > best) {
+          best = length;
+          bestDistance = i - candidate;
+          if (length == limit) {
+            break;
+          }
+        }
+        candidate = prev[candidate & (WINDOW_SIZE - 1)];
+      }
+    }
+    size_t advance = 1;
+    if (best >= MIN_MATCH) {
+      WriteMatch(writer, (unsigned)best, (unsigned)bestDistance);
+      advance = best;
+    } else {
+      WriteSymbol(writer, data[i]);
+    }
+    for (size_t end = i + advance; i < end; i++) {
+      if (i + MIN_MATCH <= aLength) {
+        unsigned h = Hash(data + i);
+        prev[i & (WINDOW_SIZE - 1)] = head[h];
+        head[h] = (int)i;
+      }
+    }
+  }
+  WriteSymbol(writer, 256);
+  writer.Flush();
+
+  AppendLittleEndian(aOut, gCrc32.Compute(aData, aLength));
+  AppendLittleEndian(aOut, (uint32_t)aLength);
+}
+
+GzipCache* GzipCache::sInstance = 0;
+
+GzipCache::GzipCache(int64_t aBudget)
+  : mBudget(aBudget),
+    mMonitor(Monitor::Create()),
+    mShutdown(false),
+    mSize(0)
+{
+  mThread = Thread::Create(this);
+  mThread->Start();
+}
+
+GzipCache::~GzipCache() {
+  {
+    MonitorAutoLock lock(mMonitor);
+    mShutdown = true;
+    lock.Notify();
+  }
+  mThread->Join();
+  delete mThread;
+  while (!mEntries.empty()) {
+    Remove(mEntries.begin());
+  }
+  delete mMonitor;
+}
+
+void GzipCache::Init() {
+  if (!sInstance) {
+    sInstance = new GzipCache(GZIP_CACHE_BUDGET);
+  }
+}
+
+void GzipCache::Shutdown() {
+  delete sInstance;
+  sInstance = 0;
+}
+
+bool GzipCache::ReadFile(const string& aPath, int64_t aLength, string& aOut) {
+  FILE* f = fopen(aPath.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  aOut.resize((size_t)aLength);
+  size_t read = aLength > 0 ? fread(&aOut[0], 1, aOut.size(), f) : 0;
+  fclose(f);
+  return read == aOut.size();
+}
+
+int64_t GzipCache::Cost(const string& aPath, const Entry& aEntry) {
+  // Entries for files not worth compressing are small, but still count,
+  // so there can't be unboundedly many.
+  return aPath.size() +
+         (aEntry.mCompressed ? aEntry.mCompressed->Length() : 0);
+}
+
+GzipCache::Compressed* GzipCache::Acquire(const string& aPath,
+                                          int64_t aLength,
+                                          int64_t aModified)
+{
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Entry>::iterator itr = mEntries.find(aPath);
+  if (itr != mEntries.end() &&
+      itr->second.mLength == aLength &&
+      itr->second.mModified == aModified) {
+    mLRU.splice(mLRU.begin(), mLRU, itr->second.mLRU);
+    Compressed* compressed = itr->second.mCompressed;
+    if (compressed) {
+      AtomicAdd(&compressed->mRefCount, 1);
+    }
+    return compressed;
+  }
+  // Missing or stale. Compress it in the background, unless that's
+  // already pending.
+  if (!mShutdown && mQueue.size() < MAX_QUEUED &&
+      mQueued.insert(aPath).second) {
+    Pending pending;
+    pending.mPath = aPath;
+    pending.mLength = aLength;
+    pending.mModified = aModified;
+    mQueue.push_back(pending);
+    lock.Notify();
+  }
+  return 0;
+}
+
+void GzipCache::Release(Compressed* aCompressed) {
+  if (AtomicAdd(&aCompressed->mRefCount, -1) == 0) {
+    delete aCompressed;
+  }
+}
+
+void GzipCache::Run() {
+  while (true) {
+    Pending pending;
+    {
+      MonitorAutoLock lock(mMonitor);
+      while (!mShutdown && mQueue.empty()) {
+        lock.Wait();
+      }
+      if (mShutdown) {
+        return;
+      }
+      pending = mQueue.front();
+      mQueue.pop_front();
+    }
+
+    // Compress outside the lock, so hits on other files aren't stalled.
+    string contents;
+    bool read = ReadFile(pending.mPath, pending.mLength, contents);
+    Compressed* compressed = 0;
+    if (read) {
+      compressed = new Compressed();
+      Compress(contents.data(), contents.size(), compressed->mData);
+      if (compressed->Length() >= contents.size()) {
+        // Not worth sending compressed; remember that instead.
+        Release(compressed);
+        compressed = 0;
+      }
+    }
+
+    MonitorAutoLock lock(mMonitor);
+    // It stays queued until now, so it isn't compressed twice at once.
+    mQueued.erase(pending.mPath);
+    if (read) {
+      Insert(pending, compressed);
+    }
+  }
+}
+
+void GzipCache::Insert(const Pending& aPending, Compressed* aCompressed) {
+  std::map<string, Entry>::iterator itr = mEntries.find(aPending.mPath);
+  if (itr != mEntries.end()) {
+    // Stale; keep the latest.
+    Remove(itr);
+  }
+  Entry e;
+  e.mLength = aPending.mLength;
+  e.mModified = aPending.mModified;
+  e.mCompressed = aCompressed;
+  int64_t cost = Cost(aPending.mPath, e);
+  if (cost > mBudget) {
+    if (aCompressed) {
+      Release(aCompressed);
+    }
+    return;
+  }
+  mLRU.push_front(aPending.mPath);
+  e.mLRU = mLRU.begin();
+  mEntries[aPending.mPath] = e;
+  mSize += cost;
+  Evict();
+}
+
+void GzipCache::Remove(std::map<string, Entry>::iterator aEntry) {
+  mSize -= Cost(aEntry->first, aEntry->second);
+  mLRU.erase(aEntry->second.mLRU);
+  if (aEntry->second.mCompressed) {
+    Release(aEntry->second.mCompressed);
+  }
+  mEntries.erase(aEntry);
+}
+
+void GzipCache::Evict() {
+  while (mSize > mBudget && !mLRU.empty()) {
+    Remove(mEntries.find(mLRU.back()));
+  }
+}
+
+#ifdef _DEBUG
+
+void GzipCache::Test() {
+  assert(gCrc32.Compute("123456789", 9) == 0xcbf43926);
+
+  // An empty input is a header, an empty fixed block and the trailer.
+  string empty;
+  Compress("", 0, empty);
+  assert(empty == string("\x1f\x8b\x08\0\0\0\0\0\0\xff\x03\0\0\0\0\0\0\0\0\0",
+                         20));
+
+  // Repetitive text shrinks, and the trailer holds its CRC and length.
+  string text;
+  for (int i = 0; i < 100; i++) {
+    text += "<li><a href=\"video.webm\">video.webm</a></li>\n";
+  }
+  string compressed;
+  Compress(text.data(), text.size(), compressed);
+  assert(compressed.size() < text.size() / 10);
+  const unsigned char* trailer =
+    (const unsigned char*)compressed.data() + compressed.size() - 8;
+  uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+                 ((uint32_t)trailer[3] << 24);
+  assert(crc == gCrc32.Compute(text.data(), text.size()));
+  assert((size_t)(trailer[4] | (trailer[5] << 8)) == text.size());
+
+  // Files are compressed in the background, and sent as they are until
+  // then.
+  const char* path = "GzipCacheTest.tmp";
+  FILE* f = fopen(path, "wb");
+  assert(f);
+  fwrite(text.data(), 1, text.size(), f);
+  fclose(f);
+  GzipCache cache(1024 * 1024);
+  assert(!cache.Acquire(path, text.size(), 1));
+  Compressed* c = 0;
+  for (int i = 0; i < 200 && !c; i++) {
+    Sleep(5);
+    c = cache.Acquire(path, text.size(), 1);
+  }
+  assert(c && string(c->Data(), c->Length()) == compressed);
+  assert(cache.mSize == (int64_t)(strlen(path) + compressed.size()));
+  Compressed* again = cache.Acquire(path, text.size(), 1);
+  assert(again == c);
+  Release(again);
+
+  // A changed file's copy is replaced; one which is no smaller compressed,
+  // as ten bytes aren't, is remembered as not worth compressing. Copies
+  // still referenced stay valid.
+  assert(!cache.Acquire(path, 10, 2));
+  bool replaced = false;
+  for (int i = 0; i < 200 && !replaced; i++) {
+    Sleep(5);
+    MonitorAutoLock lock(cache.mMonitor);
+    std::map<string, Entry>::iterator itr = cache.mEntries.find(path);
+    replaced = itr != cache.mEntries.end() && itr->second.mLength == 10;
+  }
+  assert(replaced);
+  assert(!cache.Acquire(path, 10, 2));
+  {
+    MonitorAutoLock lock(cache.mMonitor);
+    assert(cache.mEntries.size() == 1 && cache.mQueue.empty());
+    assert(cache.mSize == (int64_t)strlen(path));
+  }
+  assert(string(c->Data(), c->Length()) == compressed);
+  Release(c);
+  remove(path);
+}
+
+#endif
@@ -0,0 +1,155 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __GZIP_CACHE_H__
+#define __GZIP_CACHE_H__
+
+#include <list>
+#include <map>
+#include <set>
+
+#include "Thread.h"
+#include "Utils.h"
+
+// Gzip compression of text files for clients which accept it, with the
+// compressed files kept in memory until they exceed a budget, least
+// recently used first, so each version of a file is compressed once.
+// Files are compressed on a background thread, so serving threads never
+// wait for it; until a file's compressed copy is ready, it's sent as it
+// is. Files which don't get smaller are remembered, and always sent as
+// they are. Compressed copies are shared, immutable and reference
+// counted. Thread safe.
+class GzipCache : public Runnable {
+public:
+  class Compressed {
+  public:
+    const char* Data() const {
+      return mData.data();
+    }
+    size_t Length() const {
+      return mData.size();
+    }
+  private:
+    friend class GzipCache;
+    Compressed() : mRefCount(1) {}
+    string mData;
+    volatile int mRefCount;
+  };
+
+  // aBudget is the most compressed bytes kept.
+  GzipCache(int64_t aBudget);
+
+  // Stops the compression thread; files still waiting aren't compressed.
+  ~GzipCache();
+
+  // Creates the cache used by Get().
+  static void Init();
+  static void Shutdown();
+
+  // Returns the process-wide cache, or null before Init().
+  static GzipCache* Get() {
+    return sInstance;
+  }
+
+  // Returns the gzip compressed contents of aPath, with a reference held,
+  // or null if the file should be sent as it is: because it's not smaller
+  // compressed, or because it hasn't been compressed yet, in which case
+  // it's queued to be. aLength and aModified come from a recent stat() of
+  // the file; a cached copy which doesn't match them is stale, and is
+  // replaced.
+  Compressed* Acquire(const string& aPath, int64_t aLength, int64_t aModified);
+
+  static void Release(Compressed* aCompressed);
+
+  // Compresses queued files until shut down.
+  virtual void Run();
+
+  // Appends aData[0, aLength) compressed in the gzip format to aOut. This
+  // uses a single block of deflate's fixed Huffman codes, which is quick
+  // and needs no tables to be sent, while still getting most of the gain
+  // on text.
+  static void Compress(const char* aData, size_t aLength, string& aOut);
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  struct Entry {
+    int64_t mLength;
+    int64_t mModified;
+    // The compressed copy, or null if it's no smaller than the file.
+    Compressed* mCompressed;
+    std::list<string>::iterator mLRU;
+  };
+
+  // A file waiting to be compressed.
+  struct Pending {
+    string mPath;
+    int64_t mLength;
+    int64_t mModified;
+  };
+
+  // Reads the first aLength bytes of aPath into aOut.
+  static bool ReadFile(const string& aPath, int64_t aLength, string& aOut);
+
+  // Bytes an entry counts against the budget.
+  static int64_t Cost(const string& aPath, const Entry& aEntry);
+
+  // Caches the result of compressing aPending, replacing any older entry,
+  // and takes over the reference to aCompressed. Called with the lock
+  // held.
+  void Insert(const Pending& aPending, Compressed* aCompressed);
+
+  // Removes aPath's entry. Called with the lock held.
+  void Remove(std::map<string, Entry>::iterator aEntry);
+
+  // Drops least recently used entries until the budget is met. Called
+  // with the lock held.
+  void Evict();
+
+  static GzipCache* sInstance;
+
+  const int64_t mBudget;
+  Monitor* mMonitor;
+  Thread* mThread;
+  bool mShutdown;
+  std::map<string, Entry> mEntries;
+  // Paths of cached entries, most recently used first.
+  std::list<string> mLRU;
+  // Total cost of cached entries.
+  int64_t mSize;
+  // Files waiting to be compressed, oldest first, and their paths.
+  std::list<Pending> mQueue;
+  std::set<string> mQueued;
+};
+
+#endif
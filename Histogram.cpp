@@ -0,0 +1,155 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include "Histogram.h"
+
+Histogram::Histogram() {
+  Reset();
+}
+
+void Histogram::Reset() {
+  memset(mBuckets, 0, sizeof(mBuckets));
+  mCount = 0;
+  mMax = 0;
+  mSum = 0;
+}
+
+unsigned Histogram::BucketOf(int64_t aValue) {
+  if (aValue < SUB_BUCKETS) {
+    return aValue < 0 ? 0 : (unsigned)aValue;
+  }
+  unsigned msb = 0;
+  for (uint64_t v = (uint64_t)aValue; v > 1; v >>= 1) {
+    msb++;
+  }
+  if (msb >= MAX_BITS) {
+    return BUCKETS - 1;
+  }
+  unsigned shift = msb - SUB_BUCKET_BITS;
+  unsigned sub = (unsigned)(aValue >> shift) & (SUB_BUCKETS - 1);
+  return SUB_BUCKETS * (shift + 1) + sub;
+}
+
+int64_t Histogram::BucketLimit(unsigned aBucket) {
+  if (aBucket < SUB_BUCKETS) {
+    return aBucket;
+  }
+  unsigned shift = aBucket / SUB_BUCKETS - 1;
+  int64_t sub = aBucket % SUB_BUCKETS;
+  return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void Histogram::Record(int64_t aValue) {
+  mBuckets[BucketOf(aValue)]++;
+  mCount++;
+  mSum += aValue;
+  if (aValue > mMax) {
+    mMax = aValue;
+  }
+}
+
+void Histogram::Add(const Histogram& aOther) {
+  for (unsigned i = 0; i < BUCKETS; i++) {
+    mBuckets[i] += aOther.mBuckets[i];
+  }
+  mCount += aOther.mCount;
+  mSum += aOther.mSum;
+  if (aOther.mMax > mMax) {
+    mMax = aOther.mMax;
+  }
+}
+
+int64_t Histogram::Percentile(double aPercentile) const {
+  if (mCount == 0) {
+    return 0;
+  }
+  int64_t rank = (int64_t)(mCount * aPercentile / 100.0 + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  int64_t seen = 0;
+  for (unsigned i = 0; i < BUCKETS; i++) {
+    seen += mBuckets[i];
+    if (seen >= rank) {
+      int64_t limit = BucketLimit(i);
+      return limit < mMax ? limit : mMax;
+    }
+  }
+  return mMax;
+}
+
+string Histogram::Summary() const {
+  string s;
+  s.append("p50=");
+  s.append(ToString(Percentile(50)));
+  s.append(" p90=");
+  s.append(ToString(Percentile(90)));
+  s.append(" p99=");
+  s.append(ToString(Percentile(99)));
+  s.append(" max=");
+  s.append(ToString(mMax));
+  s.append(" n=");
+  s.append(ToString(mCount));
+  return s;
+}
+
+#ifdef _DEBUG
+void Histogram::Test() {
+  for (int64_t v = 0; v < ((int64_t)1 << 40); v = v * 3 + 1) {
+    unsigned b = BucketOf(v);
+    assert(v <= BucketLimit(b));
+    assert(b == 0 || v > BucketLimit(b - 1));
+  }
+
+  Histogram h;
+  assert(h.Percentile(50) == 0);
+  for (int64_t i = 1; i <= 1000; i++) {
+    h.Record(i);
+  }
+  assert(h.Count() == 1000);
+  assert(h.Max() == 1000);
+  int64_t p50 = h.Percentile(50);
+  assert(p50 >= 500 && p50 <= 500 * 17 / 16);
+  int64_t p99 = h.Percentile(99);
+  assert(p99 >= 990 && p99 <= 1000);
+  assert(h.Percentile(100) == 1000);
+
+  Histogram h2;
+  h2.Record(5000);
+  h.Add(h2);
+  assert(h.Count() == 1001 && h.Max() == 5000);
+  h.Reset();
+  assert(h.Count() == 0 && h.Percentile(99) == 0);
+}
+#endif
@@ -0,0 +1,93 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include "Utils.h"
+
+// Log-linear histogram of non-negative integer samples, in the style of
+// HdrHistogram. Each power of two range is split into 16 linear buckets,
+// so percentiles are accurate to within about 6%. Not thread safe.
+class Histogram {
+public:
+  Histogram();
+
+  void Record(int64_t aValue);
+
+  // Adds the samples of another histogram to this one.
+  void Add(const Histogram& aOther);
+
+  void Reset();
+
+  int64_t Count() const {
+    return mCount;
+  }
+
+  int64_t Max() const {
+    return mMax;
+  }
+
+  int64_t Sum() const {
+    return mSum;
+  }
+
+  // Returns the value below which aPercentile percent of samples fall,
+  // or 0 if there are no samples.
+  int64_t Percentile(double aPercentile) const;
+
+  // Returns "p50=... p90=... p99=... max=... n=...".
+  string Summary() const;
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  static unsigned BucketOf(int64_t aValue);
+  // Largest value which falls in aBucket.
+  static int64_t BucketLimit(unsigned aBucket);
+
+  enum {
+    SUB_BUCKET_BITS = 4,
+    SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+    // Values up to 2^48 (over 8 years in microseconds).
+    MAX_BITS = 48,
+    BUCKETS = SUB_BUCKETS * (MAX_BITS - SUB_BUCKET_BITS + 1)
+  };
+
+  int64_t mBuckets[BUCKETS];
+  int64_t mCount;
+  int64_t mMax;
+  int64_t mSum;
+};
+
+#endif
@@ -35,17 +35,32 @@
 #include <stdlib.h>
 
 #include <iostream>
-#include <memory>
 #include <string>
 #include <vector>
 
 #include "Utils.h"
+#include "BufferPool.h"
+#include "FileCache.h"
+#include "GzipCache.h"
+#include "ListingCache.h"
+#include "LiveFanout.h"
+#include "Log.h"
+#include "MetadataCache.h"
 #include "Thread.h"
+#include "ThreadPool.h"
+#include "TokenBucket.h"
+#include "Connection.h"
+#include "IoRing.h"
+#include "Reactor.h"
+#include "Scheduler.h"
+#include "Stats.h"
 #include "RequestParser.h"
 #include "Sockets.h"
 #include "Response.h"
 
-using std::auto_ptr;
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 #ifdef WIN32
 #define PORT 80
@@ -53,104 +68,361 @@ using std::auto_ptr;
 #define PORT 8080
 #endif
 
-#define DEFAULT_BUFLEN 512
+// Default size of the worker pool, and of its queue of accepted
+// connections waiting for a worker.
+#define DEFAULT_THREADS 64
+#define DEFAULT_QUEUE 1024
+
+// Default budget for the mapped file cache, in megabytes.
+#define DEFAULT_CACHE_MB 256
 
-class Connection : public Runnable{
+// Default number of connections which may wait in each listening socket's
+// accept queue. The kernel may cap this, e.g. at net.core.somaxconn.
+#define DEFAULT_BACKLOG 1024
+
+// Serves a connection on a pool thread, using a non-blocking socket, until
+// it would block.
+class ConnectionJob : public Runnable {
 public:
-  Connection(Socket* s)
-    : mClientSocket(s)
+  ConnectionJob(Socket* s, Scheduler* aScheduler)
+    : mConnection(new Connection(s)),
+      mScheduler(aScheduler)
   {
-    mThread = Thread::Create(this);
   }
 
-  void Start() {
-    mThread->Start();
+  ~ConnectionJob() {
+    delete mConnection;
   }
 
   virtual void Run() {
-    char recvbuf[DEFAULT_BUFLEN];
-    int recvbuflen = DEFAULT_BUFLEN;
-
-    // Receive until the peer shuts down the connection
-    while (!parser.IsComplete()) {
-      int r = mClientSocket->Receive(recvbuf, recvbuflen);
-      if (r > 0) {
-        parser.Add(recvbuf, r);
-      } else if (r == 0) {
-        cout << "Connection closing..." << std::endl;
-        break;
-      } else {
-        mClientSocket->Close();
-        return;
-      }
+    Connection::eWait wait = mConnection->Process();
+    if (wait == Connection::CLOSED) {
+      return;
+    }
+    // Rather than blocking this thread, hand the connection to the
+    // scheduler, which will resume it on a pool thread when it's due, when
+    // its next request arrives, or when its socket can take more data.
+    int64_t wake = mConnection->GetWakeTime();
+    int socket = mConnection->GetSocket()->GetDescriptor();
+    Runnable* job = new ConnectionJob(mConnection, mScheduler);
+    mConnection = 0;
+    if (wait == Connection::WAIT_READABLE) {
+      mScheduler->ScheduleReadable(job, socket, wake);
+    } else if (wait == Connection::WAIT_WRITABLE) {
+      // A client which stops reading is checked on now and then, as an
+      // idle one is.
+      mScheduler->ScheduleWritable(job, socket,
+                                   GetMonotonicTime() +
+                                     Connection::IDLE_TIMEOUT);
+    } else {
+      mScheduler->Schedule(job, wake);
     }
+  }
+private:
+  ConnectionJob(Connection* aConnection, Scheduler* aScheduler)
+    : mConnection(aConnection),
+      mScheduler(aScheduler)
+  {
+  }
+
+  Connection* mConnection;
+  Scheduler* mScheduler;
+};
+
+static volatile bool gRunning = true;
+
+void sighandler(int signal)
+{
+  gRunning = false;
+  Socket::Interrupt();
+};
+
+// Accepts and serves the connections arriving on one listening socket,
+// either from an epoll reactor or with its own thread pool. With
+// --listeners=N there are N shards, each with its own socket on the same
+// port, so accepting and serving connections is spread across cores.
+class ServerShard : public Runnable {
+public:
+  // aCpu is the processor to pin the shard's thread to, or -1.
+  ServerShard(Socket* aListener,
+              bool aUseReactor,
+              bool aUseRing,
+              unsigned aThreads,
+              unsigned aQueue,
+              int aCpu)
+    : mListener(aListener),
+      mUseReactor(aUseReactor),
+      mUseRing(aUseRing),
+      mThreads(aThreads),
+      mQueue(aQueue),
+      mCpu(aCpu),
+      mOk(true)
+  {
+  }
 
-    Response response(parser);
+  ~ServerShard() {
+    delete mListener;
+  }
 
-    if (!response.SendHeaders(mClientSocket.get())) {
-      mClientSocket->Close();
+  virtual void Run() {
+    if (mCpu >= 0 && !PinCurrentThread(mCpu)) {
+      LOG(LOG_WARNING, "Can't pin listener to CPU %d", mCpu);
+    }
+    if (mUseReactor) {
+      // Connections are destroyed with the reactor, and may hold cached
+      // files, so it must be gone before the services are shut down.
+      Reactor reactor(mListener, mUseRing);
+      mOk = reactor.Run(&gRunning);
       return;
     }
 
-    while (response.SendBody(mClientSocket.get())) {
-      // Transmit the body.
+    ThreadPool pool(mThreads, mQueue);
+    Scheduler scheduler(&pool);
+    while (gRunning && mListener->WaitForConnection()) {
+      // Take every pending connection. Dispatch() blocks while the queue
+      // is full, leaving further connections in the listen backlog.
+      while (Socket* client = mListener->Accept(true)) {
+        pool.Dispatch(new ConnectionJob(client, &scheduler));
+      }
     }
 
-    // cleanup
-    mClientSocket->Close();
+    // The scheduler dispatches to the pool, so must stop first.
+    // Connections which are still running then find the scheduler shut
+    // down, and are closed rather than rescheduled.
+    scheduler.Shutdown();
+    pool.Shutdown();
+  }
+
+  // False if the shard couldn't be started.
+  bool Ok() const {
+    return mOk;
   }
+
 private:
-  auto_ptr<Socket> mClientSocket;
-  RequestParser parser;
-  Thread* mThread;
+  Socket* mListener;
+  bool mUseReactor;
+  bool mUseRing;
+  unsigned mThreads;
+  unsigned mQueue;
+  int mCpu;
+  bool mOk;
 };
 
-static bool gRunning = true;
 
-void sighandler(int signal)
+static void usage(const char* aProgram)
 {
-  gRunning = false;
-};
+  cerr << "Usage: " << aProgram << " [options]" << std::endl
+       << "  --epoll      Serve all connections from a single epoll event"
+       << std::endl
+       << "               loop instead of a thread pool (Linux only)."
+       << std::endl
+       << "  --uring      As --epoll, but send through io_uring where the"
+       << std::endl
+       << "               kernel supports it." << std::endl
+       << "  --threads=N  Number of worker threads (default "
+       << DEFAULT_THREADS << ")." << std::endl
+       << "  --queue=N    Accepted connections which may wait for a worker"
+       << std::endl
+       << "               (default " << DEFAULT_QUEUE << ")." << std::endl
+       << "  --cache=MB   Memory budget for mapped files, 0 to disable"
+       << std::endl
+       << "               (default " << DEFAULT_CACHE_MB << ")." << std::endl
+       << "  --log=LEVEL  Least severe messages to log: debug, info, warning"
+       << std::endl
+       << "               or error (default info)." << std::endl
+       << "  --listeners=N  Listening sockets sharing the port with"
+       << std::endl
+       << "               SO_REUSEPORT, each with its own accept loop and"
+       << std::endl
+       << "               threads or event loop; 0 for one per CPU"
+       << std::endl
+       << "               (default 1)." << std::endl
+       << "  --pin        Pin each listener's accept loop or event loop to"
+       << std::endl
+       << "               its own CPU." << std::endl
+       << "  --backlog=N  Connections which may wait to be accepted, per"
+       << std::endl
+       << "               listener (default " << DEFAULT_BACKLOG << ")."
+       << std::endl
+       << "  --defer-accept=S  Don't wake for a connection until it has"
+       << std::endl
+       << "               sent its request, or S seconds have passed"
+       << std::endl
+       << "               (Linux only)." << std::endl
+       << "  --fastopen=N  Accept requests in the SYN with TCP Fast Open,"
+       << std::endl
+       << "               with up to N such connections pending." << std::endl;
+}
+
+// Stops the process-wide services started by main(), once no connections
+// remain.
+static void ShutdownServices()
+{
+  Socket::Shutdown();
+  FileCache::Shutdown();
+  MetadataCache::Shutdown();
+  ListingCache::Shutdown();
+  LiveFanout::Shutdown();
+  GzipCache::Shutdown();
+  Stats::Shutdown();
+  Log::Shutdown();
+  BufferPool::Shutdown();
+}
 
+// If aArg is "--aName=N" with N >= aMin, stores N in aValue and returns
+// true.
+static bool ParseCount(const string& aArg,
+                       const char* aName,
+                       unsigned& aValue,
+                       int aMin = 1)
+{
+  string prefix = string("--") + aName + "=";
+  if (aArg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  int value = atoi(aArg.c_str() + prefix.size());
+  if (value < aMin) {
+    return false;
+  }
+  aValue = (unsigned)value;
+  return true;
+}
 
 int main(int argc, char* argv[])
 {
+  bool useReactor = false;
+  bool useRing = false;
+  unsigned threads = DEFAULT_THREADS;
+  unsigned queue = DEFAULT_QUEUE;
+  unsigned cacheMB = DEFAULT_CACHE_MB;
+  unsigned listeners = 1;
+  unsigned backlog = DEFAULT_BACKLOG;
+  unsigned deferAccept = 0;
+  unsigned fastOpen = 0;
+  bool pin = false;
+  eLogLevel logLevel = LOG_INFO;
+  for (int i = 1; i < argc; i++) {
+    string arg(argv[i]);
+    if (arg == "--epoll") {
+      useReactor = true;
+    } else if (arg == "--uring") {
+      useReactor = true;
+      useRing = true;
+    } else if (arg == "--pin") {
+      pin = true;
+    } else if (arg.compare(0, 6, "--log=") == 0 &&
+               Log::ParseLevel(arg.substr(6), logLevel)) {
+      continue;
+    } else if (ParseCount(arg, "threads", threads) ||
+               ParseCount(arg, "queue", queue) ||
+               ParseCount(arg, "cache", cacheMB, 0) ||
+               ParseCount(arg, "listeners", listeners, 0) ||
+               ParseCount(arg, "backlog", backlog) ||
+               ParseCount(arg, "defer-accept", deferAccept) ||
+               ParseCount(arg, "fastopen", fastOpen)) {
+      continue;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (useReactor && !Reactor::IsSupported()) {
+    cerr << (useRing ? "--uring" : "--epoll")
+         << " is not supported on this platform" << std::endl;
+    return 1;
+  }
+  if (listeners == 0) {
+    listeners = GetProcessorCount();
+  }
+
+  BufferPool::Init();
+  FileCache::Init((int64_t)cacheMB * 1024 * 1024);
+  MetadataCache::Init();
+  ListingCache::Init();
+  LiveFanout::Init();
+  GzipCache::Init();
+  Stats::Init();
+
 #ifdef _DEBUG
+  Log::Test();
+  BufferPool::Test();
+  FileCache::Test();
+  MetadataCache::Test();
+  ListingCache::Test();
+  LiveFanout::Test();
+  GzipCache::Test();
+  Stats::Test();
   RequestParser::Test();
   Response::Test();
+  Histogram::Test();
+  IoRing::Test();
+  TimerWheel::Test();
   Thread_Test();
+  ThreadPool::Test();
+  TokenBucket::Test();
 #endif
 
+  Log::Init(logLevel);
+
   signal(SIGINT, sighandler);
 #ifdef SIGQUIT
   signal(SIGQUIT, sighandler);
 #endif
+#ifdef SIGPIPE
+  // Writes to a disconnected client should fail, not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+#endif
 
   Socket::Init();
 
-  auto_ptr<Socket> listener(Socket::Open(PORT));
-  if (!listener.get()) {
-    Socket::Shutdown();
-    return 1;
+  // Open every socket before serving any, so a failure leaves nothing to
+  // stop. Worker threads and queue slots are divided between the shards.
+  unsigned shardThreads = (threads + listeners - 1) / listeners;
+  unsigned shardQueue = (queue + listeners - 1) / listeners;
+  Socket::ListenOptions options;
+  options.mBacklog = backlog;
+  options.mReusePort = listeners > 1;
+  options.mDeferAccept = deferAccept;
+  options.mFastOpen = fastOpen;
+  vector<ServerShard*> shards;
+  for (unsigned i = 0; i < listeners; i++) {
+    Socket* listener = Socket::Open(PORT, options);
+    if (!listener) {
+      break;
+    }
+    if (i == 0) {
+      cout << "Local IP: " << listener->GetIP().c_str() << std::endl;
+    }
+    int cpu = pin ? (int)(i % GetProcessorCount()) : -1;
+    shards.push_back(new ServerShard(listener, useReactor, useRing,
+                                     shardThreads, shardQueue, cpu));
   }
-
-  cout << "Local IP: " << listener->GetIP().c_str() << std::endl;
-  cout << "Now listening on port: " << PORT << std::endl;
-
-  vector<Connection*> Connections;
-  while (gRunning) {
-    // Accept a single connection.
-    Socket* client = listener->Accept();
-    if (!client) {
-      continue;
+  bool ok = shards.size() == listeners;
+  if (ok) {
+    cout << "Now listening on port: " << PORT;
+    if (listeners > 1) {
+      cout << " (" << listeners << " listeners)";
     }
+    cout << std::endl;
 
-    Connection *c = new Connection(client);
-    c->Start();
-    Connections.push_back(c);
+    // The first shard runs on this thread.
+    vector<Thread*> running;
+    for (unsigned i = 1; i < shards.size(); i++) {
+      running.push_back(Thread::Create(shards[i]));
+      running.back()->Start();
+    }
+    shards[0]->Run();
+    for (unsigned i = 0; i < running.size(); i++) {
+      running[i]->Join();
+      delete running[i];
+    }
+  }
+  for (unsigned i = 0; i < shards.size(); i++) {
+    ok = ok && shards[i]->Ok();
+    delete shards[i];
   }
 
-  Socket::Shutdown();
-  
-  return 0;
+  ShutdownServices();
+  return ok ? 0 : 1;
 }
+
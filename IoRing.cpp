@@ -0,0 +1,735 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "IoRing.h"
+#include "Log.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Submission queue entries. Each send takes one, or two for a file
+// segment, and the queue is submitted early if it fills.
+#define RING_ENTRIES 256
+
+// The request a completion is for is encoded in its user data, above the
+// slot number.
+#define OP_WRITE 1
+#define OP_READ 2
+#define USER_DATA(op, slot) (((uint64_t)(op) << 32) | (uint32_t)(slot))
+
+static int SetupRing(unsigned aEntries, struct io_uring_params* aParams) {
+  return (int)syscall(__NR_io_uring_setup, aEntries, aParams);
+}
+
+static int EnterRing(int aRing, unsigned aSubmit) {
+  return (int)syscall(__NR_io_uring_enter, aRing, aSubmit, 0, 0, 0, 0);
+}
+
+static int RegisterRing(int aRing, unsigned aOpcode, void* aArg,
+                        unsigned aCount)
+{
+  return (int)syscall(__NR_io_uring_register, aRing, aOpcode, aArg, aCount);
+}
+
+// A connected socket whose sends go through an IoRing. At most one send
+// is in flight at a time, in a registered buffer; until it completes
+// further sends report WOULD_BLOCK, so data always leaves in order, and
+// once it has completed the socket's user data is reported as ready by
+// IoRing::Reap(). A failed send is reported by the next call.
+class RingSocket : public Socket {
+public:
+  RingSocket(IoRing* aRing, Socket* aSocket, void* aUserData);
+  ~RingSocket();
+  bool WaitForConnection();
+  Socket* Accept(bool aNonBlocking);
+  void Close();
+  int Send(const char* aBuf, int aSize);
+  int Send(const char* aBuf, int aSize, const char* aBuf2, int aSize2);
+  int SendMore(const char* aBuf, int aSize);
+  int Receive(char* aBuf, int aSize);
+  int64_t SendFile(int aFile, int64_t& aOffset, int64_t aLength);
+  bool SetNonBlocking(bool aNonBlocking);
+
+  // Called by the ring for each completion of a request in our slot.
+  void Completed(int aOp, int aResult, std::vector<void*>& aReady);
+
+private:
+  // Returns WOULD_BLOCK while a send is in flight, -1 if the last one
+  // failed, or 0 if we're free to send.
+  int CheckInFlight();
+
+  // Copies aBuf and aBuf2 into a registered buffer and queues them to be
+  // sent. Returns false if no buffer is free.
+  bool Queue(const char* aBuf, int aSize, const char* aBuf2, int aSize2);
+
+  IoRing* mRing;
+  // The socket we send through, or null once closed.
+  Socket* mWrapped;
+  void* mUserData;
+  // The slot holding the send in flight, or -1 if there is none.
+  int mSlot;
+  // Bytes of the slot sent so far, and in all.
+  int mSent;
+  int mLength;
+  bool mFailed;
+  // Whether we've returned WOULD_BLOCK since the send was queued.
+  bool mBlocked;
+};
+
+RingSocket::RingSocket(IoRing* aRing, Socket* aSocket, void* aUserData)
+  : Socket(aSocket->GetDescriptor()),
+    mRing(aRing),
+    mWrapped(aSocket),
+    mUserData(aUserData),
+    mSlot(-1),
+    mSent(0),
+    mLength(0),
+    mFailed(false),
+    mBlocked(false)
+{
+}
+
+RingSocket::~RingSocket() {
+  Close();
+}
+
+bool RingSocket::WaitForConnection() {
+  return false;
+}
+
+Socket* RingSocket::Accept(bool) {
+  return 0;
+}
+
+void RingSocket::Close() {
+  mRing->Forget(mUserData);
+  if (mSlot != -1) {
+    // Requests in flight refer to the socket by its descriptor, which
+    // mustn't be reused before they complete, so leave the ring to close
+    // it. What's already been queued is still sent.
+    mRing->ReleaseSlot(mSlot, mWrapped);
+    mSlot = -1;
+  } else {
+    delete mWrapped;
+  }
+  mWrapped = 0;
+  mSocket = 0;
+}
+
+int RingSocket::CheckInFlight() {
+  if (mSlot != -1) {
+    mBlocked = true;
+    return WOULD_BLOCK;
+  }
+  return (mFailed || !mWrapped) ? -1 : 0;
+}
+
+bool RingSocket::Queue(const char* aBuf, int aSize,
+                       const char* aBuf2, int aSize2)
+{
+  int slot = mRing->AllocSlot(this);
+  if (slot == -1) {
+    return false;
+  }
+  char* data = mRing->SlotData(slot);
+  memcpy(data, aBuf, aSize);
+  if (aSize2 > 0) {
+    memcpy(data + aSize, aBuf2, aSize2);
+  }
+  if (!mRing->QueueWrite(mSocket, slot, 0, aSize + aSize2)) {
+    mRing->ReleaseSlot(slot);
+    return false;
+  }
+  mSlot = slot;
+  mSent = 0;
+  mLength = aSize + aSize2;
+  return true;
+}
+
+int RingSocket::Send(const char* aBuf, int aSize) {
+  int r = CheckInFlight();
+  if (r != 0) {
+    return r;
+  }
+  if (aSize > 0 && aSize <= IoRing::SLOT_SIZE &&
+      Queue(aBuf, aSize, 0, 0)) {
+    return aSize;
+  }
+  return mWrapped->Send(aBuf, aSize);
+}
+
+int RingSocket::Send(const char* aBuf, int aSize,
+                     const char* aBuf2, int aSize2)
+{
+  int r = CheckInFlight();
+  if (r != 0) {
+    return r;
+  }
+  if (aSize > 0 && aSize + aSize2 <= IoRing::SLOT_SIZE &&
+      Queue(aBuf, aSize, aBuf2, aSize2)) {
+    return aSize + aSize2;
+  }
+  return mWrapped->Send(aBuf, aSize, aBuf2, aSize2);
+}
+
+int RingSocket::SendMore(const char* aBuf, int aSize) {
+  // Headers ahead of a file body; sent directly, so the kernel can put
+  // them in the same packet as its start.
+  int r = CheckInFlight();
+  return r != 0 ? r : mWrapped->SendMore(aBuf, aSize);
+}
+
+int RingSocket::Receive(char* aBuf, int aSize) {
+  return mWrapped ? mWrapped->Receive(aBuf, aSize) : -1;
+}
+
+int64_t RingSocket::SendFile(int aFile, int64_t& aOffset, int64_t aLength) {
+  int r = CheckInFlight();
+  if (r != 0) {
+    return r;
+  }
+  if (aLength <= 0 || aLength > IoRing::SLOT_SIZE) {
+    return mWrapped->SendFile(aFile, aOffset, aLength);
+  }
+  // The segment is read into a slot and sent from there, without
+  // blocking on the disk. If the file turns out to be shorter, the send
+  // fails, as it would have for a file truncated under sendfile().
+  int slot = mRing->AllocSlot(this);
+  if (slot == -1) {
+    return mWrapped->SendFile(aFile, aOffset, aLength);
+  }
+  if (!mRing->QueueReadWrite(aFile, aOffset, mSocket, slot, (int)aLength)) {
+    mRing->ReleaseSlot(slot);
+    return mWrapped->SendFile(aFile, aOffset, aLength);
+  }
+  mSlot = slot;
+  mSent = 0;
+  mLength = (int)aLength;
+  aOffset += aLength;
+  return aLength;
+}
+
+bool RingSocket::SetNonBlocking(bool aNonBlocking) {
+  return mWrapped && mWrapped->SetNonBlocking(aNonBlocking);
+}
+
+void RingSocket::Completed(int aOp, int aResult, std::vector<void*>& aReady)
+{
+  if (aOp == OP_READ) {
+    if (aResult != mLength) {
+      // A short read also cancels the linked write.
+      mFailed = true;
+    }
+  } else if (aResult < 0) {
+    if (aResult != -ECANCELED) {
+      LOG(LOG_DEBUG, "Ring send failed: %s", strerror(-aResult));
+    }
+    mFailed = true;
+  } else if (!mFailed) {
+    mSent += aResult;
+    if (aResult > 0 && mSent < mLength) {
+      // The socket took only part; queue the rest.
+      if (mRing->QueueWrite(mSocket, mSlot, mSent, mLength - mSent)) {
+        return;
+      }
+    }
+    if (mSent < mLength) {
+      mFailed = true;
+    }
+  }
+  if (mRing->mSlots[mSlot].mInFlight > 0) {
+    // The write linked to a read is still to complete.
+    return;
+  }
+  mRing->ReleaseSlot(mSlot);
+  mSlot = -1;
+  if (mBlocked) {
+    mBlocked = false;
+    aReady.push_back(mUserData);
+  }
+}
+
+IoRing::IoRing(int aRing)
+  : mRing(aRing),
+    mSqMap(MAP_FAILED),
+    mSqMapSize(0),
+    mCqMap(MAP_FAILED),
+    mCqMapSize(0),
+    mEntries(MAP_FAILED),
+    mEntriesSize(0),
+    mQueued(0),
+    mBuffers((char*)MAP_FAILED),
+    mSlots(SLOT_COUNT)
+{
+}
+
+IoRing::~IoRing() {
+  // Closing the ring cancels whatever is still in flight, after which the
+  // sockets left to us may be closed.
+  close(mRing);
+  for (size_t i = 0; i < mSlots.size(); i++) {
+    delete mSlots[i].mSocket;
+  }
+  if (mBuffers != MAP_FAILED) {
+    munmap(mBuffers, (size_t)SLOT_COUNT * SLOT_SIZE);
+  }
+  if (mEntries != MAP_FAILED) {
+    munmap(mEntries, mEntriesSize);
+  }
+  if (mCqMap != MAP_FAILED && mCqMap != mSqMap) {
+    munmap(mCqMap, mCqMapSize);
+  }
+  if (mSqMap != MAP_FAILED) {
+    munmap(mSqMap, mSqMapSize);
+  }
+}
+
+IoRing* IoRing::Create() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = SetupRing(RING_ENTRIES, &params);
+  if (fd < 0) {
+    LOG(LOG_INFO, "io_uring unavailable: %s", strerror(errno));
+    return 0;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  IoRing* ring = new IoRing(fd);
+  if (!ring->Map(&params)) {
+    delete ring;
+    return 0;
+  }
+  return ring;
+}
+
+bool IoRing::Map(const void* aParams) {
+  const struct io_uring_params* p =
+    static_cast<const struct io_uring_params*>(aParams);
+  // Fixed buffers on sockets need the kernel to poll internally for
+  // space, rather than fail, when the socket would block.
+  if (!(p->features & IORING_FEAT_FAST_POLL)) {
+    LOG(LOG_INFO, "io_uring too old to send on sockets");
+    return false;
+  }
+
+  mSqMapSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  mCqMapSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (p->features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single) {
+    mSqMapSize = mCqMapSize = MAX(mSqMapSize, mCqMapSize);
+  }
+  mSqMap = mmap(0, mSqMapSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_SQ_RING);
+  if (mSqMap == MAP_FAILED) {
+    LOG(LOG_WARNING, "Can't map io_uring: %s", strerror(errno));
+    return false;
+  }
+  mCqMap = single ? mSqMap
+                  : mmap(0, mCqMapSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, mRing,
+                         IORING_OFF_CQ_RING);
+  mEntriesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+  mEntries = mmap(0, mEntriesSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_SQES);
+  if (mCqMap == MAP_FAILED || mEntries == MAP_FAILED) {
+    LOG(LOG_WARNING, "Can't map io_uring: %s", strerror(errno));
+    return false;
+  }
+
+  char* sq = static_cast<char*>(mSqMap);
+  mSqHead = (unsigned*)(sq + p->sq_off.head);
+  mSqTail = (unsigned*)(sq + p->sq_off.tail);
+  mSqMask = *(unsigned*)(sq + p->sq_off.ring_mask);
+  mSqArray = (unsigned*)(sq + p->sq_off.array);
+  char* cq = static_cast<char*>(mCqMap);
+  mCqHead = (unsigned*)(cq + p->cq_off.head);
+  mCqTail = (unsigned*)(cq + p->cq_off.tail);
+  mCqMask = *(unsigned*)(cq + p->cq_off.ring_mask);
+  mCqes = cq + p->cq_off.cqes;
+
+  // The buffers are pinned in memory while registered, which counts
+  // against RLIMIT_MEMLOCK.
+  size_t size = (size_t)SLOT_COUNT * SLOT_SIZE;
+  mBuffers = (char*)mmap(0, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mBuffers == MAP_FAILED) {
+    return false;
+  }
+  std::vector<struct iovec> iov(SLOT_COUNT);
+  for (int i = 0; i < SLOT_COUNT; i++) {
+    iov[i].iov_base = SlotData(i);
+    iov[i].iov_len = SLOT_SIZE;
+  }
+  if (RegisterRing(mRing, IORING_REGISTER_BUFFERS, &iov[0], SLOT_COUNT) < 0) {
+    LOG(LOG_WARNING, "Can't register io_uring buffers: %s", strerror(errno));
+    return false;
+  }
+  for (int i = SLOT_COUNT - 1; i >= 0; i--) {
+    mFreeSlots.push_back(i);
+  }
+  return true;
+}
+
+Socket* IoRing::Wrap(Socket* aSocket, void* aUserData) {
+  return new RingSocket(this, aSocket, aUserData);
+}
+
+int IoRing::AllocSlot(RingSocket* aOwner) {
+  if (mFreeSlots.empty()) {
+    // Most of what's in flight has usually completed as soon as it was
+    // submitted, so submit and collect it to free its slots.
+    Submit();
+    Collect();
+    if (mFreeSlots.empty()) {
+      return -1;
+    }
+  }
+  int slot = mFreeSlots.back();
+  mFreeSlots.pop_back();
+  mSlots[slot].mOwner = aOwner;
+  return slot;
+}
+
+void IoRing::ReleaseSlot(int aSlot, Socket* aSocket) {
+  Slot& s = mSlots[aSlot];
+  s.mOwner = 0;
+  s.mSocket = aSocket;
+  if (s.mInFlight == 0) {
+    delete s.mSocket;
+    s.mSocket = 0;
+    mFreeSlots.push_back(aSlot);
+  }
+}
+
+void* IoRing::NextEntry(unsigned aCount) {
+  if (FreeEntries() < aCount) {
+    Submit();
+    if (FreeEntries() < aCount) {
+      return 0;
+    }
+  }
+  unsigned index = *mSqTail & mSqMask;
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(mEntries);
+  memset(sqe + index, 0, sizeof(*sqe));
+  mSqArray[index] = index;
+  return sqe + index;
+}
+
+unsigned IoRing::FreeEntries() const {
+  return mSqMask + 1 -
+         (*mSqTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE));
+}
+
+void IoRing::Push(void* aEntry) {
+  struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(aEntry);
+  mSlots[sqe->buf_index].mInFlight++;
+  __atomic_store_n(mSqTail, *mSqTail + 1, __ATOMIC_RELEASE);
+  mQueued++;
+}
+
+bool IoRing::QueueWrite(int aFd, int aSlot, int aOffset, int aLength) {
+  struct io_uring_sqe* sqe =
+    static_cast<struct io_uring_sqe*>(NextEntry(1));
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = aFd;
+  sqe->addr = (uint64_t)(uintptr_t)(SlotData(aSlot) + aOffset);
+  sqe->len = aLength;
+  sqe->buf_index = aSlot;
+  sqe->user_data = USER_DATA(OP_WRITE, aSlot);
+  Push(sqe);
+  return true;
+}
+
+bool IoRing::QueueReadWrite(int aFile, int64_t aFileOffset, int aFd,
+                            int aSlot, int aLength)
+{
+  // The two entries mustn't be split between submissions.
+  struct io_uring_sqe* sqe =
+    static_cast<struct io_uring_sqe*>(NextEntry(2));
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->fd = aFile;
+  sqe->off = (uint64_t)aFileOffset;
+  sqe->addr = (uint64_t)(uintptr_t)SlotData(aSlot);
+  sqe->len = aLength;
+  sqe->buf_index = aSlot;
+  sqe->user_data = USER_DATA(OP_READ, aSlot);
+  Push(sqe);
+  QueueWrite(aFd, aSlot, 0, aLength);
+  // Unlike the socket, the file may be closed by its owner as soon as we
+  // return, so the kernel must take its reference now.
+  Submit();
+  return true;
+}
+
+bool IoRing::Submit() {
+  while (mQueued > 0) {
+    int r = EnterRing(mRing, mQueued);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(LOG_WARNING, "io_uring_enter failed: %s", strerror(errno));
+      return false;
+    }
+    if (r == 0) {
+      break;
+    }
+    mQueued -= r;
+  }
+  return true;
+}
+
+void IoRing::Reap(std::vector<void*>& aReady) {
+  Collect();
+  aReady.insert(aReady.end(), mReady.begin(), mReady.end());
+  mReady.clear();
+}
+
+void IoRing::Forget(void* aUserData) {
+  mReady.erase(std::remove(mReady.begin(), mReady.end(), aUserData),
+               mReady.end());
+}
+
+void IoRing::Collect() {
+  unsigned head = *mCqHead;
+  unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const struct io_uring_cqe* cqe =
+      static_cast<const struct io_uring_cqe*>(mCqes) + (head & mCqMask);
+    int op = (int)(cqe->user_data >> 32);
+    int slot = (int)(uint32_t)cqe->user_data;
+    int result = cqe->res;
+    // Let the kernel reuse the entry before we queue more.
+    __atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+    Slot& s = mSlots[slot];
+    s.mInFlight--;
+    if (s.mOwner) {
+      s.mOwner->Completed(op, result, mReady);
+    } else if (s.mInFlight == 0) {
+      ReleaseSlot(slot, s.mSocket);
+    }
+  }
+}
+
+#ifdef _DEBUG
+
+#include <poll.h>
+
+// A bare connected socket, as accepted by the reactor.
+class TestSocket : public Socket {
+public:
+  TestSocket(int aSocket) : Socket(aSocket) {}
+  ~TestSocket() { Close(); }
+  bool WaitForConnection() { return false; }
+  Socket* Accept(bool) { return 0; }
+  void Close() {
+    if (mSocket != -1) {
+      close(mSocket);
+      mSocket = -1;
+    }
+  }
+  int Send(const char* aBuf, int aSize) {
+    int r = (int)send(mSocket, aBuf, aSize, MSG_NOSIGNAL);
+    return (r < 0 && errno == EAGAIN) ? WOULD_BLOCK : r;
+  }
+  int Send(const char* aBuf, int aSize, const char* aBuf2, int aSize2) {
+    int r = Send(aBuf, aSize);
+    return r == aSize ? r + Send(aBuf2, aSize2) : r;
+  }
+  int SendMore(const char* aBuf, int aSize) { return Send(aBuf, aSize); }
+  int Receive(char* aBuf, int aSize) {
+    return (int)read(mSocket, aBuf, aSize);
+  }
+  int64_t SendFile(int, int64_t&, int64_t) { return -1; }
+  bool SetNonBlocking(bool) { return true; }
+};
+
+// Waits for completions and returns how many sockets became ready.
+static size_t WaitForRing(IoRing* aRing) {
+  std::vector<void*> ready;
+  struct pollfd fds;
+  fds.fd = aRing->GetDescriptor();
+  fds.events = POLLIN;
+  if (poll(&fds, 1, 1000) == 1) {
+    aRing->Reap(ready);
+  }
+  return ready.size();
+}
+
+// Reads exactly aLength bytes from aFd, or returns an empty string.
+static string ReadExactly(int aFd, size_t aLength) {
+  string s(aLength, '\0');
+  size_t got = 0;
+  while (got < aLength) {
+    int r = (int)read(aFd, &s[got], aLength - got);
+    if (r <= 0) {
+      return string();
+    }
+    got += r;
+  }
+  return s;
+}
+
+void IoRing::Test() {
+  IoRing* ring = Create();
+  if (!ring) {
+    return;
+  }
+  int fds[2];
+  int r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(r == 0);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  int tag = 0;
+  Socket* s = ring->Wrap(new TestSocket(fds[0]), &tag);
+
+  // A queued send blocks those which follow until it completes.
+  int64_t offset = 0;
+  assert(s->Send("hello", 5) == 5);
+  assert(s->Send("world", 5) == Socket::WOULD_BLOCK);
+  assert(s->SendFile(0, offset, 5) == Socket::WOULD_BLOCK);
+  assert(ring->Submit());
+  assert(WaitForRing(ring) == 1);
+  assert(s->Send("head", 4, "body", 4) == 8);
+  assert(ring->Submit());
+  // Nothing was blocked on this one.
+  assert(WaitForRing(ring) == 0);
+  assert(ReadExactly(fds[1], 13) == "helloheadbody");
+
+  // File segments are read into the slot and sent from there.
+  const char* path = "IoRingTest.tmp";
+  FILE* f = fopen(path, "wb");
+  fputs("0123456789", f);
+  fclose(f);
+  int file = open(path, O_RDONLY);
+  offset = 2;
+  assert(s->SendFile(file, offset, 5) == 5);
+  assert(offset == 7);
+  WaitForRing(ring);
+  assert(ReadExactly(fds[1], 5) == "23456");
+
+  // A segment past the end of the file fails the next send.
+  offset = 8;
+  assert(s->SendFile(file, offset, 5) == 5);
+  WaitForRing(ring);
+  assert(s->Send("x", 1) == -1);
+  close(file);
+  remove(path);
+
+  // A failed socket stays failed, so carry on with a fresh one. A send
+  // the socket only takes part of at a time is completed.
+  fds[0] = dup(fds[0]);
+  delete s;
+  s = ring->Wrap(new TestSocket(fds[0]), &tag);
+  int small = 4096;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+  string big(SLOT_SIZE, 'a');
+  big[SLOT_SIZE - 1] = 'z';
+  assert(s->Send(big.c_str(), SLOT_SIZE) == SLOT_SIZE);
+  assert(s->Send("!", 1) == Socket::WOULD_BLOCK);
+  assert(ring->Submit());
+  size_t ready = 0;
+  string received;
+  while (received.size() < big.size()) {
+    char buf[4096];
+    int n = (int)read(fds[1], buf, sizeof(buf));
+    assert(n > 0);
+    received.append(buf, n);
+    ready += WaitForRing(ring);
+    ring->Submit();
+  }
+  assert(received == big);
+  ready += WaitForRing(ring);
+  assert(ready == 1);
+
+  // A socket closed with a send in flight is closed once it completes.
+  assert(s->Send("bye", 3) == 3);
+  delete s;
+  assert(ring->Submit());
+  WaitForRing(ring);
+  assert(ReadExactly(fds[1], 3) == "bye");
+  char c;
+  assert(read(fds[1], &c, 1) == 0);
+  close(fds[1]);
+  delete ring;
+}
+
+#endif
+
+#else
+
+IoRing* IoRing::Create() {
+  return 0;
+}
+
+IoRing::~IoRing() {
+}
+
+Socket* IoRing::Wrap(Socket* aSocket, void* aUserData) {
+  return aSocket;
+}
+
+bool IoRing::Submit() {
+  return true;
+}
+
+void IoRing::Reap(std::vector<void*>& aReady) {
+}
+
+#ifdef _DEBUG
+void IoRing::Test() {
+}
+#endif
+
+#endif
@@ -0,0 +1,173 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __IO_RING_H__
+#define __IO_RING_H__
+
+#include <vector>
+
+#include "Sockets.h"
+
+class RingSocket;
+
+// An io_uring submission and completion queue, with a pool of registered
+// buffers, through which an event loop sends for all its connections.
+// Small sends and file segments are copied or read into a registered
+// buffer and queued, and everything queued in one pass of the loop is
+// handed to the kernel with a single system call, rather than one
+// send() or sendfile() per connection. Larger transfers, receives and
+// accepts still use the socket directly. Linux only; Create() returns null
+// where io_uring is unavailable, and the caller carries on without it.
+// Not thread safe; the ring and its sockets belong to one event loop.
+class IoRing {
+public:
+  // Size of each registered buffer; larger sends bypass the ring.
+  static const int SLOT_SIZE = 16 * 1024;
+
+  // Number of registered buffers, and so of sends which may be in flight.
+  static const int SLOT_COUNT = 256;
+
+  // Sets up a ring, or returns null if the kernel doesn't support it.
+  static IoRing* Create();
+
+  // Sockets wrapped by the ring must be destroyed first.
+  ~IoRing();
+
+  // Returns a socket which sends through this ring, taking ownership of
+  // aSocket. aUserData is reported by Reap() when the socket can send
+  // again after returning WOULD_BLOCK because a send was in flight.
+  Socket* Wrap(Socket* aSocket, void* aUserData);
+
+  // Returns the ring's descriptor, which polls readable while there are
+  // completions to reap.
+  int GetDescriptor() const {
+    return mRing;
+  }
+
+  // Hands everything queued since the last call to the kernel. Returns
+  // false on failure.
+  bool Submit();
+
+  // Processes completed requests, requeueing the rest of partial sends,
+  // and appends the user data of each socket which is ready to send
+  // again.
+  void Reap(std::vector<void*>& aReady);
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  friend class RingSocket;
+
+  IoRing(int aRing);
+
+  bool Map(const void* aParams);
+
+  // Claims a registered buffer for aOwner, or returns -1 if all are in
+  // use.
+  int AllocSlot(RingSocket* aOwner);
+
+  // Returns a registered buffer's memory.
+  char* SlotData(int aSlot) const {
+    return mBuffers + (size_t)aSlot * SLOT_SIZE;
+  }
+
+  // Gives up aSlot, which is freed once its last request completes. If
+  // aSocket is non-null it's the owner's socket, which its requests may
+  // still refer to, so it's deleted then too.
+  void ReleaseSlot(int aSlot, Socket* aSocket = 0);
+
+  // Queues a write of aLength bytes at aOffset in aSlot to aFd. Returns
+  // false if the submission queue is full and can't be submitted.
+  bool QueueWrite(int aFd, int aSlot, int aOffset, int aLength);
+
+  // Reads aLength bytes at aFileOffset in aFile into aSlot, and writes
+  // them to aFd once the read has succeeded. Returns false as
+  // QueueWrite().
+  bool QueueReadWrite(int aFile, int64_t aFileOffset, int aFd, int aSlot,
+                      int aLength);
+
+  // Processes completed requests, keeping the user data of ready sockets
+  // for the next Reap().
+  void Collect();
+
+  // Drops aUserData from those to be reported by the next Reap(), as its
+  // socket is closing.
+  void Forget(void* aUserData);
+
+  // Returns the first of aCount free submission queue entries, submitting
+  // what's queued if there aren't enough, or null if there still aren't.
+  void* NextEntry(unsigned aCount);
+
+  unsigned FreeEntries() const;
+
+  // Makes a filled in entry visible to the kernel, to be submitted by the
+  // next Submit().
+  void Push(void* aEntry);
+
+  struct Slot {
+    Slot() : mOwner(0), mInFlight(0), mSocket(0) {}
+    RingSocket* mOwner;
+    int mInFlight;
+    Socket* mSocket;
+  };
+
+  int mRing;
+
+  // Shared ring memory.
+  void* mSqMap;
+  size_t mSqMapSize;
+  void* mCqMap;
+  size_t mCqMapSize;
+  void* mEntries;
+  size_t mEntriesSize;
+
+  // Pointers into the shared rings.
+  unsigned* mSqHead;
+  unsigned* mSqTail;
+  unsigned mSqMask;
+  unsigned* mSqArray;
+  unsigned* mCqHead;
+  unsigned* mCqTail;
+  unsigned mCqMask;
+  void* mCqes;
+
+  // Entries filled in but not yet submitted.
+  unsigned mQueued;
+
+  char* mBuffers;
+  std::vector<Slot> mSlots;
+  std::vector<int> mFreeSlots;
+  std::vector<void*> mReady;
+};
+
+#endif
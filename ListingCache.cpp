@@ -0,0 +1,354 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "GzipCache.h"
+#include "ListingCache.h"
+#include "MetadataCache.h"
+#include "PathEnumerator.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// Most directories whose listings are cached.
+#define MAX_DIRECTORIES 64
+
+// Most entries in a cached directory; larger directories are streamed.
+#define MAX_NAMES 10000
+
+// Most renderings with a suffix or compression cached per directory.
+#define MAX_VARIANTS 8
+
+ListingCache* ListingCache::sInstance = 0;
+
+ListingCache::ListingCache()
+  : mMonitor(Monitor::Create())
+{
+}
+
+ListingCache::~ListingCache() {
+  InvalidateAll();
+  delete mMonitor;
+}
+
+void ListingCache::Init() {
+  if (!sInstance && MetadataCache::Get()) {
+    sInstance = new ListingCache();
+  }
+}
+
+void ListingCache::Shutdown() {
+  delete sInstance;
+  sInstance = 0;
+}
+
+string ListingCache::Render(const string& aDir,
+                            const std::set<string>& aNames,
+                            vector<size_t>* aLinkEnds)
+{
+  string prefix = (aDir.empty() ? string(".") : aDir) + "/";
+  string html("<!DOCTYPE html>\n<ul>");
+  std::set<string>::const_iterator itr = aNames.begin();
+  for (; itr != aNames.end(); itr++) {
+    html.append("<li><a href=\"");
+    html.append(prefix);
+    html.append(*itr);
+    if (aLinkEnds) {
+      aLinkEnds->push_back(html.size());
+    }
+    html.append("\">");
+    html.append(*itr);
+    html.append("</a></li>");
+  }
+  html.append("</ul>");
+  return html;
+}
+
+bool ListingCache::ReadNames(const string& aDir,
+                             std::set<string>& aNames,
+                             size_t aMax)
+{
+  bool top = aDir.empty() || aDir == ".";
+  PathEnumerator* enumerator = PathEnumerator::getEnumerator(aDir);
+  if (!enumerator) {
+    return true;
+  }
+  string name;
+  bool fits = true;
+  while (enumerator->next(name)) {
+    if (name != "." && !(top && name == "..")) {
+      if (aNames.size() == aMax) {
+        fits = false;
+        break;
+      }
+      aNames.insert(name);
+    }
+  }
+  delete enumerator;
+  return fits;
+}
+
+ListingCache::Listing* ListingCache::Acquire(const string& aDir,
+                                             const string& aSuffix,
+                                             bool aGzip)
+{
+  // Watch before reading the names, so a change in between isn't missed.
+  // That takes MetadataCache's lock, which is held while it calls us, so
+  // it mustn't be taken with our lock held.
+  string key;
+  if (!MetadataCache::Get()->WatchDirectory(aDir, key)) {
+    return 0;
+  }
+
+  MonitorAutoLock lock(mMonitor);
+  Directory* dir;
+  std::map<string, Directory*>::iterator itr = mDirectories.find(key);
+  if (itr != mDirectories.end()) {
+    dir = itr->second;
+    mLRU.splice(mLRU.begin(), mLRU, dir->mLRU);
+  } else {
+    // Read under the lock, so notifications which arrive meanwhile are
+    // applied to the names afterwards rather than lost.
+    dir = new Directory();
+    dir->mPlain = 0;
+    dir->mTooLarge =
+      !ReadNames(key.empty() ? "." : key, dir->mNames, MAX_NAMES);
+    if (dir->mTooLarge) {
+      dir->mNames.clear();
+    }
+    mLRU.push_front(key);
+    dir->mLRU = mLRU.begin();
+    mDirectories[key] = dir;
+    while (mDirectories.size() > MAX_DIRECTORIES) {
+      Remove(mLRU.back());
+    }
+  }
+
+  if (dir->mTooLarge) {
+    return 0;
+  }
+  if (!dir->mPlain) {
+    dir->mLinkEnds.clear();
+    dir->mPlain = new Listing();
+    dir->mPlain->mData = Render(key, dir->mNames, &dir->mLinkEnds);
+  }
+  Listing* listing = dir->mPlain;
+  if (!aSuffix.empty() || aGzip) {
+    string variant = aSuffix + (aGzip ? "\ngzip" : "");
+    std::map<string, Listing*>::iterator v = dir->mVariants.find(variant);
+    if (v != dir->mVariants.end()) {
+      listing = v->second;
+    } else {
+      // Splice the suffix into the plain rendering at the end of each link.
+      const string& plain = dir->mPlain->mData;
+      string suffixed;
+      if (aSuffix.empty()) {
+        suffixed = plain;
+      } else {
+        suffixed.reserve(plain.size() + aSuffix.size() * dir->mLinkEnds.size());
+        size_t start = 0;
+        for (size_t i = 0; i < dir->mLinkEnds.size(); i++) {
+          suffixed.append(plain, start, dir->mLinkEnds[i] - start);
+          suffixed.append(aSuffix);
+          start = dir->mLinkEnds[i];
+        }
+        suffixed.append(plain, start, string::npos);
+      }
+      listing = new Listing();
+      if (aGzip) {
+        GzipCache::Compress(suffixed.data(), suffixed.size(), listing->mData);
+      } else {
+        listing->mData.swap(suffixed);
+      }
+      if (dir->mVariants.size() >= MAX_VARIANTS) {
+        Release(dir->mVariants.begin()->second);
+        dir->mVariants.erase(dir->mVariants.begin());
+      }
+      dir->mVariants[variant] = listing;
+    }
+  }
+  AtomicAdd(&listing->mRefCount, 1);
+  return listing;
+}
+
+void ListingCache::Release(Listing* aListing) {
+  if (AtomicAdd(&aListing->mRefCount, -1) == 0) {
+    delete aListing;
+  }
+}
+
+void ListingCache::Added(const string& aDir, const string& aName) {
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Directory*>::iterator itr = mDirectories.find(aDir);
+  if (itr == mDirectories.end() || itr->second->mTooLarge) {
+    return;
+  }
+  if (itr->second->mNames.size() == MAX_NAMES) {
+    // Too large to cache now, which is found when it's next listed.
+    Remove(aDir);
+  } else if (itr->second->mNames.insert(aName).second) {
+    Stale(itr->second);
+  }
+}
+
+void ListingCache::Removed(const string& aDir, const string& aName) {
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Directory*>::iterator itr = mDirectories.find(aDir);
+  if (itr == mDirectories.end()) {
+    return;
+  }
+  if (itr->second->mTooLarge) {
+    // It may now be small enough; find out when it's next listed.
+    Remove(aDir);
+  } else if (itr->second->mNames.erase(aName) > 0) {
+    Stale(itr->second);
+  }
+}
+
+void ListingCache::Invalidate(const string& aPath) {
+  MonitorAutoLock lock(mMonitor);
+  // Keys below aPath share its prefix, so sort after it and before any key
+  // which doesn't.
+  std::map<string, Directory*>::iterator itr = mDirectories.lower_bound(aPath);
+  while (itr != mDirectories.end() &&
+         itr->first.compare(0, aPath.size(), aPath) == 0) {
+    string key = itr->first;
+    itr++;
+    if (aPath.empty() || key.size() == aPath.size() ||
+        key[aPath.size()] == '/') {
+      Remove(key);
+    }
+  }
+}
+
+void ListingCache::InvalidateAll() {
+  MonitorAutoLock lock(mMonitor);
+  while (!mLRU.empty()) {
+    Remove(mLRU.front());
+  }
+}
+
+void ListingCache::Stale(Directory* aDir) {
+  if (aDir->mPlain) {
+    Release(aDir->mPlain);
+    aDir->mPlain = 0;
+  }
+  std::map<string, Listing*>::iterator itr = aDir->mVariants.begin();
+  for (; itr != aDir->mVariants.end(); itr++) {
+    Release(itr->second);
+  }
+  aDir->mVariants.clear();
+}
+
+void ListingCache::Remove(const string& aKey) {
+  std::map<string, Directory*>::iterator itr = mDirectories.find(aKey);
+  assert(itr != mDirectories.end());
+  Directory* dir = itr->second;
+  Stale(dir);
+  mLRU.erase(dir->mLRU);
+  mDirectories.erase(itr);
+  delete dir;
+}
+
+#ifdef _DEBUG
+
+void ListingCache::Test() {
+  std::set<string> names;
+  names.insert("b.webm");
+  names.insert("a.ogv");
+  vector<size_t> linkEnds;
+  string html = Render("media", names, &linkEnds);
+  assert(html == "<!DOCTYPE html>\n<ul>"
+                 "<li><a href=\"media/a.ogv\">a.ogv</a></li>"
+                 "<li><a href=\"media/b.webm\">b.webm</a></li></ul>");
+  assert(linkEnds.size() == 2 && html[linkEnds[0]] == '"' &&
+         html.compare(linkEnds[0] - 5, 5, "a.ogv") == 0);
+  assert(Render("", names, 0).find("href=\"./a.ogv\"") != string::npos);
+
+  // The rest needs change notifications, which are delivered to the
+  // running instance.
+  ListingCache* cache = Get();
+  if (!cache) {
+    return;
+  }
+#ifdef __linux__
+  mkdir("ListingCacheTest.tmp", 0755);
+  FILE* f = fopen("ListingCacheTest.tmp/one.txt", "wb");
+  assert(f);
+  fclose(f);
+  Listing* plain = cache->Acquire("ListingCacheTest.tmp", "", false);
+  assert(plain);
+  string s(plain->Data(), plain->Length());
+  assert(s.find("ListingCacheTest.tmp/one.txt\"") != string::npos);
+  assert(s.find("..") != string::npos);
+  // Shared until something changes.
+  Listing* again = cache->Acquire("./ListingCacheTest.tmp/", "", false);
+  assert(again == plain);
+  Release(again);
+  Listing* rate = cache->Acquire("ListingCacheTest.tmp", "?rate=100", false);
+  s.assign(rate->Data(), rate->Length());
+  assert(s.find("one.txt?rate=100\">one.txt<") != string::npos);
+  Release(rate);
+
+  // Creating a file updates the listing, and the old rendering stays
+  // valid for as long as it's referenced.
+  f = fopen("ListingCacheTest.tmp/two.txt", "wb");
+  assert(f);
+  fclose(f);
+  Listing* updated = 0;
+  for (int i = 0; i < 200; i++) {
+    updated = cache->Acquire("ListingCacheTest.tmp", "", false);
+    s.assign(updated->Data(), updated->Length());
+    if (s.find("two.txt") != string::npos) {
+      break;
+    }
+    Release(updated);
+    updated = 0;
+    Sleep(5);
+  }
+  assert(updated && updated != plain);
+  assert(s.find("one.txt") < s.find("two.txt"));
+  assert(string(plain->Data(), plain->Length()).find("two.txt") ==
+         string::npos);
+  Release(updated);
+  Release(plain);
+  remove("ListingCacheTest.tmp/one.txt");
+  remove("ListingCacheTest.tmp/two.txt");
+  rmdir("ListingCacheTest.tmp");
+  cache->Invalidate("ListingCacheTest.tmp");
+#endif
+}
+
+#endif
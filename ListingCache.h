@@ -0,0 +1,145 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __LISTING_CACHE_H__
+#define __LISTING_CACHE_H__
+
+#include <list>
+#include <map>
+#include <set>
+
+#include "Thread.h"
+#include "Utils.h"
+
+// Cache of rendered HTML directory listings. Each cached directory keeps
+// its sorted names, which MetadataCache's change notifications update in
+// place, so a listing is only read from the file system once; after a
+// change it's re-rendered from the names. Rendered listings are shared,
+// immutable and reference counted. Variants with a query suffix on their
+// links, or gzip compressed, are derived from the plain rendering and
+// cached alongside it. Only available where MetadataCache is; elsewhere
+// Get() returns null. Thread safe.
+class ListingCache {
+public:
+  class Listing {
+  public:
+    const char* Data() const {
+      return mData.data();
+    }
+    size_t Length() const {
+      return mData.size();
+    }
+  private:
+    friend class ListingCache;
+    Listing() : mRefCount(1) {}
+    string mData;
+    volatile int mRefCount;
+  };
+
+  ~ListingCache();
+
+  // Creates the cache returned by Get(), if MetadataCache is running.
+  // Must be called after MetadataCache::Init().
+  static void Init();
+  static void Shutdown();
+
+  static ListingCache* Get() {
+    return sInstance;
+  }
+
+  // Returns the listing of directory aDir, relative to the working
+  // directory, with aSuffix appended to each link, and gzip compressed if
+  // aGzip. The listing is returned with a reference held, or null if the
+  // directory can't be watched or has too many entries to cache, in which
+  // case it should be streamed instead.
+  Listing* Acquire(const string& aDir, const string& aSuffix, bool aGzip);
+
+  static void Release(Listing* aListing);
+
+  // Renders the listing of aNames in directory aDir. The offset in the
+  // result at which each link ends, where a suffix is inserted, is
+  // appended to aLinkEnds if it's non-null.
+  static string Render(const string& aDir,
+                       const std::set<string>& aNames,
+                       vector<size_t>* aLinkEnds);
+
+  // Reads the names in aDir, other than "." (and ".." at the top). Returns
+  // false, part way through, if there are more than aMax.
+  static bool ReadNames(const string& aDir,
+                        std::set<string>& aNames,
+                        size_t aMax);
+
+  // Called by MetadataCache as entries are added to or removed from aDir,
+  // whose path is normalized as by MetadataCache.
+  void Added(const string& aDir, const string& aName);
+  void Removed(const string& aDir, const string& aName);
+
+  // Drops the listings of aPath and of everything below it, e.g. when
+  // it's renamed.
+  void Invalidate(const string& aPath);
+  void InvalidateAll();
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  struct Directory {
+    // Too large directories are remembered, without their names, so they
+    // aren't read again until they shrink.
+    bool mTooLarge;
+    std::set<string> mNames;
+    // The plain rendering, or null once a change makes it stale, and where
+    // its links end.
+    Listing* mPlain;
+    vector<size_t> mLinkEnds;
+    // Renderings with a suffix or compressed, by suffix and encoding.
+    std::map<string, Listing*> mVariants;
+    std::list<string>::iterator mLRU;
+  };
+
+  ListingCache();
+
+  // Drops aDir's renderings, leaving its names. Called with the lock held.
+  void Stale(Directory* aDir);
+
+  // Removes aKey from the cache. Called with the lock held.
+  void Remove(const string& aKey);
+
+  static ListingCache* sInstance;
+
+  Monitor* mMonitor;
+  std::map<string, Directory*> mDirectories;
+  // Keys of cached directories, most recently used first.
+  std::list<string> mLRU;
+};
+
+#endif
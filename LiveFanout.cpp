@@ -0,0 +1,426 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "LiveFanout.h"
+#include "Log.h"
+#include "MetadataCache.h"
+#include "Stats.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#define open _open
+#define read _read
+#define close _close
+#define O_RDONLY (_O_RDONLY | _O_BINARY)
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Size of each source's ring buffer.
+#define RING_SIZE ((int64_t)BufferPool::LARGE)
+
+// Subscribers further than this behind the live edge are skipped forward,
+// which leaves the producer the other half of the ring to write into
+// while they send.
+#define MAX_LAG (RING_SIZE / 2)
+
+// Without a rate, the live edge moves forward this far each time a
+// subscriber reaches it.
+#define READ_SIZE (64 * 1024)
+
+// With a rate, the file is read in pieces of this many milliseconds'
+// worth of data.
+#define QUANTUM_MS 10
+
+// How often subscribers waiting for a following source to grow check for
+// new data, in microseconds. The file itself is only read again once
+// MetadataCache reports that it changed.
+#define FOLLOW_TICK 5000
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+LiveFanout* LiveFanout::sInstance = 0;
+
+LiveFanout::Source::Source(LiveFanout* aOwner,
+                           const string& aKey,
+                           int aFile,
+                           int64_t aRate,
+                           int64_t aIdleTimeout,
+                           int64_t aNow)
+  : mOwner(aOwner),
+    mKey(aKey),
+    mFile(aFile),
+    mRate(aRate),
+    mIdleTimeout(aIdleTimeout),
+    mLastGrowth(aNow),
+    mAtEnd(false),
+    mWriterClosed(false),
+    mQuantum(aRate * QUANTUM_MS / 1000),
+    mStartTime(aNow),
+    mMonitor(Monitor::Create()),
+    mRing(RING_SIZE),
+    mEdge(0),
+    mEnded(false),
+    mRefCount(0)
+{
+  if (mQuantum < 1) {
+    mQuantum = 1;
+  }
+}
+
+LiveFanout::Source::~Source() {
+  close(mFile);
+  delete mMonitor;
+}
+
+void LiveFanout::Source::Produce(int64_t aNow, bool aWanted) {
+  if (mAtEnd) {
+    if (aNow - mLastGrowth >= mIdleTimeout) {
+      mEnded = true;
+    }
+    return;
+  }
+  int64_t target;
+  if (mRate > 0) {
+    target = (int64_t)((double)(aNow - mStartTime) * mRate / 1000000);
+    if (target - mEdge < mQuantum) {
+      return;
+    }
+  } else if (aWanted) {
+    target = mEdge + READ_SIZE;
+  } else {
+    return;
+  }
+  // Never overwrite more than the half of the ring subscribers can't be
+  // sending from.
+  target = MIN(target, mEdge + MAX_LAG);
+  while (mEdge < target) {
+    int64_t start = mEdge % RING_SIZE;
+    int count = (int)MIN(target - mEdge, RING_SIZE - start);
+    int r = read(mFile, mRing.Data() + start, count);
+    if (r == 0 && mIdleTimeout > 0 && !mWriterClosed &&
+        aNow - mLastGrowth < mIdleTimeout) {
+      // Wait for the writer. If we'll be told when it writes, don't read
+      // again until then.
+      mAtEnd = !mWatchPath.empty();
+      return;
+    }
+    if (r <= 0) {
+      mEnded = true;
+      return;
+    }
+    mEdge += r;
+    mLastGrowth = aNow;
+  }
+}
+
+LiveFanout::Source::eResult
+LiveFanout::Source::Peek(int64_t aNow,
+                         int64_t& aPosition,
+                         const char*& aData,
+                         size_t& aLength,
+                         int64_t& aWakeTime)
+{
+  {
+    MonitorAutoLock lock(mMonitor);
+    if (!mEnded) {
+      Produce(aNow, aPosition == mEdge);
+    }
+    if (aPosition < mEdge - MAX_LAG) {
+      Stats::Increment(Stats::LIVE_SKIPPED_BYTES, mEdge - aPosition);
+      aPosition = mEdge;
+      // Don't wait for the producer; resume from the freshest data.
+      Produce(aNow, true);
+    }
+    if (aPosition < mEdge) {
+      int64_t start = aPosition % RING_SIZE;
+      aData = mRing.Data() + start;
+      aLength = (size_t)MIN(mEdge - aPosition, RING_SIZE - start);
+      return LIVE_DATA;
+    }
+    if (!mEnded) {
+      // Wait for the file to grow, or for the rate to allow more.
+      if (mRate == 0 || mAtEnd) {
+        aWakeTime = aNow + FOLLOW_TICK;
+      } else {
+        aWakeTime = mStartTime +
+          (int64_t)((double)(mEdge + mQuantum) * 1000000 / mRate);
+      }
+      return LIVE_WAIT;
+    }
+  }
+  // Ended() takes LiveFanout's lock, which mustn't be taken while holding
+  // ours; Subscribe() takes them the other way round.
+  mOwner->Ended(this);
+  return LIVE_END;
+}
+
+bool LiveFanout::Source::IsIntact(int64_t aPosition) {
+  MonitorAutoLock lock(mMonitor);
+  return aPosition >= mEdge - RING_SIZE;
+}
+
+LiveFanout::LiveFanout()
+  : mMonitor(Monitor::Create())
+{
+}
+
+LiveFanout::~LiveFanout() {
+  // Sources are destroyed by their last subscriber.
+  delete mMonitor;
+}
+
+void LiveFanout::Init() {
+  if (!sInstance) {
+    sInstance = new LiveFanout();
+  }
+}
+
+void LiveFanout::Shutdown() {
+  delete sInstance;
+  sInstance = 0;
+}
+
+LiveFanout::Source* LiveFanout::Subscribe(const string& aPath,
+                                          int64_t aRate,
+                                          int64_t aIdleTimeout,
+                                          int64_t& aPosition)
+{
+  string key = aPath + "\n";
+  AppendDecimal(key, aRate);
+  key += aIdleTimeout > 0 ? "\nfollow" : "";
+
+  // Watch the file's directory for changes before reading the file, so no
+  // write is missed. That takes MetadataCache's lock, which is held while
+  // it calls FileChanged(), so mustn't be taken with our lock held.
+  string watchPath;
+  MetadataCache* metadata = MetadataCache::Get();
+  if (aIdleTimeout > 0 && metadata) {
+    size_t slash = aPath.rfind('/');
+    string dir = slash == string::npos ? "." : aPath.substr(0, slash);
+    string name = slash == string::npos ? aPath : aPath.substr(slash + 1);
+    if (metadata->WatchDirectory(dir, watchPath)) {
+      watchPath = watchPath.empty() ? name : watchPath + "/" + name;
+    } else {
+      watchPath.clear();
+    }
+  }
+
+  MonitorAutoLock lock(mMonitor);
+  Source* source;
+  std::map<string, Source*>::iterator itr = mSources.find(key);
+  if (itr != mSources.end()) {
+    source = itr->second;
+  } else {
+    int file = open(aPath.c_str(), O_RDONLY);
+    if (file == -1) {
+      return 0;
+    }
+    source = new Source(this, key, file, aRate, aIdleTimeout,
+                        GetMonotonicTime());
+    source->mWatchPath = watchPath;
+    mSources[key] = source;
+    LOG(LOG_DEBUG, "Started live source %s at %lld B/s", aPath.c_str(),
+        (long long)aRate);
+  }
+  source->mRefCount++;
+  MonitorAutoLock sourceLock(source->mMonitor);
+  aPosition = source->mEdge;
+  return source;
+}
+
+void LiveFanout::Unsubscribe(Source* aSource) {
+  MonitorAutoLock lock(mMonitor);
+  assert(aSource->mRefCount > 0);
+  if (--aSource->mRefCount > 0) {
+    return;
+  }
+  std::map<string, Source*>::iterator itr = mSources.find(aSource->mKey);
+  if (itr != mSources.end() && itr->second == aSource) {
+    mSources.erase(itr);
+  }
+  delete aSource;
+}
+
+void LiveFanout::FileChanged(const string& aPath, bool aClosed) {
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Source*>::iterator itr = mSources.begin();
+  for (; itr != mSources.end(); itr++) {
+    Source* source = itr->second;
+    if (source->mWatchPath == aPath) {
+      MonitorAutoLock sourceLock(source->mMonitor);
+      source->mAtEnd = false;
+      source->mWriterClosed = source->mWriterClosed || aClosed;
+    }
+  }
+}
+
+void LiveFanout::Ended(Source* aSource) {
+  // Later viewers start the stream again, from the beginning.
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Source*>::iterator itr = mSources.find(aSource->mKey);
+  if (itr != mSources.end() && itr->second == aSource) {
+    mSources.erase(itr);
+  }
+}
+
+#ifdef _DEBUG
+
+// Drains aSource from aPosition into aOut, until it waits or ends.
+static LiveFanout::Source::eResult Drain(LiveFanout::Source* aSource,
+                                         int64_t& aPosition,
+                                         string& aOut,
+                                         size_t aMax)
+{
+  while (aOut.size() < aMax) {
+    const char* data = 0;
+    size_t length = 0;
+    int64_t wake = 0;
+    LiveFanout::Source::eResult result =
+      aSource->Peek(GetMonotonicTime(), aPosition, data, length, wake);
+    if (result != LiveFanout::Source::LIVE_DATA) {
+      return result;
+    }
+    length = MIN(length, aMax - aOut.size());
+    aOut.append(data, length);
+    assert(aSource->IsIntact(aPosition));
+    aPosition += length;
+  }
+  return LiveFanout::Source::LIVE_DATA;
+}
+
+void LiveFanout::Test() {
+  const char* path = "LiveFanoutTest.tmp";
+  string contents;
+  for (int i = 0; contents.size() < 3 * 1024 * 1024; i++) {
+    AppendDecimal(contents, i);
+    contents.push_back(' ');
+  }
+  FILE* f = fopen(path, "wb");
+  assert(f);
+  fwrite(contents.data(), 1, contents.size(), f);
+  fclose(f);
+
+  // Change notifications are delivered to the running instance.
+  assert(sInstance && sInstance->mSources.empty());
+  LiveFanout& fanout = *sInstance;
+  int64_t position = -1;
+  assert(!fanout.Subscribe("LiveFanoutTest.missing", 0, 0, position));
+  int64_t first = -1;
+  Source* a = fanout.Subscribe(path, 0, 0, first);
+  assert(a && first == 0);
+
+  // The first viewer starts at the beginning; a later one joins the same
+  // source at the live edge.
+  string out;
+  assert(Drain(a, first, out, 100000) == Source::LIVE_DATA);
+  assert(out == contents.substr(0, 100000));
+  int64_t second = -1;
+  Source* b = fanout.Subscribe(path, 0, 0, second);
+  assert(b == a && second > 0 && second <= first + READ_SIZE);
+
+  // The first viewer races ahead, so the second, left behind, is skipped
+  // forward to the edge.
+  out.clear();
+  assert(Drain(a, first, out, (size_t)RING_SIZE) == Source::LIVE_DATA);
+  assert(out == contents.substr(100000, out.size()));
+  int64_t behind = second;
+  string late;
+  Drain(b, second, late, 10);
+  assert(second - 10 > behind);
+  assert(late == contents.substr((size_t)(second - 10), 10));
+
+  // The first viewer reads to the end, which ends the source.
+  out.clear();
+  assert(Drain(a, first, out, contents.size()) == Source::LIVE_END);
+  assert(first == (int64_t)contents.size());
+  fanout.Unsubscribe(a);
+  fanout.Unsubscribe(b);
+  assert(fanout.mSources.empty());
+
+  // With a rate, the edge moves forward in time.
+  Source* paced = fanout.Subscribe(path, 1024 * 1024, 0, position);
+  out.clear();
+  assert(Drain(paced, position, out, contents.size()) == Source::LIVE_WAIT);
+  assert(out.size() < 100 * 1024);
+  Sleep(50);
+  size_t before = out.size();
+  assert(Drain(paced, position, out, contents.size()) == Source::LIVE_WAIT);
+  assert(out.size() > before && out == contents.substr(0, out.size()));
+  fanout.Unsubscribe(paced);
+  assert(fanout.mSources.empty());
+
+  // A following source waits for the writer at the end of the file, and
+  // ends when the writer closes it.
+  f = fopen(path, "wb");
+  assert(f);
+  fputs("abc", f);
+  fflush(f);
+  Source* follow = fanout.Subscribe(path, 0, 10000000, position);
+  out.clear();
+  assert(Drain(follow, position, out, 100) == Source::LIVE_WAIT);
+  assert(out == "abc");
+  fputs("def", f);
+  fflush(f);
+  for (int i = 0; i < 200 && out.size() < 6; i++) {
+    Sleep(5);
+    Drain(follow, position, out, 100);
+  }
+  assert(out == "abcdef");
+  fclose(f);
+  Source::eResult result = Source::LIVE_WAIT;
+  for (int i = 0; i < 200 && result == Source::LIVE_WAIT; i++) {
+    Sleep(5);
+    result = Drain(follow, position, out, 100);
+  }
+  assert(result == Source::LIVE_END && out == "abcdef");
+  fanout.Unsubscribe(follow);
+
+  // Or when nothing is written for its idle timeout.
+  follow = fanout.Subscribe(path, 0, 20000, position);
+  out.clear();
+  assert(Drain(follow, position, out, 100) == Source::LIVE_WAIT);
+  Sleep(30);
+  assert(Drain(follow, position, out, 100) == Source::LIVE_END);
+  assert(out == "abcdef");
+  fanout.Unsubscribe(follow);
+  assert(fanout.mSources.empty());
+
+  remove(path);
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __LIVE_FANOUT_H__
+#define __LIVE_FANOUT_H__
+
+#include <map>
+
+#include "BufferPool.h"
+#include "Thread.h"
+#include "Utils.h"
+
+// Shares live streams between their viewers. Each live source, i.e. a file
+// streamed at a given rate, is read once, sequentially, into a ring buffer
+// which all its subscribers send from, so memory and disk reads grow with
+// the number of sources rather than viewers. A source's live edge moves
+// forward at its rate, or without a rate, as fast as its fastest
+// subscriber takes data, and the source ends at the end of the file.
+// A following source instead waits at the end of the file for a writer to
+// append more, until the writer closes the file or nothing is appended
+// for its idle timeout; where MetadataCache is available it's told when
+// the file changes, rather than reading it again to find out.
+// Subscribers join at the live edge; one which falls too far behind is
+// skipped forward to the edge, and one whose data is overwritten while
+// it's being sent is dropped, so slow viewers never hold up the others.
+// Thread safe.
+class LiveFanout {
+public:
+  class Source {
+  public:
+    enum eResult {
+      // Data is available to send.
+      LIVE_DATA,
+      // Nothing to send until the live edge moves forward.
+      LIVE_WAIT,
+      // The stream has ended.
+      LIVE_END
+    };
+
+    // Moves the live edge forward as due, and finds the data to send to a
+    // subscriber which has reached aPosition. Sets aData and aLength to
+    // the data, returning LIVE_DATA, or when that's LIVE_WAIT, sets
+    // aWakeTime to the monotonic time at which to try again. If the
+    // subscriber has fallen too far behind, aPosition is moved forward to
+    // the live edge first.
+    eResult Peek(int64_t aNow,
+                 int64_t& aPosition,
+                 const char*& aData,
+                 size_t& aLength,
+                 int64_t& aWakeTime);
+
+    // True if the data Peek() returned for aPosition hasn't since been
+    // overwritten; the data was sent without the lock held, so if not it
+    // may have been corrupted mid-send.
+    bool IsIntact(int64_t aPosition);
+
+  private:
+    friend class LiveFanout;
+    Source(LiveFanout* aOwner,
+           const string& aKey,
+           int aFile,
+           int64_t aRate,
+           int64_t aIdleTimeout,
+           int64_t aNow);
+    ~Source();
+
+    // Reads from the file into the ring, up to where the live edge is due
+    // at aNow, or with no rate, a piece further if aWanted. Called with
+    // the lock held.
+    void Produce(int64_t aNow, bool aWanted);
+
+    LiveFanout* mOwner;
+    string mKey;
+    int mFile;
+    // Bytes per second, or 0 to read as fast as subscribers take data.
+    int64_t mRate;
+    // For a following source, how long to wait for the file to grow, in
+    // microseconds, else 0. mWatchPath is the file's normalized path, if
+    // its changes are reported to FileChanged(), else empty.
+    int64_t mIdleTimeout;
+    string mWatchPath;
+    // When the file last grew, whether we've read to its end and are
+    // waiting to hear it's changed, and whether its writer has closed it.
+    int64_t mLastGrowth;
+    bool mAtEnd;
+    bool mWriterClosed;
+    // Bytes to accumulate before reading, when there's a rate.
+    int64_t mQuantum;
+    int64_t mStartTime;
+    Monitor* mMonitor;
+    // The ring holds the bytes of the stream up to mEdge, the live edge;
+    // the byte at offset p in the stream is at p % the ring's size.
+    Buffer mRing;
+    int64_t mEdge;
+    bool mEnded;
+    // Subscribers, guarded by LiveFanout's lock.
+    unsigned mRefCount;
+  };
+
+  ~LiveFanout();
+
+  static void Init();
+  static void Shutdown();
+
+  static LiveFanout* Get() {
+    return sInstance;
+  }
+
+  // Subscribes to the live stream of aPath at aRate bytes per second, or 0
+  // for as fast as subscribers take it, starting it if it isn't running.
+  // With aIdleTimeout, in microseconds, the stream follows the file as
+  // it's written. Sets aPosition to the live edge. Returns the source, or
+  // null if the file can't be opened.
+  Source* Subscribe(const string& aPath,
+                    int64_t aRate,
+                    int64_t aIdleTimeout,
+                    int64_t& aPosition);
+
+  void Unsubscribe(Source* aSource);
+
+  // Called by MetadataCache when aPath, normalized, is written to, or
+  // closed after writing if aClosed.
+  void FileChanged(const string& aPath, bool aClosed);
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  LiveFanout();
+
+  // Stops new subscribers joining aSource, which has ended.
+  void Ended(Source* aSource);
+
+  static LiveFanout* sInstance;
+
+  Monitor* mMonitor;
+  // Running sources, by path and rate.
+  std::map<string, Source*> mSources;
+};
+
+#endif
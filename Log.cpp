@@ -0,0 +1,408 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "Log.h"
+#include "Thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define vsnprintf _vsnprintf
+#else
+#include <pthread.h>
+#endif
+
+// Messages each thread may have waiting to be written.
+#define RING_SIZE 256
+
+// How often the writer drains the rings, in microseconds.
+#define DRAIN_INTERVAL 10000
+
+#ifdef _MSC_VER
+// Volatile accesses have acquire and release semantics with MSVC.
+static inline unsigned LoadAcquire(volatile unsigned* aValue) {
+  return *aValue;
+}
+static inline void StoreRelease(volatile unsigned* aValue, unsigned aNew) {
+  *aValue = aNew;
+}
+#else
+static inline unsigned LoadAcquire(volatile unsigned* aValue) {
+  return __atomic_load_n(aValue, __ATOMIC_ACQUIRE);
+}
+static inline void StoreRelease(volatile unsigned* aValue, unsigned aNew) {
+  __atomic_store_n(aValue, aNew, __ATOMIC_RELEASE);
+}
+#endif
+
+struct LogRecord {
+  time_t mTime;
+  eLogLevel mLevel;
+  unsigned mLength;
+  char mText[Log::MAX_MESSAGE];
+};
+
+// Single producer, single consumer queue of one thread's messages. Only
+// the owning thread advances mHead, only the writer advances mTail.
+struct LogRing {
+  LogRing() : mHead(0), mTail(0), mDropped(0), mClosed(0), mNext(0) {}
+  LogRecord mRecords[RING_SIZE];
+  volatile unsigned mHead;
+  volatile unsigned mTail;
+  // Messages dropped because the ring was full.
+  volatile int mDropped;
+  // Set when the owning thread exits; the writer frees the ring once it's
+  // drained.
+  volatile unsigned mClosed;
+  LogRing* mNext;
+};
+
+class LogWriter : public Runnable {
+public:
+  virtual void Run();
+};
+
+eLogLevel Log::sLevel = LOG_INFO;
+
+static FILE* sOutput = 0;
+static Monitor* sMonitor = 0;
+static Thread* sThread = 0;
+static LogWriter* sWriter = 0;
+static bool sShutdown = false;
+// All rings, guarded by sMonitor.
+static LogRing* sRings = 0;
+
+static const char sLevelNames[] = { 'D', 'I', 'W', 'E' };
+
+static void CloseRing(LogRing* aRing) {
+  StoreRelease(&aRing->mClosed, 1);
+}
+
+#ifdef _WIN32
+
+// Fiber local storage, rather than TLS, so we're told when threads exit.
+static DWORD sRingKey = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI RingDestructor(PVOID aRing) {
+  if (aRing) {
+    CloseRing(static_cast<LogRing*>(aRing));
+  }
+}
+
+static bool CreateRingKey() {
+  sRingKey = FlsAlloc(RingDestructor);
+  return sRingKey != FLS_OUT_OF_INDEXES;
+}
+
+static void DeleteRingKey() {
+  FlsFree(sRingKey);
+}
+
+static LogRing* GetRing() {
+  return static_cast<LogRing*>(FlsGetValue(sRingKey));
+}
+
+static void SetRing(LogRing* aRing) {
+  FlsSetValue(sRingKey, aRing);
+}
+
+#else
+
+static pthread_key_t sRingKey;
+
+static void RingDestructor(void* aRing) {
+  CloseRing(static_cast<LogRing*>(aRing));
+}
+
+static bool CreateRingKey() {
+  return pthread_key_create(&sRingKey, RingDestructor) == 0;
+}
+
+static void DeleteRingKey() {
+  pthread_key_delete(sRingKey);
+}
+
+static LogRing* GetRing() {
+  return static_cast<LogRing*>(pthread_getspecific(sRingKey));
+}
+
+static void SetRing(LogRing* aRing) {
+  pthread_setspecific(sRingKey, aRing);
+}
+
+#endif
+
+// Returns the calling thread's ring, creating it if need be.
+static LogRing* GetThreadRing() {
+  LogRing* ring = GetRing();
+  if (!ring) {
+    ring = new LogRing();
+    SetRing(ring);
+    MonitorAutoLock lock(sMonitor);
+    ring->mNext = sRings;
+    sRings = ring;
+  }
+  return ring;
+}
+
+static void WriteRecord(FILE* aOutput, const LogRecord& aRecord) {
+  struct tm t;
+#ifdef _WIN32
+  localtime_s(&t, &aRecord.mTime);
+#else
+  localtime_r(&aRecord.mTime, &t);
+#endif
+  fprintf(aOutput, "%.2d:%.2d:%.2d %c %.*s\n",
+          t.tm_hour, t.tm_min, t.tm_sec, sLevelNames[aRecord.mLevel],
+          (int)aRecord.mLength, aRecord.mText);
+}
+
+// Writes out everything in the rings, and frees the rings of threads
+// which have exited. Only called by the writer thread, or after it has
+// stopped.
+static void Drain() {
+  LogRing* rings;
+  {
+    MonitorAutoLock lock(sMonitor);
+    rings = sRings;
+  }
+  bool wrote = false;
+  bool closed = false;
+  for (LogRing* ring = rings; ring; ring = ring->mNext) {
+    // Read mClosed first, so a ring isn't freed while its thread's last
+    // messages are still unread.
+    unsigned isClosed = LoadAcquire(&ring->mClosed);
+    unsigned head = LoadAcquire(&ring->mHead);
+    unsigned tail = ring->mTail;
+    for (; tail != head; tail++) {
+      WriteRecord(sOutput, ring->mRecords[tail % RING_SIZE]);
+      wrote = true;
+    }
+    StoreRelease(&ring->mTail, tail);
+    int dropped = ring->mDropped;
+    if (dropped) {
+      fprintf(sOutput, "%d log messages dropped\n", dropped);
+      AtomicAdd(&ring->mDropped, -dropped);
+      wrote = true;
+    }
+    closed = closed || isClosed;
+  }
+  if (wrote) {
+    fflush(sOutput);
+  }
+  if (closed) {
+    MonitorAutoLock lock(sMonitor);
+    LogRing** link = &sRings;
+    while (*link) {
+      LogRing* ring = *link;
+      if (ring->mClosed && ring->mTail == ring->mHead && !ring->mDropped) {
+        *link = ring->mNext;
+        delete ring;
+      } else {
+        link = &ring->mNext;
+      }
+    }
+  }
+}
+
+void LogWriter::Run() {
+  while (true) {
+    {
+      MonitorAutoLock lock(sMonitor);
+      if (sShutdown) {
+        return;
+      }
+      lock.TimedWait(DRAIN_INTERVAL);
+    }
+    Drain();
+  }
+}
+
+void Log::Init(eLogLevel aLevel, FILE* aOutput) {
+  sLevel = aLevel;
+  sOutput = aOutput;
+  if (sMonitor || !CreateRingKey()) {
+    return;
+  }
+  sMonitor = Monitor::Create();
+  sShutdown = false;
+  sWriter = new LogWriter();
+  sThread = Thread::Create(sWriter);
+  sThread->Start();
+}
+
+void Log::Shutdown() {
+  if (!sMonitor) {
+    return;
+  }
+  {
+    MonitorAutoLock lock(sMonitor);
+    sShutdown = true;
+    lock.Notify();
+  }
+  sThread->Join();
+  delete sThread;
+  delete sWriter;
+  Drain();
+  // Other threads should have exited by now; messages they log from here
+  // on are written synchronously, and their rings are leaked.
+  LogRing* ring = GetRing();
+  if (ring) {
+    SetRing(0);
+  }
+  DeleteRingKey();
+  while (sRings) {
+    LogRing* next = sRings->mNext;
+    if (sRings == ring || sRings->mClosed) {
+      delete sRings;
+    }
+    sRings = next;
+  }
+  delete sMonitor;
+  sMonitor = 0;
+}
+
+bool Log::ParseLevel(const string& aName, eLogLevel& aLevel) {
+  static const char* names[] = { "debug", "info", "warning", "error" };
+  for (unsigned i = 0; i < ARRAY_LENGTH(names); i++) {
+    if (aName == names[i]) {
+      aLevel = (eLogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Log::Write(eLogLevel aLevel, const char* aFormat, ...) {
+  if (!IsEnabled(aLevel)) {
+    return;
+  }
+  LogRecord sync;
+  LogRing* ring = sMonitor ? GetThreadRing() : 0;
+  LogRecord* record = &sync;
+  unsigned head = 0;
+  if (ring) {
+    head = ring->mHead;
+    if (head - LoadAcquire(&ring->mTail) >= RING_SIZE) {
+      AtomicAdd(&ring->mDropped, 1);
+      return;
+    }
+    record = &ring->mRecords[head % RING_SIZE];
+  }
+
+  va_list args;
+  va_start(args, aFormat);
+  int length = vsnprintf(record->mText, MAX_MESSAGE, aFormat, args);
+  va_end(args);
+  if (length < 0 || length >= MAX_MESSAGE) {
+    // Truncated; older MSVC runtimes return -1.
+    length = MAX_MESSAGE - 1;
+  }
+  record->mLength = (unsigned)length;
+  record->mLevel = aLevel;
+  record->mTime = time(0);
+
+  if (ring) {
+    StoreRelease(&ring->mHead, head + 1);
+  } else {
+    WriteRecord(sOutput ? sOutput : stdout, sync);
+  }
+}
+
+#ifdef _DEBUG
+
+class LogSpammer : public Runnable {
+public:
+  LogSpammer(unsigned aId) : mId(aId) {}
+  virtual void Run() {
+    for (unsigned i = 0; i < 100; i++) {
+      LOG(LOG_INFO, "thread %u message %u", mId, i);
+    }
+    LOG(LOG_DEBUG, "filtered");
+  }
+private:
+  unsigned mId;
+};
+
+void Log::Test() {
+  FILE* output = tmpfile();
+  if (!output) {
+    return;
+  }
+  eLogLevel level;
+  assert(ParseLevel("warning", level) && level == LOG_WARNING);
+  assert(!ParseLevel("loud", level));
+
+  Init(LOG_INFO, output);
+  const unsigned numThreads = 4;
+  Runnable* jobs[numThreads];
+  Thread* threads[numThreads];
+  for (unsigned i = 0; i < numThreads; i++) {
+    jobs[i] = new LogSpammer(i);
+    threads[i] = Thread::Create(jobs[i]);
+    threads[i]->Start();
+  }
+  for (unsigned i = 0; i < numThreads; i++) {
+    threads[i]->Join();
+    delete threads[i];
+    delete jobs[i];
+  }
+  string longMessage(2 * MAX_MESSAGE, 'x');
+  LOG(LOG_ERROR, "%s", longMessage.c_str());
+  Shutdown();
+
+  // Every message arrives, in order for each thread.
+  rewind(output);
+  char line[2 * MAX_MESSAGE];
+  unsigned next[numThreads] = { 0 };
+  unsigned lines = 0;
+  while (fgets(line, sizeof(line), output)) {
+    lines++;
+    unsigned id, n;
+    if (sscanf(line + 11, "thread %u message %u", &id, &n) == 2) {
+      assert(line[9] == 'I');
+      assert(id < numThreads && n == next[id]);
+      next[id]++;
+    } else {
+      assert(line[9] == 'E');
+      assert(strlen(line) == 11 + MAX_MESSAGE - 1 + 1);
+    }
+  }
+  assert(lines == numThreads * 100 + 1);
+  fclose(output);
+  sOutput = 0;
+}
+
+#endif
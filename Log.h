@@ -0,0 +1,94 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+
+#include "Utils.h"
+
+enum eLogLevel {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARNING,
+  LOG_ERROR
+};
+
+// Asynchronous logging. Each thread formats its messages into its own
+// lock-free ring buffer, and a background thread drains the rings to the
+// output, so logging never takes a lock or blocks on I/O. If a thread
+// logs faster than its ring is drained, messages are dropped and counted
+// rather than waiting. Before Init() and after Shutdown() messages are
+// written synchronously.
+class Log {
+public:
+  // Starts the writer thread. Messages below aLevel are discarded.
+  static void Init(eLogLevel aLevel, FILE* aOutput = stdout);
+
+  // Writes out all pending messages and stops the writer thread.
+  static void Shutdown();
+
+  static bool IsEnabled(eLogLevel aLevel) {
+    return aLevel >= sLevel;
+  }
+
+  // Logs a printf style message; a newline is appended. Messages longer
+  // than MAX_MESSAGE are truncated.
+  static void Write(eLogLevel aLevel, const char* aFormat, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+  // Parses "debug", "info", "warning" or "error".
+  static bool ParseLevel(const string& aName, eLogLevel& aLevel);
+
+  enum {
+    MAX_MESSAGE = 240
+  };
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  static eLogLevel sLevel;
+};
+
+#define LOG(level_, ...)                 \
+  do {                                   \
+    if (Log::IsEnabled(level_)) {        \
+      Log::Write(level_, __VA_ARGS__);   \
+    }                                    \
+  } while (0)
+
+#endif
@@ -0,0 +1,550 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <algorithm>
+#include <assert.h>
+#include <stdio.h>
+
+#include "ListingCache.h"
+#include "LiveFanout.h"
+#include "MetadataCache.h"
+
+MetadataCache* MetadataCache::sInstance = 0;
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+// Most entries cached, and so most descriptors held open.
+#define MAX_ENTRIES 1024
+
+// How long the notification thread waits for events before checking for
+// shutdown, in milliseconds.
+#define POLL_INTERVAL 500
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                      IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | \
+                      IN_MOVED_FROM | IN_MOVED_TO)
+
+MetadataCache::MetadataCache(int aNotify)
+  : mNotify(aNotify),
+    mMonitor(Monitor::Create()),
+    mShutdown(false)
+{
+  mThread = Thread::Create(this);
+  mThread->Start();
+}
+
+MetadataCache::~MetadataCache() {
+  {
+    MonitorAutoLock lock(mMonitor);
+    mShutdown = true;
+  }
+  mThread->Join();
+  delete mThread;
+  // Outstanding references are leaked, rather than left dangling.
+  InvalidateAll();
+  close(mNotify);
+  delete mMonitor;
+}
+
+bool MetadataCache::IsSupported() {
+  return true;
+}
+
+void MetadataCache::Init() {
+  if (sInstance) {
+    return;
+  }
+  int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify < 0) {
+    perror("inotify_init1");
+    return;
+  }
+  sInstance = new MetadataCache(notify);
+}
+
+void MetadataCache::Shutdown() {
+  delete sInstance;
+  sInstance = 0;
+}
+
+string MetadataCache::Normalize(const string& aPath) {
+  string path;
+  size_t start = 0;
+  while (start < aPath.size()) {
+    size_t end = aPath.find('/', start);
+    if (end == string::npos) {
+      end = aPath.size();
+    }
+    if (end > start && aPath.compare(start, end - start, ".") != 0) {
+      if (!path.empty()) {
+        path.append("/");
+      }
+      path.append(aPath, start, end - start);
+    }
+    start = end + 1;
+  }
+  return path;
+}
+
+MetadataCache::Entry* MetadataCache::Lookup(const string& aPath) {
+  string path = Normalize(aPath);
+  MonitorAutoLock lock(mMonitor);
+  std::map<string, Entry*>::iterator itr = mEntries.find(path);
+  if (itr == mEntries.end()) {
+    return 0;
+  }
+  Entry* e = itr->second;
+  e->mRefCount++;
+  mLRU.splice(mLRU.begin(), mLRU, e->mLRU);
+  return e;
+}
+
+MetadataCache::Entry* MetadataCache::Insert(const string& aPath,
+                                            const char* aContentType)
+{
+  string path = Normalize(aPath);
+  if (path.empty()) {
+    return 0;
+  }
+  size_t slash = path.rfind('/');
+  string dir = (slash == string::npos) ? "." : path.substr(0, slash);
+
+  MonitorAutoLock lock(mMonitor);
+  // Watch before reading the metadata, so a change in between isn't
+  // missed.
+  if (!Watch(dir)) {
+    return 0;
+  }
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat64 st;
+  if (fstat64(fd, &st) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  Entry* e = new Entry();
+  e->mPath = path;
+  e->mLength = st.st_size;
+  e->mModified = st.st_mtime;
+  e->mInode = st.st_ino;
+  e->mIsDirectory = S_ISDIR(st.st_mode);
+  e->mContentType = aContentType;
+  if (S_ISREG(st.st_mode)) {
+    e->mDescriptor = fd;
+  } else {
+    close(fd);
+  }
+  e->mRefCount = 1;
+
+  std::map<string, Entry*>::iterator itr = mEntries.find(path);
+  if (itr != mEntries.end()) {
+    Remove(itr->second);
+  }
+  e->mCached = true;
+  mLRU.push_front(e);
+  e->mLRU = mLRU.begin();
+  mEntries[path] = e;
+
+  // Evict unreferenced entries, least recently used first.
+  std::list<Entry*>::iterator lru = mLRU.end();
+  while (mEntries.size() > MAX_ENTRIES && lru != mLRU.begin()) {
+    Entry* old = *--lru;
+    if (old->mRefCount == 0) {
+      lru++;
+      Remove(old);
+    }
+  }
+  return e;
+}
+
+void MetadataCache::Release(Entry* aEntry) {
+  MonitorAutoLock lock(mMonitor);
+  assert(aEntry->mRefCount > 0);
+  if (--aEntry->mRefCount == 0 && !aEntry->mCached) {
+    Destroy(aEntry);
+  }
+}
+
+bool MetadataCache::WatchDirectory(const string& aDir, string& aKey) {
+  aKey = Normalize(aDir);
+  MonitorAutoLock lock(mMonitor);
+  return Watch(aKey.empty() ? "." : aKey);
+}
+
+bool MetadataCache::IsWithin(const string& aPath, const string& aDir) {
+  return aPath.compare(0, aDir.size(), aDir) == 0 &&
+         (aDir.empty() || aPath.size() == aDir.size() ||
+          aPath[aDir.size()] == '/');
+}
+
+bool MetadataCache::Watch(const string& aDir) {
+  // Find the directories from aDir up which aren't watched yet. Those
+  // which are already have their ancestors watched, so we can stop there.
+  std::vector<string> dirs;
+  string dir = aDir;
+  while (mWatches.find(dir) == mWatches.end()) {
+    dirs.push_back(dir);
+    if (dir == ".") {
+      break;
+    }
+    size_t slash = dir.rfind('/');
+    dir = (slash == string::npos) ? "." : dir.substr(0, slash);
+  }
+  // Watch them outermost first, so the invariant holds if one fails.
+  while (!dirs.empty()) {
+    const string& d = dirs.back();
+    int wd = inotify_add_watch(mNotify, d.c_str(), WATCH_EVENTS);
+    if (wd < 0) {
+      return false;
+    }
+    mWatches[d] = wd;
+    mWatchedDirs[wd].push_back(d);
+    dirs.pop_back();
+  }
+  return true;
+}
+
+void MetadataCache::Unwatch(const string& aPath) {
+  // As in Invalidate(), paths below aPath follow it in the map.
+  std::map<string, int>::iterator itr = mWatches.lower_bound(aPath);
+  while (itr != mWatches.end() &&
+         itr->first.compare(0, aPath.size(), aPath) == 0) {
+    std::map<string, int>::iterator watch = itr++;
+    if (!IsWithin(watch->first, aPath)) {
+      continue;
+    }
+    int wd = watch->second;
+    std::vector<string>& paths = mWatchedDirs[wd];
+    paths.erase(std::find(paths.begin(), paths.end(), watch->first));
+    if (paths.empty()) {
+      // Fails harmlessly if the directory is already gone.
+      inotify_rm_watch(mNotify, wd);
+      mWatchedDirs.erase(wd);
+    }
+    mWatches.erase(watch);
+  }
+}
+
+void MetadataCache::Run() {
+  // Large enough for many events; inotify_event is variable length.
+  char buffer[64 * 1024]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    {
+      MonitorAutoLock lock(mMonitor);
+      if (mShutdown) {
+        return;
+      }
+    }
+    struct pollfd pfd;
+    pfd.fd = mNotify;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, POLL_INTERVAL) <= 0) {
+      continue;
+    }
+    ssize_t n;
+    while ((n = read(mNotify, buffer, sizeof(buffer))) > 0) {
+      HandleEvents(buffer, (size_t)n);
+    }
+  }
+}
+
+void MetadataCache::HandleEvents(const char* aBuffer, size_t aLength) {
+  // The listing cache and live streams are updated with our lock held;
+  // they never call us with their own locks held.
+  ListingCache* listings = ListingCache::Get();
+  LiveFanout* live = LiveFanout::Get();
+  MonitorAutoLock lock(mMonitor);
+  size_t offset = 0;
+  while (offset < aLength) {
+    const struct inotify_event* ev =
+      reinterpret_cast<const struct inotify_event*>(aBuffer + offset);
+    offset += sizeof(struct inotify_event) + ev->len;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+      // Events were lost, so anything may have changed, including which
+      // directories our watches are on.
+      InvalidateAll();
+      Unwatch("");
+      if (listings) {
+        listings->InvalidateAll();
+      }
+      continue;
+    }
+    std::map<int, std::vector<string> >::iterator itr =
+      mWatchedDirs.find(ev->wd);
+    if (itr == mWatchedDirs.end()) {
+      continue;
+    }
+    // The event applies under every path the directory is watched by.
+    // Copied, as handling it may stop the watch.
+    std::vector<string> dirs = itr->second;
+    for (size_t i = 0; i < dirs.size(); i++) {
+      HandleEvent(ev, dirs[i], listings, live);
+    }
+  }
+}
+
+void MetadataCache::HandleEvent(const struct inotify_event* aEvent,
+                                const string& aDir,
+                                ListingCache* aListings,
+                                LiveFanout* aLive)
+{
+  string key = aDir == "." ? "" : aDir;
+  if (aEvent->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+    // The directory itself went away; paths through it are no longer
+    // valid, so stop watching it, and everything below it, under them.
+    Invalidate(key);
+    if (aListings) {
+      aListings->Invalidate(key);
+    }
+    Unwatch(key);
+    return;
+  }
+  if (aEvent->len == 0) {
+    return;
+  }
+  // The name may be a directory, e.g. one that was renamed, so this also
+  // invalidates everything below it.
+  string name(aEvent->name);
+  string path = key.empty() ? name : key + "/" + name;
+  Invalidate(path);
+  if (aEvent->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+    // Watches follow a directory when it's renamed, so those below this
+    // name no longer match their paths.
+    Unwatch(path);
+  }
+  if (aListings) {
+    // Keep the listing of the directory up to date, rather than reading it
+    // again.
+    aListings->Invalidate(path);
+    if (aEvent->mask & (IN_CREATE | IN_MOVED_TO)) {
+      aListings->Added(key, name);
+    } else if (aEvent->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      aListings->Removed(key, name);
+    }
+  }
+  if (aLive && (aEvent->mask & (IN_MODIFY | IN_CLOSE_WRITE))) {
+    // Following live streams wait for this rather than polling.
+    aLive->FileChanged(path, (aEvent->mask & IN_CLOSE_WRITE) != 0);
+  }
+}
+
+void MetadataCache::Invalidate(const string& aPath) {
+  // Keys below aPath share its prefix, so sort after it and before any key
+  // which doesn't.
+  std::map<string, Entry*>::iterator itr = mEntries.lower_bound(aPath);
+  while (itr != mEntries.end() &&
+         itr->first.compare(0, aPath.size(), aPath) == 0) {
+    Entry* e = itr->second;
+    bool within = IsWithin(itr->first, aPath);
+    itr++;
+    if (within) {
+      Remove(e);
+    }
+  }
+}
+
+void MetadataCache::InvalidateAll() {
+  while (!mLRU.empty()) {
+    Remove(mLRU.front());
+  }
+}
+
+void MetadataCache::Remove(Entry* aEntry) {
+  mEntries.erase(aEntry->mPath);
+  mLRU.erase(aEntry->mLRU);
+  aEntry->mCached = false;
+  if (aEntry->mRefCount == 0) {
+    Destroy(aEntry);
+  }
+}
+
+void MetadataCache::Destroy(Entry* aEntry) {
+  if (aEntry->mDescriptor != -1) {
+    close(aEntry->mDescriptor);
+  }
+  delete aEntry;
+}
+
+#ifdef _DEBUG
+
+static void WriteTestFile(const char* aPath, const char* aContents) {
+  FILE* f = fopen(aPath, "wb");
+  assert(f);
+  fputs(aContents, f);
+  fclose(f);
+}
+
+// Waits for the notification thread to invalidate aPath.
+static bool WaitForInvalidation(MetadataCache& aCache, const char* aPath) {
+  for (int i = 0; i < 200; i++) {
+    MetadataCache::Entry* e = aCache.Lookup(aPath);
+    if (!e) {
+      return true;
+    }
+    aCache.Release(e);
+    Sleep(5);
+  }
+  return false;
+}
+
+void MetadataCache::Test() {
+  assert(Normalize("a/b") == "a/b");
+  assert(Normalize("./a//b/") == "a/b");
+  assert(Normalize("a/./b/.") == "a/b");
+  assert(Normalize(".") == "");
+
+  int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify < 0) {
+    return;
+  }
+  mkdir("MetadataCacheTest.tmp", 0755);
+  WriteTestFile("MetadataCacheTest.tmp/a.txt", "hello");
+  {
+    MetadataCache cache(notify);
+    Entry* e = cache.Insert("MetadataCacheTest.tmp//a.txt", "text/plain");
+    assert(e && e->Length() == 5 && !e->IsDirectory());
+    assert(e->Descriptor() != -1);
+    cache.Release(e);
+    e = cache.Lookup("./MetadataCacheTest.tmp/a.txt");
+    assert(e && e->Length() == 5);
+    Entry* dir = cache.Insert("MetadataCacheTest.tmp", "text/html");
+    assert(dir && dir->IsDirectory() && dir->Descriptor() == -1);
+    cache.Release(dir);
+    assert(!cache.Insert("MetadataCacheTest.tmp/missing", "text/plain"));
+
+    // Modifying the file invalidates its entry; the old entry stays valid
+    // for as long as it's referenced.
+    WriteTestFile("MetadataCacheTest.tmp/a.txt", "hello world");
+    assert(WaitForInvalidation(cache, "MetadataCacheTest.tmp/a.txt"));
+    assert(e->Length() == 5);
+    cache.Release(e);
+    e = cache.Insert("MetadataCacheTest.tmp/a.txt", "text/plain");
+    assert(e && e->Length() == 11);
+    cache.Release(e);
+
+    // So does renaming a directory further up, and a new file at the old
+    // path is then read and watched afresh.
+    mkdir("MetadataCacheTest.tmp/x", 0755);
+    mkdir("MetadataCacheTest.tmp/x/y", 0755);
+    WriteTestFile("MetadataCacheTest.tmp/x/y/f.txt", "old");
+    e = cache.Insert("MetadataCacheTest.tmp/x/y/f.txt", "text/plain");
+    assert(e && e->Length() == 3);
+    cache.Release(e);
+    rename("MetadataCacheTest.tmp/x", "MetadataCacheTest.tmp/x_old");
+    assert(WaitForInvalidation(cache, "MetadataCacheTest.tmp/x/y/f.txt"));
+    mkdir("MetadataCacheTest.tmp/x", 0755);
+    mkdir("MetadataCacheTest.tmp/x/y", 0755);
+    WriteTestFile("MetadataCacheTest.tmp/x/y/f.txt", "new file");
+    e = cache.Insert("MetadataCacheTest.tmp/x/y/f.txt", "text/plain");
+    assert(e && e->Length() == 8);
+    cache.Release(e);
+    WriteTestFile("MetadataCacheTest.tmp/x/y/f.txt", "newer file");
+    assert(WaitForInvalidation(cache, "MetadataCacheTest.tmp/x/y/f.txt"));
+
+    // Renaming a directory invalidates everything below it.
+    rename("MetadataCacheTest.tmp", "MetadataCacheTest2.tmp");
+    assert(WaitForInvalidation(cache, "MetadataCacheTest.tmp/a.txt"));
+    assert(WaitForInvalidation(cache, "MetadataCacheTest.tmp"));
+  }
+  const char* dirs[] = { "x", "x_old" };
+  for (size_t i = 0; i < 2; i++) {
+    string dir = string("MetadataCacheTest2.tmp/") + dirs[i];
+    remove((dir + "/y/f.txt").c_str());
+    rmdir((dir + "/y").c_str());
+    rmdir(dir.c_str());
+  }
+  remove("MetadataCacheTest2.tmp/a.txt");
+  rmdir("MetadataCacheTest2.tmp");
+}
+
+#endif
+
+#else
+
+MetadataCache::MetadataCache(int aNotify)
+  : mNotify(aNotify),
+    mMonitor(0),
+    mThread(0),
+    mShutdown(true)
+{
+}
+
+MetadataCache::~MetadataCache() {
+}
+
+bool MetadataCache::IsSupported() {
+  return false;
+}
+
+void MetadataCache::Init() {
+}
+
+void MetadataCache::Shutdown() {
+}
+
+MetadataCache::Entry* MetadataCache::Lookup(const string& aPath) {
+  return 0;
+}
+
+MetadataCache::Entry* MetadataCache::Insert(const string& aPath,
+                                            const char* aContentType)
+{
+  return 0;
+}
+
+void MetadataCache::Release(Entry* aEntry) {
+}
+
+bool MetadataCache::WatchDirectory(const string& aDir, string& aKey) {
+  return false;
+}
+
+void MetadataCache::Run() {
+}
+
+#ifdef _DEBUG
+void MetadataCache::Test() {
+}
+#endif
+
+#endif
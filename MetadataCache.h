@@ -0,0 +1,187 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __METADATA_CACHE_H__
+#define __METADATA_CACHE_H__
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include "Thread.h"
+#include "Utils.h"
+
+class ListingCache;
+class LiveFanout;
+struct inotify_event;
+
+// Cache of what a response needs to know about a file before it can
+// start: its size, modification time, whether it's a directory, its
+// content type, and an open descriptor. Entries are invalidated when the
+// file or a directory above it changes, as reported by inotify, so a hit
+// needs no system calls. Only available on Linux; elsewhere Get() returns
+// null. Thread safe.
+class MetadataCache : public Runnable {
+public:
+  class Entry {
+  public:
+    int64_t Length() const {
+      return mLength;
+    }
+    // Seconds since the epoch.
+    int64_t Modified() const {
+      return mModified;
+    }
+    uint64_t Inode() const {
+      return mInode;
+    }
+    bool IsDirectory() const {
+      return mIsDirectory;
+    }
+    const char* ContentType() const {
+      return mContentType;
+    }
+    // Read-only descriptor for a regular file, or -1. It's shared by all
+    // users of the entry, so must only be read at explicit offsets, e.g.
+    // with Socket::SendFile().
+    int Descriptor() const {
+      return mDescriptor;
+    }
+  private:
+    friend class MetadataCache;
+    Entry() : mLength(0), mModified(0), mInode(0), mIsDirectory(false),
+              mContentType(0), mDescriptor(-1), mRefCount(0),
+              mCached(false) {}
+    string mPath;
+    int64_t mLength;
+    int64_t mModified;
+    uint64_t mInode;
+    bool mIsDirectory;
+    const char* mContentType;
+    int mDescriptor;
+    unsigned mRefCount;
+    // False once invalidated or evicted; the entry is then destroyed when
+    // its last reference is released.
+    bool mCached;
+    std::list<Entry*>::iterator mLRU;
+  };
+
+  ~MetadataCache();
+
+  static bool IsSupported();
+
+  // Creates the cache returned by Get(), and starts watching for changes.
+  static void Init();
+  static void Shutdown();
+
+  static MetadataCache* Get() {
+    return sInstance;
+  }
+
+  // Returns the entry for aPath, relative to the working directory, with a
+  // reference held, or null if it isn't cached.
+  Entry* Lookup(const string& aPath);
+
+  // Reads the metadata of aPath and caches it with content type
+  // aContentType, which must be a string literal. Returns the new entry
+  // with a reference held, or null if the file can't be opened.
+  Entry* Insert(const string& aPath, const char* aContentType);
+
+  void Release(Entry* aEntry);
+
+  // Ensures changes to the entries of directory aDir are reported, to
+  // ListingCache as well. Sets aKey to aDir normalized, which is empty for
+  // the working directory. Returns false if aDir can't be watched.
+  bool WatchDirectory(const string& aDir, string& aKey);
+
+  // Processes change notifications until shut down.
+  virtual void Run();
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  MetadataCache(int aNotify);
+
+  // Returns aPath with redundant separators and "." components removed.
+  static string Normalize(const string& aPath);
+
+  // Whether normalized aPath is aDir or below it; everything is below "".
+  static bool IsWithin(const string& aPath, const string& aDir);
+
+  // Ensures changes to entries of directory aDir are reported, and
+  // renames of aDir or any directory above it. Called with the lock held.
+  bool Watch(const string& aDir);
+
+  // Stops watching aPath, and every directory below it, under those
+  // names. Called with the lock held.
+  void Unwatch(const string& aPath);
+
+  // Applies the change notifications in aBuffer.
+  void HandleEvents(const char* aBuffer, size_t aLength);
+
+  // Applies aEvent to the entries below aDir, one of the paths of the
+  // directory it's for. Called with the lock held.
+  void HandleEvent(const struct inotify_event* aEvent,
+                   const string& aDir,
+                   ListingCache* aListings,
+                   LiveFanout* aLive);
+
+  // Invalidates aPath, and everything below it if it's a directory.
+  // Called with the lock held.
+  void Invalidate(const string& aPath);
+  void InvalidateAll();
+
+  // Removes aEntry from the cache, destroying it if it's unreferenced.
+  // Called with the lock held.
+  void Remove(Entry* aEntry);
+  static void Destroy(Entry* aEntry);
+
+  static MetadataCache* sInstance;
+
+  // inotify descriptor.
+  int mNotify;
+  Monitor* mMonitor;
+  Thread* mThread;
+  bool mShutdown;
+  std::map<string, Entry*> mEntries;
+  // Cached entries, most recently used first.
+  std::list<Entry*> mLRU;
+  // Watched directories, by path and by watch descriptor. A directory
+  // reached through several paths (e.g. through a symlink) has one watch
+  // descriptor for all of them. Every watched directory's ancestors are
+  // watched too.
+  std::map<string, int> mWatches;
+  std::map<int, std::vector<string> > mWatchedDirs;
+};
+
+#endif
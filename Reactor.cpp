@@ -0,0 +1,229 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Log.h"
+#include "Reactor.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64
+
+// Upper bound on how long we block in epoll_wait(), in milliseconds.
+#define MAX_WAIT 500
+
+// Interval between timer lateness reports, in microseconds.
+#define REPORT_INTERVAL 1000000
+
+Reactor::Reactor(Socket* aListener, bool aUseRing)
+  : mListener(aListener),
+    mUseRing(aUseRing),
+    mRing(0),
+    mEpoll(epoll_create1(EPOLL_CLOEXEC)),
+    mTimers(GetMonotonicTime()),
+    mNextReport(GetMonotonicTime() + REPORT_INTERVAL)
+{
+}
+
+Reactor::~Reactor() {
+  std::set<Client*>::iterator itr;
+  for (itr = mClients.begin(); itr != mClients.end(); itr++) {
+    mTimers.Cancel(*itr);
+    delete *itr;
+  }
+  // Connections' sockets may refer to the ring.
+  delete mRing;
+  if (mEpoll >= 0) {
+    close(mEpoll);
+  }
+}
+
+bool Reactor::IsSupported() {
+  return true;
+}
+
+bool Reactor::Run(volatile bool* aRunning) {
+  if (mEpoll < 0) {
+    perror("epoll_create1");
+    return false;
+  }
+
+  // The listener is tagged with a null pointer, connections with their
+  // Client.
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = 0;
+  if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mListener->GetDescriptor(), &ev) < 0) {
+    perror("Can't register listener");
+    return false;
+  }
+
+  if (mUseRing) {
+    mRing = IoRing::Create();
+    if (!mRing) {
+      LOG(LOG_WARNING, "io_uring unavailable, sending with system calls");
+    } else {
+      // Tagged with the ring, and level-triggered, so we keep waking
+      // while completions remain.
+      ev.events = EPOLLIN;
+      ev.data.ptr = mRing;
+      if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mRing->GetDescriptor(), &ev) < 0) {
+        perror("Can't register io_uring");
+        return false;
+      }
+    }
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (*aRunning) {
+    int n = epoll_wait(mEpoll, events, MAX_EVENTS, NextTimeout());
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return false;
+    }
+    for (int i = 0; i < n; i++) {
+      if (mRing && events[i].data.ptr == mRing) {
+        // Reaped by RunRing().
+        continue;
+      }
+      Client* c = static_cast<Client*>(events[i].data.ptr);
+      if (!c) {
+        AcceptConnections();
+      } else {
+        // Errors and hangups are reported by the next Send()/Receive().
+        Dispatch(c);
+      }
+    }
+    RunTimers();
+    if (mRing) {
+      RunRing();
+    }
+  }
+  return true;
+}
+
+void Reactor::AcceptConnections() {
+  // Edge-triggered, so drain every pending connection.
+  while (Socket* socket = mListener->Accept(true)) {
+    Client* c = new Client(socket, mRing);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, socket->GetDescriptor(), &ev) < 0) {
+      perror("Can't register connection");
+      delete c;
+      continue;
+    }
+    mClients.insert(c);
+    Dispatch(c);
+  }
+}
+
+void Reactor::Dispatch(Client* aClient) {
+  mTimers.Cancel(aClient);
+  Connection::eWait wait = aClient->mConnection.Process();
+  if (wait == Connection::CLOSED) {
+    // Closing the socket removes it from the epoll set, but a socket with
+    // a ring send in flight is only closed once the send completes, so
+    // remove it now; its events would otherwise refer to a deleted Client.
+    if (mRing) {
+      epoll_ctl(mEpoll, EPOLL_CTL_DEL, aClient->mDescriptor, 0);
+    }
+    mClients.erase(aClient);
+    delete aClient;
+  } else if (wait == Connection::WAIT_TIMER ||
+             wait == Connection::WAIT_READABLE) {
+    // Readable connections are also woken at their idle deadline.
+    mTimers.Schedule(aClient, aClient->mConnection.GetWakeTime());
+  }
+  // Otherwise we'll be woken by the next readiness edge.
+}
+
+void Reactor::RunTimers() {
+  int64_t now = GetMonotonicTime();
+  std::vector<TimerWheel::Entry*> expired;
+  mTimers.Advance(now, expired);
+  for (size_t i = 0; i < expired.size(); i++) {
+    Dispatch(static_cast<Client*>(expired[i]));
+  }
+  if (now >= mNextReport) {
+    Histogram& lateness = mTimers.Lateness();
+    if (lateness.Count() > 0) {
+      LOG(LOG_INFO, "Reactor lateness (us): %s", lateness.Summary().c_str());
+      lateness.Reset();
+    }
+    mNextReport = now + REPORT_INTERVAL;
+  }
+}
+
+void Reactor::RunRing() {
+  std::vector<void*> ready;
+  mRing->Reap(ready);
+  for (size_t i = 0; i < ready.size(); i++) {
+    Dispatch(static_cast<Client*>(ready[i]));
+  }
+  mRing->Submit();
+}
+
+int Reactor::NextTimeout() const {
+  int64_t delay = mTimers.NextTimeout(GetMonotonicTime(), MAX_WAIT * 1000);
+  // Round up, so we don't wake before the timer is due.
+  return (int)((delay + 999) / 1000);
+}
+
+#else
+
+Reactor::Reactor(Socket* aListener, bool aUseRing)
+  : mListener(aListener),
+    mUseRing(aUseRing),
+    mRing(0),
+    mEpoll(-1),
+    mTimers(0),
+    mNextReport(0)
+{
+}
+
+Reactor::~Reactor() {
+}
+
+bool Reactor::IsSupported() {
+  return false;
+}
+
+bool Reactor::Run(volatile bool* aRunning) {
+  return false;
+}
+
+#endif
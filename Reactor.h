@@ -0,0 +1,100 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <set>
+
+#include "Connection.h"
+#include "IoRing.h"
+#include "Sockets.h"
+#include "TimerWheel.h"
+
+// Serves every connection from a single thread. Sockets are non-blocking
+// and registered edge-triggered with epoll; each readiness event or
+// expired pacing timer resumes the connection's state machine until it
+// would block again. Optionally, connections send through an io_uring,
+// so that the small sends of a whole pass of the loop are submitted
+// together; file segments are submitted as soon as they're queued.
+// Only available on Linux.
+class Reactor {
+public:
+  // If aUseRing, sends go through an io_uring where the kernel supports
+  // it, and through plain system calls otherwise.
+  Reactor(Socket* aListener, bool aUseRing);
+  ~Reactor();
+
+  static bool IsSupported();
+
+  // Runs the event loop until *aRunning becomes false. Returns false if
+  // the loop could not be started.
+  bool Run(volatile bool* aRunning);
+
+private:
+  // A connection, and its pacing/idle timer.
+  struct Client : public TimerWheel::Entry {
+    Client(Socket* aSocket, IoRing* aRing)
+      : mDescriptor(aSocket->GetDescriptor()),
+        mConnection(aRing ? aRing->Wrap(aSocket, this) : aSocket) {}
+    // The socket's descriptor, as registered with epoll.
+    int mDescriptor;
+    Connection mConnection;
+  };
+
+  void AcceptConnections();
+
+  // Resumes aClient, and reschedules or destroys it depending on what
+  // it's waiting for next.
+  void Dispatch(Client* aClient);
+
+  // Resumes all connections whose wake time has passed, and periodically
+  // reports how late they were.
+  void RunTimers();
+
+  // Resumes connections whose ring sends have completed, then submits
+  // everything queued during this pass of the loop.
+  void RunRing();
+
+  // Milliseconds until the next timer is due, capped so that shutdown
+  // requests are noticed promptly.
+  int NextTimeout() const;
+
+  Socket* mListener;
+  bool mUseRing;
+  IoRing* mRing;
+  int mEpoll;
+  std::set<Client*> mClients;
+  TimerWheel mTimers;
+  int64_t mNextReport;
+};
+
+#endif
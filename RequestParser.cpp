@@ -32,196 +32,577 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <iostream>
 
+#include "Log.h"
 #include "RequestParser.h"
+#include "Thread.h"
 
-static int gCount = 0;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned CountTrailingZeros(unsigned x) {
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return index;
+}
+#else
+static inline unsigned CountTrailingZeros(unsigned x) {
+  return __builtin_ctz(x);
+}
+#endif
+
+// Source of request ids; requests are parsed on many threads.
+static volatile int gCount = 0;
+
+static inline char ToLowerAscii(char c) {
+  return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+}
+
+// Returns true if [aBegin, aEnd) equals aLiteral, ignoring ASCII case.
+static bool EqualsNoCase(const char* aBegin,
+                         const char* aEnd,
+                         const char* aLiteral)
+{
+  for (; aBegin < aEnd; aBegin++, aLiteral++) {
+    if (!*aLiteral || ToLowerAscii(*aBegin) != ToLowerAscii(*aLiteral)) {
+      return false;
+    }
+  }
+  return !*aLiteral;
+}
+
+static bool Equals(const char* aBegin, const char* aEnd, const char* aLiteral) {
+  size_t length = strlen(aLiteral);
+  return (size_t)(aEnd - aBegin) == length &&
+         memcmp(aBegin, aLiteral, length) == 0;
+}
+
+static bool IsSpace(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Parses the decimal number in [aBegin, aEnd) into aValue. Returns false
+// if the range is empty, contains anything but digits, or the number is
+// too large.
+static bool ParseDigits(const char* aBegin, const char* aEnd, int64_t& aValue) {
+  if (aBegin == aEnd || aEnd - aBegin > 18) {
+    return false;
+  }
+  aValue = 0;
+  for (; aBegin < aEnd; aBegin++) {
+    if (*aBegin < '0' || *aBegin > '9') {
+      return false;
+    }
+    aValue = aValue * 10 + (*aBegin - '0');
+  }
+  return true;
+}
+
+// Most ranges accepted in one Range header. Requests for more are served
+// the entire file, rather than a multipart response with a part for each.
+#define MAX_RANGES 100
 
 RequestParser::RequestParser()
-  : start(0),
+  : id(AtomicAdd(&gCount, 1) - 1),
+    start(0),
+    scanned(0),
     complete(false),
     method(UNKNOWN),
-    rangeStart(-1),
-    rangeEnd(-1),
-    hasRange(false),
-    id(gCount++)
+    targetOffset(0),
+    targetLength(0),
+    acceptedEncodings(0),
+    http11(false),
+    connectionClose(false),
+    connectionKeepAlive(false)
 {
 }
 
 void RequestParser::Add(const char* buf, unsigned len) {
   assert(!complete);
-  string str(buf, len);
-  request += str;
-  const char* linebr = "\r\n";
-  assert(linebr[0] == 13);
-  assert(linebr[1] == 10);
-  // Continue to parse request.
-  while (start < request.size()) {
-    size_t end = request.find(linebr, start, 2);
-    if (end == string::npos)
-      break;
-    if (start == end)
-      complete = true;
-    string l = string(request, start, end - start);
-    Parse(l);
-    start = end + 2;
-  }
-  cout << "Request " << id << std::endl << buf;
+  request.append(buf, len);
+  ParseBuffered();
+}
+
+const char* RequestParser::Find(const char* aBegin,
+                                const char* aEnd,
+                                char aByte)
+{
+  const char* p = aBegin;
+#ifdef HAVE_AVX2
+  const __m256i needle32 = _mm256_set1_epi8(aByte);
+  for (; aEnd - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+    unsigned mask =
+      (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32));
+    if (mask) {
+      return p + CountTrailingZeros(mask);
+    }
+  }
+#endif
+#ifdef HAVE_SSE2
+  const __m128i needle16 = _mm_set1_epi8(aByte);
+  for (; aEnd - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    unsigned mask =
+      (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16));
+    if (mask) {
+      return p + CountTrailingZeros(mask);
+    }
+  }
+#endif
+  for (; p < aEnd; p++) {
+    if (*p == aByte) {
+      return p;
+    }
+  }
+  return aEnd;
+}
+
+void RequestParser::ParseBuffered() {
+  // Continue to parse request. Anything after the blank line which ends
+  // the headers belongs to the next (pipelined) request.
+  const char* base = request.data();
+  const char* end = base + request.size();
+  while (!complete) {
+    const char* cr = Find(base + scanned, end, '\r');
+    if (end - cr < 2) {
+      // No complete line end yet. If the CR arrived, resume from it.
+      scanned = cr - base;
+      return;
+    }
+    if (cr[1] != '\n') {
+      scanned = cr - base + 1;
+      continue;
+    }
+    ParseLine(base + start, cr - (base + start));
+    start = scanned = cr - base + 2;
+  }
+  LOG(LOG_DEBUG, "Request %d: %.*s",
+      id, (int)(Find(base, base + start, '\r') - base), base);
+}
+
+void RequestParser::Reset() {
+  assert(complete);
+  request.erase(0, start);
+  start = 0;
+  scanned = 0;
+  complete = false;
+  method = UNKNOWN;
+  targetOffset = 0;
+  targetLength = 0;
+  params.clear();
+  ranges.clear();
+  acceptedEncodings = 0;
+  ifNoneMatch.clear();
+  ifModifiedSince.clear();
+  ifRange.clear();
+  http11 = false;
+  connectionClose = false;
+  connectionKeepAlive = false;
+  id = AtomicAdd(&gCount, 1) - 1;
+  ParseBuffered();
+}
+
+bool RequestParser::IsKeepAlive() const {
+  if (connectionClose) {
+    return false;
+  }
+  // HTTP/1.1 connections are persistent unless the client says otherwise,
+  // HTTP/1.0 connections only if the client asks.
+  return http11 || connectionKeepAlive;
 }
 
 #ifdef _DEBUG
 void RequestParser::Test() {
-  assert(ExtractMethod("GET / HTTP1.1") == GET);
-  assert(ExtractMethod("HEAD / HTTP1.1") == HEAD);
-  assert(ExtractMethod("POST / HTTP1.1") == POST);
-  assert(ExtractMethod("Error / HTTP1.1") == UNKNOWN);
-
-  assert(ExtractTarget("GET / HTTP1.1") == "");
-  assert(ExtractTarget("GET // HTTP1.1") == "");
-  assert(ExtractTarget("GET /// HTTP1.1") == "");
-  assert(ExtractTarget("GET /dir/file.txt HTTP1.1") == "dir/file.txt");
-  assert(ExtractTarget("GET /dir/file.txt?params HTTP1.1") == "dir/file.txt");
-  assert(ExtractTarget("GET /?params HTTP1.1") == "");
-  assert(ExtractTarget("GET //?params HTTP1.1") == "");
-
-  assert(Flatten(ExtractQueryParams("GET / HTTP1.1")) == "");
-
-  assert(Flatten(ExtractQueryParams("GET // HTTP1.1")) == "");
-  assert(Flatten(ExtractQueryParams("GET /// HTTP1.1")) == "");
-  assert(Flatten(ExtractQueryParams("GET /dir/file.txt HTTP1.1")) == "");
-  assert(Flatten(ExtractQueryParams("GET /dir/file.txt? HTTP1.1")) == "");
-  assert(Flatten(ExtractQueryParams("GET /dir/file.txt?params HTTP1.1")) == "params=''");
-  assert(Flatten(ExtractQueryParams("GET /dir/file.txt?param1&param2&param3 HTTP1.1")) == "param1='' param2='' param3=''");
-  assert(Flatten(ExtractQueryParams("GET /dir/file.txt?param1=val1&param2=val2&param3=val3 HTTP1.1")) == "param1='val1' param2='val2' param3='val3'");
-  assert(Flatten(ExtractQueryParams("GET /?params HTTP1.1")) == "params=''");
-  assert(Flatten(ExtractQueryParams("GET /? HTTP1.1")) == "");
-  assert(Flatten(ExtractQueryParams("GET //?params HTTP1.1")) == "params=''");
-
-  assert(TestRange(true, "Range: bytes=0-1024", 0, 1024));
-  assert(TestRange(false, "Range: time=0-1024", 0, 0));
-  assert(TestRange(true, "Range: bytes=0-", 0, -1));
-  assert(TestRange(true, "Range: bytes=1024-", 1024, -1));
-  assert(TestRange(true, "Range: bytes=232128512-", 232128512, -1));
+  const char* data = "xx\r\nabc:def\r\n";
+  assert(Find(data, data + 13, '\r') == data + 2);
+  assert(Find(data, data + 13, 'z') == data + 13);
+  string longLine(100, 'a');
+  longLine[70] = ':';
+  assert(Find(longLine.data(), longLine.data() + 100, ':') ==
+         longLine.data() + 70);
+
+  assert(TestRequestLine("GET / HTTP1.1", GET, "", ""));
+  assert(TestRequestLine("HEAD / HTTP1.1", HEAD, "", ""));
+  assert(TestRequestLine("POST / HTTP1.1", POST, "", ""));
+  assert(TestRequestLine("Error / HTTP1.1", UNKNOWN, "", ""));
+
+  assert(TestRequestLine("GET // HTTP1.1", GET, "", ""));
+  assert(TestRequestLine("GET /// HTTP1.1", GET, "", ""));
+  assert(TestRequestLine("GET /dir/file.txt HTTP1.1", GET, "dir/file.txt", ""));
+  assert(TestRequestLine("GET /dir/file.txt? HTTP1.1", GET, "dir/file.txt", ""));
+  assert(TestRequestLine("GET /dir/file.txt?params HTTP1.1", GET, "dir/file.txt", "params=''"));
+  assert(TestRequestLine("GET /dir/file.txt?param1&param2&param3 HTTP1.1", GET, "dir/file.txt", "param1='' param2='' param3=''"));
+  assert(TestRequestLine("GET /dir/file.txt?param1=val1&param2=val2&param3=val3 HTTP1.1", GET, "dir/file.txt", "param1='val1' param2='val2' param3='val3'"));
+  assert(TestRequestLine("GET /?params HTTP1.1", GET, "", "params=''"));
+  assert(TestRequestLine("GET /? HTTP1.1", GET, "", ""));
+  assert(TestRequestLine("GET //?params HTTP1.1", GET, "", "params=''"));
+
+  assert(TestRange(true, "Range: bytes=0-1024", "0-1024"));
+  assert(TestRange(false, "Range: time=0-1024", ""));
+  assert(TestRange(true, "Range: bytes=0-", "0-"));
+  assert(TestRange(true, "Range: bytes=1024-", "1024-"));
+  assert(TestRange(true, "Range: bytes=232128512-", "232128512-"));
+  assert(TestRange(true, "Range: bytes=-500", "-500"));
+  assert(TestRange(true, "Range: bytes=0-99, 200-299 ,-10", "0-99,200-299,-10"));
+  assert(TestRange(true, "Range: bytes=5-5,,7-", "5-5,7-"));
+  assert(TestRange(false, "Range: bytes=10-5", ""));
+  assert(TestRange(false, "Range: bytes=-", ""));
+  assert(TestRange(false, "Range: bytes=0-99,x-", ""));
+  assert(TestRange(false, "Range: bytes=1-2-3", ""));
+  assert(TestRange(false, "Range: bytes=99999999999999999999-", ""));
+  assert(TestRange(false, "Range: bytes=,", ""));
+
+  // Persistent connections and pipelining.
+  RequestParser p;
+  string pipelined("GET /a HTTP/1.1\r\nHost: x\r\n\r\n"
+                   "GET /b?live HTTP/1.0\r\n\r\n"
+                   "HEAD /c HTTP/1.1\r\nconnection: Close\r\n\r\n"
+                   "GET /d HTTP/1.0\r\nConnection: keep-alive\r\n");
+  p.Add(pipelined.c_str(), (unsigned)pipelined.size());
+  assert(p.IsComplete() && p.GetTarget() == "a" && p.IsKeepAlive());
+  p.Reset();
+  assert(p.IsComplete() && p.GetTarget() == "b" && !p.IsKeepAlive());
+  assert(p.IsLive());
+  p.Reset();
+  assert(p.IsComplete() && p.GetMethod() == HEAD && !p.IsKeepAlive());
+  p.Reset();
+  assert(!p.IsComplete() && p.GetTarget() == "d");
+  p.Add("\r\n", 2);
+  assert(p.IsComplete() && p.IsKeepAlive());
+
+  // Requests arriving a byte at a time, with line ends split across reads.
+  RequestParser q;
+  string split("GET /e HTTP/1.1\r\nRange: bytes=5-9\r\nX: a\rb\r\n\r\n");
+  for (size_t i = 0; i < split.size(); i++) {
+    assert(!q.IsComplete());
+    q.Add(&split[i], 1);
+  }
+  assert(q.IsComplete() && q.GetTarget() == "e" && q.IsRangeRequest());
+  assert(q.GetRanges().size() == 1);
+  assert(q.GetRanges()[0].first == 5 && q.GetRanges()[0].last == 9);
+
+  assert(ParseAcceptEncoding("", "") == 0);
+  struct {
+    const char* mValue;
+    unsigned mExpected;
+  } encodings[] = {
+    { "gzip, deflate, br", ENCODING_GZIP | ENCODING_BROTLI },
+    { " GZIP ;q=1.0 , identity", ENCODING_GZIP },
+    { "x-gzip", ENCODING_GZIP },
+    { "br;q=0.5", ENCODING_BROTLI },
+    { "gzip;q=0, br", ENCODING_BROTLI },
+    { "gzip; q=0.000", 0 },
+    { "gzip;q=0.01", ENCODING_GZIP },
+    { "*", ENCODING_GZIP | ENCODING_BROTLI },
+    { "*;q=0", 0 },
+    { "br;q=0, *", ENCODING_GZIP },
+    { "deflate", 0 }
+  };
+  for (unsigned i = 0; i < ARRAY_LENGTH(encodings); i++) {
+    const char* e = encodings[i].mValue;
+    assert(ParseAcceptEncoding(e, e + strlen(e)) == encodings[i].mExpected);
+  }
+
+  // Conditional headers, which don't carry over to the next request.
+  RequestParser c;
+  string conditional("GET /f HTTP/1.1\r\nif-none-match:  \"a\", W/\"b\" \r\n"
+                     "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                     "If-Range: \"a\"\r\n\r\n"
+                     "GET /g HTTP/1.1\r\n\r\n");
+  c.Add(conditional.c_str(), (unsigned)conditional.size());
+  assert(c.GetIfNoneMatch() == "\"a\", W/\"b\"");
+  assert(c.GetIfModifiedSince() == "Sun, 06 Nov 1994 08:49:37 GMT");
+  assert(c.GetIfRange() == "\"a\"");
+  c.Reset();
+  assert(c.IsComplete() && c.GetIfNoneMatch().empty() &&
+         c.GetIfModifiedSince().empty() && c.GetIfRange().empty());
 }
-#endif
 
-void RequestParser::GetRange(int64_t& start, int64_t& end) const {
-  start = rangeStart;
-  end = rangeEnd;
+bool RequestParser::TestRequestLine(const char* aLine,
+                                    eMethod aMethod,
+                                    const char* aTarget,
+                                    const char* aParams)
+{
+  RequestParser p;
+  string request = string(aLine) + "\r\n\r\n";
+  p.Add(request.c_str(), (unsigned)request.size());
+  return p.IsComplete() &&
+         p.GetMethod() == aMethod &&
+         p.GetTarget() == aTarget &&
+         Flatten(p.GetParams()) == aParams;
 }
+#endif
 
 bool RequestParser::TestRange(bool expected,
                               const string& s,
-                              int64_t expStart,
-                              int64_t expEnd)
+                              const char* expRanges)
 {
-  int64_t start=-2, end=-2;
-  bool r = ParseRange(s, start, end);
-  return r == expected &&
-          (!expected || start == expStart && end == expEnd);
+  vector<ByteRange> ranges;
+  const char* begin = s.data();
+  const char* colon = Find(begin, begin + s.size(), ':');
+  bool r = colon != begin + s.size() &&
+           ParseRange(colon + 1, begin + s.size(), ranges);
+  // Flatten the ranges back into the header's syntax.
+  string flat;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (i > 0) {
+      flat += ",";
+    }
+    if (ranges[i].first != -1) {
+      flat += ToString(ranges[i].first);
+    }
+    flat += "-";
+    if (ranges[i].last != -1) {
+      flat += ToString(ranges[i].last);
+    }
+  }
+  return r == expected && flat == expRanges;
 }
 
-void RequestParser::Parse(const string& s) {
-  if (start == 0) {
+void RequestParser::ParseLine(const char* aLine, size_t aLength) {
+  const char* end = aLine + aLength;
+  if (aLength == 0) {
+    // Blank line, end of request.
+    complete = true;
+  } else if (start == 0) {
     // Request line.
-    ParseRequestLine(s);
-  } else if (s.find("Range") == 0) {
-    int64_t start,end;
-    if (ParseRange(s, start, end)) {
-      rangeStart = start;
-      rangeEnd = end;
-      hasRange = true;
+    ParseRequestLine(aLine, end);
+  } else {
+    const char* colon = Find(aLine, end, ':');
+    if (colon == end) {
+      return;
+    }
+    // The headers we interpret all have names of different lengths, so
+    // most lines are rejected without comparing their names.
+    switch (colon - aLine) {
+      case 5:
+        if (EqualsNoCase(aLine, colon, "Range")) {
+          ParseRange(colon + 1, end, ranges);
+        }
+        break;
+      case 8:
+        if (EqualsNoCase(aLine, colon, "If-Range")) {
+          ParseValue(colon + 1, end, ifRange);
+        }
+        break;
+      case 10:
+        if (EqualsNoCase(aLine, colon, "Connection")) {
+          ParseConnection(colon + 1, end);
+        }
+        break;
+      case 13:
+        if (EqualsNoCase(aLine, colon, "If-None-Match")) {
+          ParseValue(colon + 1, end, ifNoneMatch);
+        }
+        break;
+      case 15:
+        if (EqualsNoCase(aLine, colon, "Accept-Encoding")) {
+          acceptedEncodings = ParseAcceptEncoding(colon + 1, end);
+        }
+        break;
+      case 17:
+        if (EqualsNoCase(aLine, colon, "If-Modified-Since")) {
+          ParseValue(colon + 1, end, ifModifiedSince);
+        }
+        break;
     }
   }
 }
 
-bool RequestParser::ParseRange(const string& s,
-                               int64_t& start,
-                               int64_t& end)
+void RequestParser::ParseValue(const char* aValue,
+                               const char* aEnd,
+                               string& aOut)
 {
-  // Range: bytes=start,end
-  size_t sp = s.find(" ");
-  size_t eq = s.find("=");
-  if (sp == string::npos || eq == string::npos)
-    return false;
-  string bytes(s, sp + 1, eq - sp - 1);
-  if (bytes != "bytes") {
-    // The space is not followed by "bytes=", this is an invalid range param.
-    return false;
+  while (aValue < aEnd && IsSpace(*aValue)) {
+    aValue++;
   }
-
-  string range(s, eq + 1);
-  size_t dash = range.find("-");
-  if (dash == string::npos)
-    return false;
-  string startStr(range, 0, dash);
-  string endStr(range, dash + 1);
-
-  start = atoll(startStr.c_str());
-  if (endStr != "") {
-    end = atoll(endStr.c_str());
-  } else {
-    end = -1;
+  while (aEnd > aValue && IsSpace(aEnd[-1])) {
+    aEnd--;
   }
+  aOut.assign(aValue, aEnd);
+}
 
-  return true;
+unsigned RequestParser::ParseAcceptEncoding(const char* aValue,
+                                            const char* aEnd)
+{
+  // A comma separated list of codings, each optionally with a quality
+  // value, e.g. "gzip, br;q=0.8, *;q=0". Quality zero refuses a coding.
+  unsigned accepted = 0;
+  unsigned refused = 0;
+  unsigned wildcard = 0;
+  while (aValue < aEnd) {
+    const char* comma = Find(aValue, aEnd, ',');
+    const char* semicolon = Find(aValue, comma, ';');
+    const char* tokenEnd = semicolon;
+    while (aValue < tokenEnd && IsSpace(*aValue)) {
+      aValue++;
+    }
+    while (tokenEnd > aValue && IsSpace(tokenEnd[-1])) {
+      tokenEnd--;
+    }
+    bool zero = false;
+    if (semicolon != comma) {
+      const char* q = Find(semicolon, comma, '=');
+      if (q != comma) {
+        // Zero if only zeros and a point follow, e.g. "0" or "0.000".
+        zero = true;
+        for (q++; q < comma && !IsSpace(*q); q++) {
+          if (*q != '0' && *q != '.') {
+            zero = false;
+          }
+        }
+      }
+    }
+    unsigned coding = 0;
+    if (EqualsNoCase(aValue, tokenEnd, "gzip") ||
+        EqualsNoCase(aValue, tokenEnd, "x-gzip")) {
+      coding = ENCODING_GZIP;
+    } else if (EqualsNoCase(aValue, tokenEnd, "br")) {
+      coding = ENCODING_BROTLI;
+    } else if (Equals(aValue, tokenEnd, "*")) {
+      wildcard = zero ? 0 : ENCODING_GZIP | ENCODING_BROTLI;
+    }
+    if (zero) {
+      refused |= coding;
+    } else {
+      accepted |= coding;
+    }
+    aValue = comma + 1;
+  }
+  // Codings not named are covered by the wildcard.
+  return (accepted | (wildcard & ~accepted)) & ~refused;
 }
 
-eMethod RequestParser::ExtractMethod(const string& request) {
-  size_t sp = request.find(" ");
-  string m(request, 0, sp);
-  if (m == "GET")
-    return GET;
-  else if (m == "HEAD")
-    return HEAD;
-  else if (m == "POST")
-    return POST;
-  return UNKNOWN;
+void RequestParser::ParseConnection(const char* aValue, const char* aEnd) {
+  // A comma separated list of options.
+  while (aValue < aEnd) {
+    const char* comma = Find(aValue, aEnd, ',');
+    const char* tokenEnd = comma;
+    while (aValue < tokenEnd && IsSpace(*aValue)) {
+      aValue++;
+    }
+    while (tokenEnd > aValue && IsSpace(tokenEnd[-1])) {
+      tokenEnd--;
+    }
+    if (EqualsNoCase(aValue, tokenEnd, "close")) {
+      connectionClose = true;
+    } else if (EqualsNoCase(aValue, tokenEnd, "keep-alive")) {
+      connectionKeepAlive = true;
+    }
+    aValue = comma + 1;
+  }
 }
 
-string RequestParser::ExtractTarget(const string& request) {
-  size_t start = request.find("/") + 1;
-  size_t query = request.find("?", start); // Location of query params.
-  size_t end = (query != string::npos) ? query : request.find(" ", start);
-  // Remove trailing slashes.
-  while (end > start && request.at(end - 1) == '/') {
-    end--;
-  }
-  return string(request, start, end - start);
-}
-
-map<string, string> RequestParser::ExtractQueryParams(const string& request) {
-  map<string,string> m;
-  size_t query = request.find("?");
-  if (query == string::npos)
-    return m;
-  size_t start = query + 1;
-  size_t end = request.find(" ", start);
-  vector<string> v;
-  Tokenize(string(request, start, end - start), v, "&");
-  for (unsigned i=0; i<v.size(); i++) {
-    size_t eq = v[i].find("=");
-    string key;
-    string value;
-    if (eq == string::npos) {
-      key = v[i];
-      value = "";
-    } else {
-      key = string(v[i], 0, eq);
-      value = string(v[i], eq + 1, v[i].size() - eq - 1);
+bool RequestParser::ParseRange(const char* aValue,
+                               const char* aEnd,
+                               vector<ByteRange>& aRanges)
+{
+  // Range: bytes=first-last, first-, -suffix, ...
+  aRanges.clear();
+  while (aValue < aEnd && IsSpace(*aValue)) {
+    aValue++;
+  }
+  const char* eq = Find(aValue, aEnd, '=');
+  if (eq == aEnd || !Equals(aValue, eq, "bytes")) {
+    // Not a byte range.
+    return false;
+  }
+  const char* spec = eq + 1;
+  while (spec < aEnd) {
+    const char* comma = Find(spec, aEnd, ',');
+    const char* specEnd = comma;
+    while (spec < specEnd && IsSpace(*spec)) {
+      spec++;
     }
-    m[key] = value;
+    while (specEnd > spec && IsSpace(specEnd[-1])) {
+      specEnd--;
+    }
+    // Empty list elements are allowed, and ignored.
+    if (spec != specEnd) {
+      const char* dash = Find(spec, specEnd, '-');
+      ByteRange range = { -1, -1 };
+      bool valid = dash != specEnd;
+      if (valid && dash == spec) {
+        // Suffix range.
+        valid = ParseDigits(dash + 1, specEnd, range.last);
+      } else if (valid) {
+        valid = ParseDigits(spec, dash, range.first) &&
+                (dash + 1 == specEnd ||
+                 (ParseDigits(dash + 1, specEnd, range.last) &&
+                  range.last >= range.first));
+      }
+      if (!valid || aRanges.size() == MAX_RANGES) {
+        aRanges.clear();
+        return false;
+      }
+      aRanges.push_back(range);
+    }
+    spec = comma + 1;
   }
-  return m;
+  return !aRanges.empty();
 }
 
-void RequestParser::ParseRequestLine(const string& request) {
+void RequestParser::ParseRequestLine(const char* aLine, const char* aEnd) {
   // Extract method.
-  method = ExtractMethod(request);
-  target = ExtractTarget(request);
-  params = ExtractQueryParams(request);
-  //printf("Target: '%s'\n", target.c_str());
-  //printf("Params: '%s'\n", Flatten(params).c_str());
+  const char* sp = Find(aLine, aEnd, ' ');
+  if (Equals(aLine, sp, "GET"))
+    method = GET;
+  else if (Equals(aLine, sp, "HEAD"))
+    method = HEAD;
+  else if (Equals(aLine, sp, "POST"))
+    method = POST;
+
+  // The target follows the first slash, up to the query or the next space.
+  const char* slash = Find(aLine, aEnd, '/');
+  const char* targetStart = (slash == aEnd) ? aEnd : slash + 1;
+  const char* uriEnd = Find(targetStart, aEnd, ' ');
+  const char* query = Find(targetStart, uriEnd, '?');
+  const char* targetEnd = query;
+  // Remove trailing slashes.
+  while (targetEnd > targetStart && targetEnd[-1] == '/') {
+    targetEnd--;
+  }
+  targetOffset = targetStart - request.data();
+  targetLength = targetEnd - targetStart;
+  if (query != uriEnd) {
+    ParseQueryParams(query + 1, uriEnd, params);
+  }
+
+  const char* version = aEnd;
+  while (version > aLine && version[-1] != ' ') {
+    version--;
+  }
+  http11 = version > aLine && Equals(version, aEnd, "HTTP/1.1");
+}
+
+void RequestParser::ParseQueryParams(const char* aQuery,
+                                     const char* aEnd,
+                                     map<string, string>& aParams)
+{
+  while (aQuery < aEnd) {
+    const char* amp = Find(aQuery, aEnd, '&');
+    if (amp > aQuery) {
+      const char* eq = Find(aQuery, amp, '=');
+      string& value = aParams[string(aQuery, eq)];
+      if (eq == amp) {
+        value.clear();
+      } else {
+        value.assign(eq + 1, amp);
+      }
+    }
+    aQuery = amp + 1;
+  }
 }
@@ -32,36 +32,92 @@
 #ifndef __REQUEST_PARSER_H__
 #define __REQUEST_PARSER_H__
 
+#include <assert.h>
+
 #include "Utils.h"
 
 enum eMethod { UNKNOWN, HEAD, GET, POST };
 
+// Content codings a client may accept, as flags.
+enum eEncoding {
+  ENCODING_GZIP = 1,
+  ENCODING_BROTLI = 2
+};
+
+// A byte-range-spec from a Range header, as the client sent it: bytes
+// first to last inclusive, with last -1 if the range runs to the end of
+// the file. For a suffix range, the final last bytes, first is -1.
+struct ByteRange {
+  int64_t first;
+  int64_t last;
+};
+
+// Incremental HTTP request parser. Received bytes are appended to a single
+// buffer, which is scanned for line ends in place; the request target is
+// recorded as an offset into the buffer rather than copied, and headers
+// are interpreted without temporary strings.
 class RequestParser {
 public:
   RequestParser();
 
   void Add(const char* buf, unsigned len);
 
-  bool IsComplete() {
+  // Prepares to parse the next request on a persistent connection. Data
+  // already received beyond the end of the current request is kept, so
+  // this may complete a pipelined request immediately.
+  void Reset();
+
+  bool IsComplete() const {
     return complete;
   }
 
-  eMethod GetMethod() {
+  eMethod GetMethod() const {
     return method;
   }
   
-  string GetTarget() {
-    return target;
+  string GetTarget() const {
+    return string(request, targetOffset, targetLength);
   }
 
   const map<string, string>& GetParams() const {
     return params;
   }
 
-  void GetRange(int64_t& start, int64_t& end) const;
+  // The ranges requested, in the order given. Empty unless the request
+  // had a valid byte Range header.
+  const vector<ByteRange>& GetRanges() const {
+    return ranges;
+  }
 
   bool IsRangeRequest() const {
-    return hasRange;
+    return !ranges.empty();
+  }
+
+  // Content codings the client accepts, as a mask of eEncoding flags.
+  unsigned GetAcceptedEncodings() const {
+    return acceptedEncodings;
+  }
+
+  // Values of the conditional request headers, or empty if not sent.
+  const string& GetIfNoneMatch() const {
+    return ifNoneMatch;
+  }
+
+  const string& GetIfModifiedSince() const {
+    return ifModifiedSince;
+  }
+
+  const string& GetIfRange() const {
+    return ifRange;
+  }
+
+  // True if the connection may be reused for another request, according
+  // to the HTTP version and Connection header.
+  bool IsKeepAlive() const;
+
+  // True for HTTP/1.1 requests, which accept chunked responses.
+  bool IsHttp11() const {
+    return http11;
   }
 
   bool IsLive() const {
@@ -77,40 +133,76 @@ public:
     return GetParams().find("mime")->second;
   }
 
-  const int id;
+  int id;
 
 #ifdef _DEBUG
   static void Test();
 #endif
 
 private:
+  // Times private helpers; see bench/MicroBench.cpp.
+  friend class MicroBench;
 
   static bool TestRange(bool expected,
                         const string& s,
-                        int64_t expStart,
-                        int64_t expEnd);
+                        const char* expRanges);
 
-  void Parse(const string& s);
+  static bool TestRequestLine(const char* aLine,
+                              eMethod aMethod,
+                              const char* aTarget,
+                              const char* aParams);
 
-  static bool ParseRange(const string& s, int64_t& start, int64_t& end);
+  // Returns the first occurrence of aByte in [aBegin, aEnd), or aEnd.
+  static const char* Find(const char* aBegin, const char* aEnd, char aByte);
 
-  static eMethod ExtractMethod(const string& request);
+  // Parses the line at [aLine, aLine + aLength), which excludes the CRLF.
+  void ParseLine(const char* aLine, size_t aLength);
 
-  static string ExtractTarget(const string& request);
+  // Parses whole lines in the buffer, up to the end of the request.
+  void ParseBuffered();
 
-  static map<string, string> ExtractQueryParams(const string& request);
+  // Parses the value of a Range header into aRanges. Returns false, and
+  // leaves aRanges empty, if it isn't a valid set of byte ranges, in which
+  // case the header is to be ignored.
+  static bool ParseRange(const char* aValue,
+                         const char* aEnd,
+                         vector<ByteRange>& aRanges);
 
-  void ParseRequestLine(const string& request);
-  
+  void ParseConnection(const char* aValue, const char* aEnd);
+
+  // Returns the eEncoding flags which the Accept-Encoding header value
+  // [aValue, aEnd) allows.
+  static unsigned ParseAcceptEncoding(const char* aValue, const char* aEnd);
+
+  // Sets aOut to the header value [aValue, aEnd) without surrounding
+  // whitespace.
+  static void ParseValue(const char* aValue, const char* aEnd, string& aOut);
+
+  void ParseRequestLine(const char* aLine, const char* aEnd);
+
+  static void ParseQueryParams(const char* aQuery,
+                               const char* aEnd,
+                               map<string, string>& aParams);
+
+  // Received data; the current request starts at offset 0.
   string request;
+  // Offset of the first unparsed line.
   size_t start;
-  vector<string> lines;
+  // Offset from which to resume scanning for the end of that line.
+  size_t scanned;
   bool complete;
   eMethod method;
-  string target;
+  size_t targetOffset;
+  size_t targetLength;
   map<string, string> params;
-  int64_t rangeStart, rangeEnd;
-  bool hasRange;
+  vector<ByteRange> ranges;
+  unsigned acceptedEncodings;
+  string ifNoneMatch;
+  string ifModifiedSince;
+  string ifRange;
+  bool http11;
+  bool connectionClose;
+  bool connectionKeepAlive;
 };
 
 #endif
@@ -34,20 +34,32 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <iostream>
-#include <sstream>
 
+#include "GzipCache.h"
+#include "Log.h"
 #include "PathEnumerator.h"
 #include "Response.h"
+#include "Stats.h"
+#include "Thread.h"
+#include "TokenBucket.h"
 #include "Utils.h"
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <fcntl.h>
+#include <io.h>
 #define S_ISDIR(m) ((m & _S_IFDIR) == _S_IFDIR)
-#define fseek64 _fseeki64
-#define ftell64 _ftelli64
+
+static int OpenForReading(const char* path) {
+  return _open(path, _O_RDONLY | _O_BINARY);
+}
+
+#define close _close
+#define strcasecmp _stricmp
 
 static int gmtime_r(const time_t *timep, struct tm *result) {
   return gmtime_s(result, timep) == 0;
@@ -58,21 +70,16 @@ static int gmtime_r(const time_t *timep, struct tm *result) {
 #else
 #define __stat64 stat64
 #define _stat64 stat64
+#include <fcntl.h>
+#include <strings.h>
 #include <unistd.h>
-#define fseek64 fseeko64
-#define ftell64 ftello64
 
-void Sleep(int ms) {
-  usleep(ms * 1000);
-}
-
-static int fopen_s(FILE** file, const char* path, const char* mode) {
-  FILE *f = fopen(path, mode);
-  if (!f) {
-    return 1;
-  }
-  *file = f;
-  return 0;
+static int OpenForReading(const char* path) {
+#ifdef O_CLOEXEC
+  return open(path, O_RDONLY | O_CLOEXEC);
+#else
+  return open(path, O_RDONLY);
+#endif
 }
 
 #define DIR_LIST_CHARSET "text/html; charset=utf-8"
@@ -80,6 +87,77 @@ static int fopen_s(FILE** file, const char* path, const char* mode) {
 #endif
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Largest segment handed to Socket::SendFile() when not rate limiting.
+#define MAX_SEGMENT ((int64_t)1 << 30)
+
+// Rate limited responses are sent in pieces of at least this many
+// milliseconds' worth of data...
+#define RATE_QUANTUM_MS 10
+
+// ...and by default may catch up on at most this many milliseconds'
+// worth of data after falling behind. Override with burst=N (in KB).
+#define RATE_BURST_MS 100
+
+// Reserved path at which the server's stats are served.
+#define STATS_TARGET "__stats"
+
+// Room reserved for the headers up front, enough for all but unusually
+// long content types.
+#define HEADERS_RESERVE 256
+
+#define SERVER_HEADER "Server: HttpMediaServer/0.1\r\n"
+
+// Size of an HTTP date, including its null terminator.
+#define HTTP_DATE_SIZE 30
+
+// Largest file which is gzip compressed for sending. Larger files are only
+// sent compressed if there's a precompressed sibling.
+#define MAX_GZIP_LENGTH (4 * 1024 * 1024)
+
+// Streamed directory listings are generated in pieces of about this many
+// bytes, each sent as an HTTP chunk.
+#define LISTING_CHUNK_SIZE (16 * 1024)
+
+// How long a followed live stream waits for its file to grow before
+// ending, by default, in microseconds.
+#define FOLLOW_IDLE_TIMEOUT ((int64_t)10 * 1000000)
+
+// Separates the parts of a multipart/byteranges body.
+#define BYTERANGES_BOUNDARY "HttpMediaServer-3d1f7a9c52e8b604"
+
+// Status, and the status line and headers which don't vary, for each
+// eMode.
+struct HeaderTemplate {
+  const char* mStatus;
+  const char* mHeaders;
+};
+
+#define HEADER_TEMPLATE(status_, headers_) \
+  { status_, "HTTP/1.1 " status_ "\r\n" SERVER_HEADER headers_ }
+
+static const HeaderTemplate gHeaderTemplates[] = {
+  HEADER_TEMPLATE("200 OK", ""),                      // GET_ENTIRE_FILE
+  HEADER_TEMPLATE("206 Partial Content", ""),         // GET_FILE_RANGE
+  HEADER_TEMPLATE("200 OK", ""),                      // DIR_LIST
+  HEADER_TEMPLATE("200 OK", ""),                      // STATS
+  HEADER_TEMPLATE("304 Not Modified", ""),            // NOT_MODIFIED
+  HEADER_TEMPLATE("404 File Not Found",               // ERROR_FILE_NOT_EXIST
+                  "Content-Length: 0\r\n"),
+  HEADER_TEMPLATE("416 Range Not Satisfiable",        // ERROR_RANGE_NOT_SATISFIABLE
+                  "Content-Length: 0\r\n"),
+  HEADER_TEMPLATE("500 Internal Server Error",        // INTERNAL_ERROR
+                  "Content-Length: 0\r\n")
+};
+
+// Each thread's copy of the Date header, formatted at most once a second.
+struct DateCache {
+  time_t mTime;
+  char mHeader[64];
+};
+
+static THREAD_LOCAL DateCache gDateCache;
 
 
 static const char* gContentTypes[][2] = {
@@ -91,232 +169,941 @@ static const char* gContentTypes[][2] = {
   {"html", "text/html; charset=utf-8"},
   {"txt", "text/plain; charset=utf-8"},
   {"js", "text/javascript; charset=utf-8"},
-  {"js", "text/css; charset=utf-8"},
+  {"css", "text/css; charset=utf-8"},
   {"jpg", "image/jpeg"},
   {"jpeg", "image/jpeg"},
   {"png", "image/png"},
   {"gif", "image/gif"}
 };
 
-Response::Response(RequestParser p)
-  : parser(p),
+Response::Response(const RequestParser& aParser)
+  : parser(aParser),
     mode(INTERNAL_ERROR),
     fileLength(-1),
-    file(0),
-    rangeStart(0),
-    rangeEnd(0),
+    lastModified(0),
+    contentEncoding(0),
+    gzipped(0),
+    varies(false),
+    entry(0),
+    contentType(0),
+    mapping(0),
+    file(-1),
+    liveSource(0),
+    livePosition(0),
+    rangeIndex(0),
+    partHeadersSent(0),
     offset(0),
-    bytesRemaining(0)
+    bytesRemaining(0),
+    shaper(0),
+    quantum(0),
+    wakeTime(0),
+    headersSent(0),
+    listing(0),
+    enumerator(0),
+    streaming(false),
+    chunked(false),
+    listJson(false),
+    listOffset(0),
+    listLimit(-1),
+    listIndex(0),
+    chunkData(0),
+    chunkLength(0),
+    chunkSent(0),
+    keepAlive(false),
+    startTime(GetMonotonicTime()),
+    bodySent(0),
+    finished(false),
+    bodyStartTime(0),
+    sleepStart(0)
 {
+  if (ContainsKey(parser.GetParams(), "delay")) {
+    const map<string,string> params = parser.GetParams();
+    string delayStr = params.find("delay")->second;
+    double delay = atof(delayStr.c_str());
+    if (delay > 0.0) {
+      wakeTime = GetMonotonicTime() + (int64_t)(delay * 1000.0 + 0.5);
+    }
+  }
+
   string target = parser.GetTarget();
   if (target == "") {
     mode = DIR_LIST;
     path = ".";
+  } else if (target == STATS_TARGET) {
+    mode = STATS;
   } else if (target.find("..") != string::npos) {
     mode = ERROR_FILE_NOT_EXIST;
   } else {
-    // Determine if the file exists, and if it is a directory.
-    struct __stat64 buf;
-    int result;
-    result = _stat64(target.c_str(), &buf );
+    // Determine if the file exists, and if it is a directory. Hot files
+    // are found in the metadata cache without touching the file system.
+    MetadataCache* cache = MetadataCache::Get();
+    if (cache) {
+      entry = cache->Lookup(target);
+      if (!entry) {
+        entry = cache->Insert(target,
+                              ExtractContentType(target, GET_ENTIRE_FILE));
+      }
+    }
+    int result = 0;
+    bool isDirectory = false;
+    uint64_t inode = 0;
+    if (entry) {
+      isDirectory = entry->IsDirectory();
+      fileLength = entry->Length();
+      lastModified = entry->Modified();
+      inode = entry->Inode();
+      contentType = entry->ContentType();
+    } else {
+      struct __stat64 buf;
+      result = _stat64(target.c_str(), &buf );
+      if (result == 0) {
+        isDirectory = S_ISDIR(buf.st_mode);
+        fileLength = buf.st_size;
+        lastModified = buf.st_mtime;
+        inode = buf.st_ino;
+      }
+    }
     if (result == -1) {
-      cerr << "File not found" << std::endl;
+      LOG(LOG_DEBUG, "File not found: %s", target.c_str());
       mode = ERROR_FILE_NOT_EXIST;
     } else if (result != 0) {
       mode = INTERNAL_ERROR;
-    } else if (S_ISDIR(buf.st_mode)) {
+    } else if (isDirectory) {
       mode = DIR_LIST;
       path = parser.GetTarget();
-    } else if (parser.IsRangeRequest() && !parser.IsLive()) {
-      mode = GET_FILE_RANGE;
-      path = parser.GetTarget();
-      parser.GetRange(rangeStart, rangeEnd);
-      if (rangeEnd == -1) {
-        rangeEnd = buf.st_size;
-      }
-      fileLength = buf.st_size;
+      fileLength = -1;
     } else {
-      mode = GET_ENTIRE_FILE;
       path = parser.GetTarget();
-      fileLength = buf.st_size;
+      if (!parser.IsLive()) {
+        // Live streams grow while they're served, so have no validators,
+        // and aren't compressed.
+        SelectEncoding(inode);
+        BuildETag(inode);
+      }
+      if (!etag.empty() && IsNotModified()) {
+        mode = NOT_MODIFIED;
+      } else if (parser.IsRangeRequest() && !parser.IsLive() &&
+                 IfRangeMatches()) {
+        mode = ResolveRanges(parser.GetRanges(), fileLength, ranges)
+                 ? GET_FILE_RANGE
+                 : ERROR_RANGE_NOT_SATISFIABLE;
+      } else {
+        mode = GET_ENTIRE_FILE;
+      }
     }
   }
+
+  // Live streams have no Content-Length, so their end is signalled by
+  // closing the connection.
+  keepAlive = parser.IsKeepAlive() &&
+              !(mode == GET_ENTIRE_FILE && parser.IsLive());
+
+  Stats::Increment(RequestCounter(mode));
 }
 
-bool Response::SendHeaders(Socket* aSocket) {
-  string headers;
-  headers.append("HTTP/1.1 ");
-  headers.append(StatusCode(mode));
-  headers.append("\r\n");
-  headers.append("Connection: close\r\n");
-  headers.append(GetDate());
-  headers.append("\r\n");
-  headers.append("Server: HttpMediaServer/0.1\r\n");
-    
-  if (ContainsKey(parser.GetParams(), "delay")) {
-    const map<string,string> params = parser.GetParams();
-    string delayStr = params.find("delay")->second;
-    double delay = atof(delayStr.c_str());
-    if (delay > 0.0) {
-      Sleep((unsigned)(delay+0.5));
+Response::~Response() {
+  CloseFile();
+  if (entry) {
+    MetadataCache::Get()->Release(entry);
+  }
+  if (listing) {
+    ListingCache::Release(listing);
+  }
+  if (gzipped) {
+    GzipCache::Release(gzipped);
+  }
+  delete enumerator;
+  if (liveSource) {
+    LiveFanout::Get()->Unsubscribe(liveSource);
+  }
+  delete shaper;
+}
+
+bool Response::OpenFile() {
+  // Live streams are sent until the end of the file, wherever that is by
+  // then, so can't use a snapshot of its length.
+  FileCache* cache = FileCache::Get();
+  if (cache && !parser.IsLive()) {
+    mapping = cache->Acquire(path, fileLength, lastModified);
+    if (mapping) {
+      return true;
+    }
+  }
+  if (entry && entry->Descriptor() != -1) {
+    // Shared with other responses; SendFile() doesn't move its offset.
+    file = entry->Descriptor();
+    return true;
+  }
+  file = OpenForReading(path.c_str());
+  return file != -1;
+}
+
+void Response::CloseFile() {
+  if (mapping) {
+    FileCache::Get()->Release(mapping);
+    mapping = 0;
+  }
+  if (file != -1) {
+    if (!entry || file != entry->Descriptor()) {
+      close(file);
+    }
+    file = -1;
+  }
+}
+
+void Response::CreateShaper() {
+  const map<string,string>& params = parser.GetParams();
+  if (!ContainsKey(params, "rate")) {
+    return;
+  }
+  double rate = atof(params.find("rate")->second.c_str()) * 1024;
+  if (rate <= 0.0) {
+    return;
+  }
+  quantum = (int64_t)(rate * RATE_QUANTUM_MS / 1000);
+  if (quantum < 1) {
+    quantum = 1;
+  }
+  int64_t burst = (int64_t)(rate * RATE_BURST_MS / 1000);
+  if (ContainsKey(params, "burst")) {
+    burst = (int64_t)(atof(params.find("burst")->second.c_str()) * 1024);
+  }
+  if (burst < quantum) {
+    burst = quantum;
+  }
+  // Start with a single quantum, so the first piece goes out immediately
+  // but doesn't put us ahead of the requested rate.
+  bodyStartTime = GetMonotonicTime();
+  shaper = new TokenBucket(rate, burst, quantum, bodyStartTime);
+}
+
+Response::eStatus Response::Flush(Socket* aSocket,
+                                  const char* aBuf,
+                                  size_t aLength,
+                                  size_t& aOffset)
+{
+  while (aOffset < aLength) {
+    int r = aSocket->Send(aBuf + aOffset, (int)(aLength - aOffset));
+    if (r == Socket::WOULD_BLOCK) {
+      return SEND_BLOCKED;
+    }
+    if (r < 0) {
+      return SEND_FAILED;
+    }
+    aOffset += r;
+  }
+  return SEND_DONE;
+}
+
+Response::eStatus Response::SendHeaders(Socket* aSocket) {
+  int64_t now = GetMonotonicTime();
+  if (now < wakeTime) {
+    // Simulating round trip delay.
+    return SEND_WAITING;
+  }
+
+  if (headers.empty()) {
+    if (wakeTime) {
+      Stats::Increment(Stats::DELAY_SLEEP, now - startTime);
+    }
+    BuildHeaders();
+    if (!StartBody()) {
+      return SEND_FAILED;
+    }
+  }
+
+  size_t sent = headersSent;
+  eStatus status = SEND_DONE;
+  while (headersSent < headers.size()) {
+    const char* rest = headers.c_str() + headersSent;
+    int length = (int)(headers.size() - headersSent);
+    const char* body = 0;
+    int64_t bodyLength = 0;
+    GetBufferedBody(now, body, bodyLength);
+    int r;
+    if (bodyLength > 0) {
+      // Send the start of the body with the headers, so that small
+      // responses go out in a single packet.
+      r = aSocket->Send(rest, length, body, (int)bodyLength);
+    } else if (file != -1 && bytesRemaining > 0) {
+      // The body will be sent straight from the file; let the kernel
+      // put the headers in the same packet as its start.
+      r = aSocket->SendMore(rest, length);
+    } else {
+      r = aSocket->Send(rest, length);
+    }
+    if (r == Socket::WOULD_BLOCK) {
+      status = SEND_BLOCKED;
+      break;
     }
+    if (r < 0) {
+      status = SEND_FAILED;
+      break;
+    }
+    if (r > length) {
+      BufferedBodySent(r - length);
+      r = length;
+    }
+    headersSent += r;
+  }
+  if (sent == 0 && headersSent > 0) {
+    Stats::Record(Stats::TIME_TO_FIRST_BYTE, GetMonotonicTime() - startTime);
+  }
+  return status;
+}
+
+void Response::BuildHeaders() {
+  // Generate the listing or stats now, so we know their length.
+  if (mode == DIR_LIST) {
+    BuildListing();
+  } else if (mode == STATS) {
+    SetChunk(Stats::Format());
+  }
+
+  string specifiedType;
+  const char* type;
+  if (parser.HasSpecifiedMimeType()) {
+    specifiedType = parser.GetSpecifiedMimeType();
+    type = specifiedType.c_str();
+  } else if (listJson) {
+    type = "application/json";
+  } else {
+    type = contentType && mode != DIR_LIST ? contentType
+                                           : ExtractContentType(path, mode);
   }
 
+  headers.reserve(HEADERS_RESERVE);
+  headers.append(gHeaderTemplates[mode].mHeaders);
+  headers.append(keepAlive ? "Connection: keep-alive\r\n"
+                           : "Connection: close\r\n");
+  headers.append(GetDate());
+
   if (!parser.IsLive()) {
     if (mode == GET_ENTIRE_FILE) {
-      headers.append("Accept-Ranges: bytes\r\n");
-      headers.append("Content-Length: ");
-      headers.append(ToString(fileLength));
+      headers.append("Accept-Ranges: bytes\r\nContent-Length: ");
+      AppendDecimal(headers, gzipped ? (int64_t)gzipped->Length()
+                                          : fileLength);
       headers.append("\r\n");
-    } else if (mode == GET_FILE_RANGE) {
-      headers.append("Accept-Ranges: bytes\r\n");
-      headers.append("Content-Length: ");
-      headers.append(ToString(rangeEnd - rangeStart));
+    } else if (mode == GET_FILE_RANGE && ranges.size() == 1) {
+      headers.append("Accept-Ranges: bytes\r\nContent-Length: ");
+      AppendDecimal(headers, ranges[0].last - ranges[0].first + 1);
+      headers.append("\r\nContent-Range: ");
+      AppendContentRange(headers, ranges[0]);
       headers.append("\r\n");
-      headers.append("Content-Range: bytes ");
-      headers.append(ToString(rangeStart));
-      headers.append("-");
-      headers.append(ToString(rangeEnd));
-      headers.append("/");
-      headers.append(ToString(fileLength));
+    } else if (mode == GET_FILE_RANGE) {
+      partType = type;
+      type = "multipart/byteranges; boundary=" BYTERANGES_BOUNDARY;
+      int64_t length = 0;
+      for (size_t i = 0; i <= ranges.size(); i++) {
+        length += PartHeaders(i).size();
+        if (i < ranges.size()) {
+          length += ranges[i].last - ranges[i].first + 1;
+        }
+      }
+      headers.append("Accept-Ranges: bytes\r\nContent-Length: ");
+      AppendDecimal(headers, length);
       headers.append("\r\n");
     }
   }
-  //headers.append("Last-Modified: Wed, 10 Nov 2009 04:58:08 GMT\r\n");
-
-  headers.append("Content-Type: ");
-  if (parser.HasSpecifiedMimeType()) {
-    headers.append(parser.GetSpecifiedMimeType());
-  } else {
-    headers.append(ExtractContentType(path, mode));
+  if (!etag.empty()) {
+    char date[HTTP_DATE_SIZE];
+    FormatHttpDate(lastModified, date);
+    headers.append("ETag: ");
+    headers.append(etag);
+    headers.append("\r\nLast-Modified: ");
+    headers.append(date);
+    headers.append("\r\n");
+  }
+  if (contentEncoding && mode != NOT_MODIFIED) {
+    headers.append("Content-Encoding: ");
+    headers.append(contentEncoding);
+    headers.append("\r\n");
+  }
+  if (varies) {
+    headers.append("Vary: Accept-Encoding\r\n");
+  }
+  if (mode == ERROR_RANGE_NOT_SATISFIABLE) {
+    headers.append("Content-Range: bytes */");
+    AppendDecimal(headers, fileLength);
+    headers.append("\r\n");
+  }
+  if (chunked) {
+    headers.append("Transfer-Encoding: chunked\r\n");
+  } else if (streaming) {
+    // No length; the connection will be closed after the listing.
+  } else if (mode == DIR_LIST || mode == STATS) {
+    headers.append("Content-Length: ");
+    AppendDecimal(headers, (int64_t)chunkLength);
+    headers.append("\r\n");
   }
-  headers.append("\r\n\r\n");
 
-  cout << "Sending Headers " << parser.id << std::endl << headers;
+  if (mode != NOT_MODIFIED) {
+    headers.append("Content-Type: ");
+    headers.append(type);
+    headers.append("\r\n");
+  }
+  headers.append("\r\n");
 
-  return aSocket->Send(headers.c_str(), (int)headers.size()) != -1;
+  LOG(LOG_DEBUG, "Sending headers (%d): %s", parser.id, StatusCode(mode));
 }
 
-// Returns true if we need to call again.
-bool Response::SendBody(Socket *aSocket) {
-  if (mode == ERROR_FILE_NOT_EXIST) {
-    cout << "Sent (empty) body (" << parser.id << ")" << std::endl;
+bool Response::StartBody() {
+  if ((mode != GET_ENTIRE_FILE && mode != GET_FILE_RANGE) ||
+      parser.GetMethod() == HEAD) {
+    return true;
+  }
+  LiveFanout* fanout = LiveFanout::Get();
+  if (parser.IsLive() && fanout) {
+    // Paced by the source, which all its viewers share.
+    const map<string,string>& params = parser.GetParams();
+    int64_t rate = 0;
+    if (ContainsKey(params, "rate")) {
+      rate = MAX((int64_t)(atof(params.find("rate")->second.c_str()) * 1024),
+                 0);
+    }
+    // With follow, the stream waits for the file to grow, by default for
+    // FOLLOW_IDLE_TIMEOUT, or follow=N seconds.
+    int64_t idleTimeout = 0;
+    if (ContainsKey(params, "follow")) {
+      idleTimeout = (int64_t)(atof(params.find("follow")->second.c_str()) *
+                              1000000);
+      if (idleTimeout <= 0) {
+        idleTimeout = FOLLOW_IDLE_TIMEOUT;
+      }
+    }
+    liveSource = fanout->Subscribe(path, rate, idleTimeout, livePosition);
+    return liveSource != 0;
+  }
+  if (gzipped) {
+    offset = 0;
+    bytesRemaining = gzipped->Length();
+  } else if (!OpenFile()) {
     return false;
+  } else if (mode == GET_FILE_RANGE) {
+    StartRange(0);
+  } else {
+    // Live streams have no Content-Length, so send whatever is in the
+    // file when we reach its end.
+    offset = 0;
+    bytesRemaining = parser.IsLive() ? -1 : fileLength;
   }
+  CreateShaper();
+  return true;
+}
 
-  int len = 1024;
-  unsigned wait = 0;
-  string rateStr;
-  if (ContainsKey(parser.GetParams(), "rate")) {
-    const map<string,string> params = parser.GetParams();
-    rateStr = params.find("rate")->second;
-    double rate = atof(rateStr.c_str());
-    const double period = 0.1;
-    if (rate <= 0.0) {
-      len = 1024;
-      wait = 0;
-    } else {
-      len = (unsigned)(rate * 1024 * period);
-      wait = (unsigned)(period * 1000.0); // ms
+void Response::GetBufferedBody(int64_t aNow,
+                               const char*& aData,
+                               int64_t& aLength)
+{
+  aLength = 0;
+  if (parser.GetMethod() == HEAD) {
+    return;
+  }
+  if (chunkData) {
+    aData = chunkData + chunkSent;
+    aLength = chunkLength - chunkSent;
+    return;
+  }
+  if (partHeadersSent < partHeaders.size()) {
+    aData = partHeaders.data() + partHeadersSent;
+    aLength = partHeaders.size() - partHeadersSent;
+    return;
+  }
+  // The file may have shrunk since its length was taken.
+  int64_t length = 0;
+  const char* body = GetBodyInMemory(length);
+  if (body && bytesRemaining != 0 && offset < length) {
+    aData = body + offset;
+    aLength = MIN(length - offset, MAX_SEGMENT);
+    if (bytesRemaining > 0) {
+      aLength = MIN(aLength, bytesRemaining);
+    }
+    if (shaper) {
+      aLength = MIN(aLength, shaper->Available(aNow));
     }
   }
+}
+
+void Response::BufferedBodySent(int64_t aCount) {
+  if (chunkData) {
+    chunkSent += (size_t)aCount;
+    bodySent += aCount;
+    return;
+  }
+  if (partHeadersSent < partHeaders.size()) {
+    partHeadersSent += (size_t)aCount;
+    bodySent += aCount;
+    return;
+  }
+  offset += aCount;
+  bodySent += aCount;
+  if (bytesRemaining > 0) {
+    bytesRemaining -= aCount;
+  }
+  if (shaper) {
+    shaper->Consume(aCount);
+  }
+}
+
+void Response::StartRange(size_t aIndex) {
+  rangeIndex = aIndex;
+  if (ranges.size() > 1) {
+    partHeaders = PartHeaders(aIndex);
+    partHeadersSent = 0;
+  }
+  if (aIndex < ranges.size()) {
+    offset = ranges[aIndex].first;
+    bytesRemaining = ranges[aIndex].last - ranges[aIndex].first + 1;
+  }
+}
+
+string Response::PartHeaders(size_t aIndex) const {
+  string s("\r\n--" BYTERANGES_BOUNDARY);
+  if (aIndex == ranges.size()) {
+    s.append("--\r\n");
+    return s;
+  }
+  s.append("\r\nContent-Type: ");
+  s.append(partType);
+  s.append("\r\nContent-Range: ");
+  AppendContentRange(s, ranges[aIndex]);
+  s.append("\r\n\r\n");
+  return s;
+}
 
-  if (mode == GET_ENTIRE_FILE) {
-    if (!file) {
-      if (fopen_s(&file, path.c_str(), "rb")) {
-        file = 0;
-        return false;
+void Response::AppendContentRange(string& aOut,
+                                  const ByteRange& aRange) const
+{
+  aOut.append("bytes ");
+  AppendDecimal(aOut, aRange.first);
+  aOut.append("-");
+  AppendDecimal(aOut, aRange.last);
+  aOut.append("/");
+  AppendDecimal(aOut, fileLength);
+}
+
+static bool CompareRanges(const ByteRange& aA, const ByteRange& aB) {
+  return aA.first < aB.first;
+}
+
+bool Response::ResolveRanges(const vector<ByteRange>& aRequested,
+                             int64_t aLength,
+                             vector<ByteRange>& aRanges)
+{
+  aRanges.clear();
+  for (size_t i = 0; i < aRequested.size(); i++) {
+    ByteRange range = aRequested[i];
+    if (range.first == -1) {
+      // The final range.last bytes.
+      if (range.last == 0 || aLength == 0) {
+        continue;
+      }
+      range.first = range.last < aLength ? aLength - range.last : 0;
+      range.last = aLength - 1;
+    } else {
+      if (range.first >= aLength) {
+        continue;
+      }
+      if (range.last == -1 || range.last >= aLength) {
+        range.last = aLength - 1;
       }
     }
-    if (feof(file)) {
-      // Transmitted entire file!
-      fclose(file);
-      file = 0;
-      return false;
+    aRanges.push_back(range);
+  }
+  if (aRanges.empty()) {
+    return false;
+  }
+  std::sort(aRanges.begin(), aRanges.end(), CompareRanges);
+  size_t merged = 0;
+  for (size_t i = 1; i < aRanges.size(); i++) {
+    if (aRanges[i].first <= aRanges[merged].last + 1) {
+      aRanges[merged].last = std::max(aRanges[merged].last, aRanges[i].last);
+    } else {
+      aRanges[++merged] = aRanges[i];
     }
+  }
+  aRanges.resize(merged + 1);
+  return true;
+}
 
-    int64_t tell = ftell64(file);
+const char* Response::GetBodyInMemory(int64_t& aLength) const {
+  if (gzipped) {
+    aLength = gzipped->Length();
+    return gzipped->Data();
+  }
+  if (mapping) {
+    aLength = mapping->Length();
+    return mapping->Data();
+  }
+  return 0;
+}
 
-    // Transmit the next segment.
-    char* buf = new char[len];
-    int x = (int)fread(buf, 1, len, file);
-    int r = aSocket->Send(buf, x);
-    delete buf;
-    if (r < 0) {
-      // Some kind of error.
+bool Response::IsCompressible(const char* aContentType) {
+  return strncmp(aContentType, "text/", 5) == 0 ||
+         strstr(aContentType, "javascript") ||
+         strstr(aContentType, "json") ||
+         strstr(aContentType, "xml");
+}
+
+void Response::SelectEncoding(uint64_t& aInode) {
+  if (!contentType) {
+    contentType = ExtractContentType(path, GET_ENTIRE_FILE);
+  }
+  if (!IsCompressible(contentType)) {
+    return;
+  }
+  varies = true;
+  unsigned accepted = parser.GetAcceptedEncodings();
+  if ((accepted & ENCODING_BROTLI) && UseSibling(".br", aInode)) {
+    contentEncoding = "br";
+  } else if ((accepted & ENCODING_GZIP) && UseSibling(".gz", aInode)) {
+    contentEncoding = "gzip";
+  } else if ((accepted & ENCODING_GZIP) && !parser.IsRangeRequest() &&
+             fileLength <= MAX_GZIP_LENGTH && GzipCache::Get()) {
+    // Ranges of a compressed copy aren't supported, so range requests get
+    // the file as it is. So do requests for a file while it's compressed
+    // in the background, rather than waiting for it.
+    gzipped = GzipCache::Get()->Acquire(path, fileLength, lastModified);
+    if (gzipped) {
+      contentEncoding = "gzip";
+    }
+  }
+}
+
+bool Response::UseSibling(const char* aSuffix, uint64_t& aInode) {
+  string sibling = path + aSuffix;
+  MetadataCache* cache = MetadataCache::Get();
+  if (cache) {
+    MetadataCache::Entry* e = cache->Lookup(sibling);
+    if (!e) {
+      e = cache->Insert(sibling, "application/octet-stream");
+    }
+    if (!e) {
       return false;
     }
-      
-    if (wait > 0) {
-      Sleep(wait);
+    if (e->IsDirectory()) {
+      cache->Release(e);
+      return false;
     }
-    // Else we tranmitted that segment, we're ok.
-    return true;
+    if (entry) {
+      cache->Release(entry);
+    }
+    entry = e;
+    fileLength = e->Length();
+    lastModified = e->Modified();
+    aInode = e->Inode();
+  } else {
+    struct __stat64 buf;
+    if (_stat64(sibling.c_str(), &buf) != 0 || S_ISDIR(buf.st_mode)) {
+      return false;
+    }
+    fileLength = buf.st_size;
+    lastModified = buf.st_mtime;
+    aInode = buf.st_ino;
+  }
+  path = sibling;
+  return true;
+}
 
-  } else if (mode == GET_FILE_RANGE) {
-    if (!file) {
-      if (fopen_s(&file, path.c_str(), "rb")) {
-        file = 0;
-        return false;
+void Response::BuildListing() {
+  const map<string, string>& params = parser.GetParams();
+  string suffix;
+  if (ContainsKey(params, "rate")) {
+    suffix = "?rate=" + params.find("rate")->second;
+  }
+  listJson = ContainsKey(params, "json");
+  bool paged = ContainsKey(params, "offset") || ContainsKey(params, "limit");
+
+  // Whole HTML listings come from the cache, sorted and compressed if the
+  // client accepts it.
+  ListingCache* cache = ListingCache::Get();
+  if (cache && !listJson && !paged) {
+    bool gzip = (parser.GetAcceptedEncodings() & ENCODING_GZIP) != 0;
+    listing = cache->Acquire(path, suffix, gzip);
+    if (listing) {
+      varies = true;
+      if (gzip) {
+        contentEncoding = "gzip";
       }
-      fseek64(file, rangeStart, SEEK_SET);
-      offset = rangeStart;
-      bytesRemaining = rangeEnd - rangeStart;
-    }
-    if (feof(file) || bytesRemaining == 0) {
-      // Transmitted entire range.
-      fclose(file);
-      file = 0;
-      return false;
+      chunkData = listing->Data();
+      chunkLength = listing->Length();
+      chunkSent = 0;
+      return;
     }
+  }
 
-    // Transmit the next segment.
-    char* buf = new char[len];
+  // Otherwise the listing is streamed in directory order as it's read,
+  // so memory use doesn't grow with the size of the directory.
+  if (ContainsKey(params, "offset")) {
+    listOffset = MAX(atoll(params.find("offset")->second.c_str()), 0);
+  }
+  if (ContainsKey(params, "limit")) {
+    listLimit = atoll(params.find("limit")->second.c_str());
+    if (listLimit <= 0) {
+      listLimit = -1;
+    }
+  }
+  enumerator = PathEnumerator::getEnumerator(path);
+  streaming = true;
+  chunked = parser.IsHttp11();
+  NextListingChunk(listJson ? "{\"entries\":[" : "<!DOCTYPE html>\n<ul>");
+  if (!chunked && streaming) {
+    // An HTTP/1.0 client can't be sent chunks, so a listing longer than
+    // its first piece ends when the connection is closed.
+    keepAlive = false;
+  }
+}
 
-    len = (unsigned)MIN(bytesRemaining, len);
-    size_t bytesSent = fread(buf, 1, len, file);
-    bytesRemaining -= bytesSent;
-    int r = aSocket->Send(buf, (int)bytesSent);
-    delete buf;
-    if (r < 0) {
-      // Some kind of error.
-      return false;
+bool Response::NextListingName(string& aName) {
+  while (enumerator && enumerator->next(aName)) {
+    if (aName == "." || (path == "." && aName == "..")) {
+      continue;
+    }
+    if (listIndex++ >= listOffset) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Response::NextListingChunk(const char* aPrefix) {
+  if (!streaming) {
+    return false;
+  }
+  string piece(aPrefix);
+  piece.reserve(LISTING_CHUNK_SIZE + 1024);
+  string name;
+  bool more = false;
+  while (piece.size() < LISTING_CHUNK_SIZE) {
+    if (listLimit >= 0 && listIndex - listOffset >= listLimit) {
+      // The page is full; look ahead to see if there's another.
+      more = NextListingName(name);
+      streaming = false;
+      break;
     }
-    offset += bytesSent;
-    assert(ftell64(file) == offset);
+    if (!NextListingName(name)) {
+      streaming = false;
+      break;
+    }
+    if (listJson) {
+      if (listIndex - listOffset > 1) {
+        piece.push_back(',');
+      }
+      AppendJsonString(piece, name);
+    } else {
+      piece.append("<li><a href=\"");
+      piece.append(path);
+      piece.append("/");
+      piece.append(name);
+      if (ContainsKey(parser.GetParams(), "rate")) {
+        piece.append("?rate=" + parser.GetParams().find("rate")->second);
+      }
+      piece.append("\">");
+      piece.append(name);
+      piece.append("</a></li>");
+    }
+  }
 
-    if (wait > 0) {
-      Sleep(wait);
+  if (!streaming) {
+    delete enumerator;
+    enumerator = 0;
+    int64_t next = listOffset + listLimit;
+    if (listJson) {
+      piece.append("]");
+      if (more) {
+        piece.append(",\"next\":");
+        AppendDecimal(piece, next);
+      }
+      piece.append("}");
+    } else {
+      piece.append("</ul>");
+      if (more) {
+        piece.append("<p><a href=\"");
+        piece.append(path);
+        piece.append("?offset=");
+        AppendDecimal(piece, next);
+        piece.append("&amp;limit=");
+        AppendDecimal(piece, listLimit);
+        if (ContainsKey(parser.GetParams(), "rate")) {
+          piece.append("&amp;rate=" + parser.GetParams().find("rate")->second);
+        }
+        piece.append("\">Next</a></p>");
+      }
     }
+  }
 
-    // Else we tranmitted that segment, we're ok.
+  if (!chunked) {
+    SetChunk(piece);
     return true;
   }
-  else if (mode == DIR_LIST) {
-    std::stringstream response;
-    PathEnumerator *enumerator = PathEnumerator::getEnumerator(path);
-    if (enumerator) {
-      response << "<!DOCTYPE html>\n<ul>";
-      string href;
-      while (enumerator->next(href)) {
-        if (href == "." || path == "." && href == "..") {
-          continue;
-        }
-        response << "<li><a href=\"" << path + "/" + href;
-        if (!rateStr.empty()) {
-          response << "?rate=" + rateStr;
-        }
-        response << "\">" << href << "</a></li>";
+  string framed;
+  framed.reserve(piece.size() + 32);
+  AppendHex(framed, piece.size());
+  framed.append("\r\n");
+  framed.append(piece);
+  framed.append(streaming ? "\r\n" : "\r\n0\r\n\r\n");
+  SetChunk(framed);
+  return true;
+}
+
+void Response::SetChunk(const string& aBody) {
+  chunk.Allocate(aBody.size());
+  memcpy(chunk.Data(), aBody.c_str(), aBody.size());
+  chunkData = chunk.Data();
+  chunkLength = aBody.size();
+  chunkSent = 0;
+}
+
+Response::eStatus Response::SendBody(Socket *aSocket) {
+  if (parser.GetMethod() == HEAD) {
+    return SEND_DONE;
+  }
+
+  if (mode == NOT_MODIFIED || mode == ERROR_FILE_NOT_EXIST ||
+      mode == ERROR_RANGE_NOT_SATISFIABLE) {
+    return SEND_DONE;
+  }
+
+  if (chunkData) {
+    // Resume transmitting the directory listing or stats.
+    size_t sent = chunkSent;
+    eStatus status = Flush(aSocket, chunkData, chunkLength, chunkSent);
+    bodySent += chunkSent - sent;
+    if (status != SEND_DONE) {
+      return status;
+    }
+    chunk.Release();
+    if (listing) {
+      ListingCache::Release(listing);
+      listing = 0;
+    }
+    chunkData = 0;
+    // A streamed listing goes on with its next piece.
+    return NextListingChunk("") ? SEND_MORE : SEND_DONE;
+  }
+
+  int64_t now = GetMonotonicTime();
+  if (now < wakeTime) {
+    // Rate limiting.
+    return SEND_WAITING;
+  }
+  if (sleepStart) {
+    Stats::Increment(Stats::RATE_SLEEP, now - sleepStart);
+    sleepStart = 0;
+  }
+
+  if (liveSource) {
+    return SendLive(aSocket, now);
+  }
+
+  if (mode == GET_ENTIRE_FILE || mode == GET_FILE_RANGE) {
+    if (partHeadersSent < partHeaders.size()) {
+      size_t sent = partHeadersSent;
+      eStatus status = Flush(aSocket, partHeaders.data(), partHeaders.size(),
+                             partHeadersSent);
+      bodySent += partHeadersSent - sent;
+      if (status != SEND_DONE) {
+        return status;
       }
-      response << "</ul>";
-      delete enumerator;
     }
-    string _r = response.str();
-    aSocket->Send(_r.c_str(), (int)_r.size());
-    return false;
+    if (bytesRemaining == 0) {
+      if (ranges.size() > 1 && rangeIndex < ranges.size()) {
+        // On to the next part, or the closing delimiter.
+        StartRange(rangeIndex + 1);
+        return SEND_MORE;
+      }
+      // Transmitted entire file or range.
+      CloseFile();
+      return SEND_DONE;
+    }
+
+    // Without rate limiting the kernel sends as much as the socket will
+    // take; otherwise we send what the shaper allows, and if that's less
+    // than a quantum, wait until a quantum is available.
+    int64_t len = MAX_SEGMENT;
+    if (shaper) {
+      len = shaper->Available(now);
+      int64_t wanted = (bytesRemaining > 0) ? MIN(quantum, bytesRemaining)
+                                            : quantum;
+      if (len < wanted) {
+        wakeTime = shaper->WhenAvailable(wanted);
+        sleepStart = now;
+        return SEND_WAITING;
+      }
+    }
+    if (bytesRemaining > 0) {
+      len = MIN(len, bytesRemaining);
+    }
+
+    int64_t r = 0;
+    int64_t length = 0;
+    const char* body = GetBodyInMemory(length);
+    if (body) {
+      // The file may have shrunk since its length was taken, which
+      // SendFile() would report as end of file.
+      if (offset < length) {
+        len = MIN(len, length - offset);
+        r = aSocket->Send(body + offset, (int)len);
+      }
+      if (r > 0) {
+        offset += r;
+      }
+    } else {
+      r = aSocket->SendFile(file, offset, len);
+    }
+    if (r == Socket::WOULD_BLOCK) {
+      return SEND_BLOCKED;
+    }
+    if (r < 0) {
+      return SEND_FAILED;
+    }
+    if (r == 0) {
+      // End of file. For a live stream that's the end of the response; the
+      // file may also have been truncated under us.
+      CloseFile();
+      return parser.IsLive() ? SEND_DONE : SEND_FAILED;
+    }
+    bodySent += r;
+    if (bytesRemaining > 0) {
+      bytesRemaining -= r;
+    }
+    if (shaper) {
+      // Charge only for what was actually sent.
+      shaper->Consume(r);
+    }
+    return SEND_MORE;
   }
+  return SEND_DONE;
+}
 
-  return false;
+Response::eStatus Response::SendLive(Socket* aSocket, int64_t aNow) {
+  const char* data = 0;
+  size_t length = 0;
+  LiveFanout::Source::eResult result =
+    liveSource->Peek(aNow, livePosition, data, length, wakeTime);
+  if (result == LiveFanout::Source::LIVE_END) {
+    return SEND_DONE;
+  }
+  if (result == LiveFanout::Source::LIVE_WAIT) {
+    return SEND_WAITING;
+  }
+  int r = aSocket->Send(data, (int)length);
+  if (r == Socket::WOULD_BLOCK) {
+    return SEND_BLOCKED;
+  }
+  if (r < 0) {
+    return SEND_FAILED;
+  }
+  if (!liveSource->IsIntact(livePosition)) {
+    // The source moved on so far while we were sending that what was sent
+    // may have been overwritten.
+    LOG(LOG_DEBUG, "Dropping live subscriber (%d)", parser.id);
+    Stats::Increment(Stats::LIVE_DROPPED);
+    return SEND_FAILED;
+  }
+  livePosition += r;
+  bodySent += r;
+  return SEND_MORE;
 }
 
 #ifdef _DEBUG
@@ -329,27 +1116,179 @@ void Response::Test() {
   assert(ExtractContentType("dir1/dir2/file.txt", GET_ENTIRE_FILE) == string("text/plain; charset=utf-8"));
   assert(ExtractContentType("dir1/dir2/file.html", GET_ENTIRE_FILE) == string("text/html; charset=utf-8"));
   assert(ExtractContentType("", DIR_LIST) == string(DIR_LIST_CHARSET));
+
+  assert(TestRanges("0-", 100, "0-99"));
+  assert(TestRanges("0-1023", 100, "0-99"));
+  assert(TestRanges("-10", 100, "90-99"));
+  assert(TestRanges("-1000", 100, "0-99"));
+  assert(TestRanges("90-,0-9", 100, "0-9,90-99"));
+  assert(TestRanges("0-9,10-19,5-7,50-60,55-", 100, "0-19,50-99"));
+  assert(TestRanges("100-,-0,200-300,0-5", 100, "0-5"));
+  assert(TestRanges("100-,-0", 100, ""));
+  assert(TestRanges("-5", 0, ""));
+
+  char date[HTTP_DATE_SIZE];
+  FormatHttpDate(784111777, date);
+  assert(string(date) == "Sun, 06 Nov 1994 08:49:37 GMT");
+  FormatHttpDate(951782400, date);
+  assert(string(date) == "Tue, 29 Feb 2000 00:00:00 GMT");
+  int64_t time = 0;
+  assert(ParseHttpDate("Sun, 06 Nov 1994 08:49:37 GMT", time));
+  assert(time == 784111777);
+  assert(ParseHttpDate("Tue, 29 Feb 2000 00:00:00 GMT", time));
+  assert(time == 951782400);
+  assert(ParseHttpDate("Thu, 01 Jan 1970 00:00:00 GMT", time) && time == 0);
+  assert(!ParseHttpDate("Sunday, 06-Nov-94 08:49:37 GMT", time));
+  assert(!ParseHttpDate("Sun, 06 Xyz 1994 08:49:37 GMT", time));
+  assert(!ParseHttpDate("Sun, 06 Nov 1994 08:49:37 UTC", time));
+  assert(!ParseHttpDate("", time));
+
+  assert(MatchETag("\"a\"", "\"a\"", true));
+  assert(MatchETag("*", "\"a\"", false));
+  assert(MatchETag("\"b\", W/\"a\"", "\"a\"", false));
+  assert(!MatchETag("W/\"a\"", "\"a\"", true));
+  assert(MatchETag("\"x,y\",\"a\"", "\"a\"", true));
+  assert(!MatchETag("\"ab\"", "\"a\"", false));
+  assert(!MatchETag("a", "\"a\"", false));
+  assert(!MatchETag("\"a", "\"a\"", false));
+
+  string json;
+  AppendJsonString(json, "a\"b\\c\n");
+  assert(json == "\"a\\\"b\\\\c\\u000a\"");
+
+#ifndef _WIN32
+  // Streamed listings are in directory order, so only their shape is known.
+  mkdir("ListingTest.tmp", 0755);
+  const char* names[] = { "ListingTest.tmp/a", "ListingTest.tmp/b",
+                          "ListingTest.tmp/c" };
+  for (size_t i = 0; i < ARRAY_LENGTH(names); i++) {
+    FILE* f = fopen(names[i], "wb");
+    assert(f);
+    fclose(f);
+  }
+  string headers, body;
+  TestListing("GET /ListingTest.tmp?json&limit=2 HTTP/1.1\r\n\r\n",
+              headers, body);
+  assert(headers.find("Transfer-Encoding: chunked\r\n") != string::npos);
+  assert(headers.find("Content-Type: application/json\r\n") != string::npos);
+  assert(body.find("{\"entries\":[\"") != string::npos);
+  string end(",\"next\":2}\r\n0\r\n\r\n");
+  assert(body.size() > end.size() &&
+         body.compare(body.size() - end.size(), end.size(), end) == 0);
+  TestListing("GET /ListingTest.tmp?json&offset=3 HTTP/1.0\r\n\r\n",
+              headers, body);
+  assert(headers.find("Transfer-Encoding") == string::npos);
+  assert(body.compare(0, 13, "{\"entries\":[\"") == 0);
+  assert(body.find(',') == string::npos &&
+         body.compare(body.size() - 3, 3, "\"]}") == 0);
+  TestListing("GET /ListingTest.tmp?offset=4 HTTP/1.1\r\n\r\n",
+              headers, body);
+  assert(body == "19\r\n<!DOCTYPE html>\n<ul></ul>\r\n0\r\n\r\n");
+  for (size_t i = 0; i < ARRAY_LENGTH(names); i++) {
+    remove(names[i]);
+  }
+  rmdir("ListingTest.tmp");
+#endif
+}
+
+bool Response::TestRanges(const char* aRange,
+                          int64_t aLength,
+                          const char* aExpected)
+{
+  RequestParser parser;
+  string request = string("GET / HTTP/1.1\r\nRange: bytes=") + aRange +
+                   "\r\n\r\n";
+  parser.Add(request.c_str(), (unsigned)request.size());
+  vector<ByteRange> ranges;
+  bool satisfiable = ResolveRanges(parser.GetRanges(), aLength, ranges);
+  string flat;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (i > 0) {
+      flat += ",";
+    }
+    flat += ToString(ranges[i].first) + "-" + ToString(ranges[i].last);
+  }
+  return satisfiable == (*aExpected != 0) && flat == aExpected;
+}
+
+void Response::TestListing(const char* aRequest,
+                           string& aHeaders,
+                           string& aBody)
+{
+  RequestParser parser;
+  parser.Add(aRequest, (unsigned)strlen(aRequest));
+  Response response(parser);
+  assert(response.mode == DIR_LIST);
+  response.BuildHeaders();
+  aHeaders = response.headers;
+  aBody.clear();
+  do {
+    aBody.append(response.chunkData, response.chunkLength);
+  } while (response.NextListingChunk(""));
 }
 #endif
 
 
-string Response::StatusCode(eMode mode) {
+const char* Response::StatusCode(eMode mode) {
+  return gHeaderTemplates[mode].mStatus;
+}
+
+void Response::Finish(bool aCompleted) {
+  if (finished) {
+    return;
+  }
+  finished = true;
+  int64_t now = GetMonotonicTime();
+
+  Stats::Increment(Stats::BYTES_SENT, headersSent + bodySent);
+  if (sleepStart) {
+    Stats::Increment(Stats::RATE_SLEEP, now - sleepStart);
+  }
+  if (aCompleted) {
+    Stats::Record(Stats::TIME_TO_LAST_BYTE, now - startTime);
+    if (shaper && bodySent > 0 && now > bodyStartTime) {
+      double achieved = bodySent * 1000000.0 / (now - bodyStartTime);
+      Stats::Record(Stats::RATE_ACHIEVED,
+                    (int64_t)(achieved * 1000 / shaper->Rate() + 0.5));
+    }
+  }
+
+  if (!Log::IsEnabled(LOG_INFO)) {
+    return;
+  }
+  static const char* methods[] = { "UNKNOWN", "HEAD", "GET", "POST" };
+  const char* method = methods[parser.GetMethod()];
+  // Request id, method, target, status, body bytes, duration.
+  Log::Write(LOG_INFO, "%d %s /%s %.3s %lld %.1fms%s",
+             parser.id, method, parser.GetTarget().c_str(), StatusCode(mode),
+             (long long)bodySent, (now - startTime) / 1000.0,
+             aCompleted ? "" : " aborted");
+}
+
+Stats::eCounter Response::RequestCounter(eMode mode) {
   switch (mode) {
-    case GET_ENTIRE_FILE: return string("200 OK");
-    case GET_FILE_RANGE: return string("206 OK");
-    case DIR_LIST: return string("200 OK");
-    case ERROR_FILE_NOT_EXIST: return string("404 File Not Found");
+    case GET_ENTIRE_FILE: return Stats::REQUESTS_ENTIRE_FILE;
+    case GET_FILE_RANGE: return Stats::REQUESTS_FILE_RANGE;
+    case DIR_LIST: return Stats::REQUESTS_DIR_LIST;
+    case STATS: return Stats::REQUESTS_STATS;
+    case NOT_MODIFIED: return Stats::REQUESTS_NOT_MODIFIED;
+    case ERROR_FILE_NOT_EXIST: return Stats::REQUESTS_NOT_FOUND;
+    case ERROR_RANGE_NOT_SATISFIABLE:
+      return Stats::REQUESTS_RANGE_NOT_SATISFIABLE;
     case INTERNAL_ERROR:
     default:
-      return string("500 Internal Server Error");
+      return Stats::REQUESTS_INTERNAL_ERROR;
   };
 }
 
-string Response::ExtractContentType(const string& file, eMode mode) {
-  if (mode == ERROR_FILE_NOT_EXIST || mode == INTERNAL_ERROR)
+const char* Response::ExtractContentType(const string& file, eMode mode) {
+  if (mode == ERROR_FILE_NOT_EXIST || mode == ERROR_RANGE_NOT_SATISFIABLE ||
+      mode == INTERNAL_ERROR)
     return "text/html; charset=utf-8";
   if (mode == DIR_LIST)
     return DIR_LIST_CHARSET;
+  if (mode == STATS)
+    return "text/plain; version=0.0.4; charset=utf-8";
 
   size_t dot = file.rfind(".");
   if (dot == string::npos) {
@@ -357,12 +1296,10 @@ string Response::ExtractContentType(const string& file, eMode mode) {
     return "application/octet-stream";
   }
 
-  string extension(file, dot+1, file.size() - dot - 1);
-  StrToLower(extension);
-
+  const char* extension = file.c_str() + dot + 1;
   for (unsigned i=0; i<ARRAY_LENGTH(gContentTypes); i++) {
-    if (extension == gContentTypes[i][0]) {
-      return string(gContentTypes[i][1]);
+    if (strcasecmp(extension, gContentTypes[i][0]) == 0) {
+      return gContentTypes[i][1];
     }
   }
   return "application/octet-stream";
@@ -376,19 +1313,177 @@ static char const day[7][4] = {
   "Sun","Mon","Tue","Wed","Thu","Fri","Sat"
 };
 
-string Response::GetDate() {
+const char* Response::GetDate() {
   time_t rawtime;
   time(&rawtime);
+  DateCache& cache = gDateCache;
+  if (rawtime == cache.mTime) {
+    return cache.mHeader;
+  }
+  char date[HTTP_DATE_SIZE];
+  FormatHttpDate(rawtime, date);
+  snprintf(cache.mHeader, ARRAY_LENGTH(cache.mHeader), "Date: %s\r\n", date);
+  cache.mTime = rawtime;
+  return cache.mHeader;
+}
+
+// Writes the two digits of aValue, from 0 to 99, to aBuffer.
+static void FormatTwoDigits(int aValue, char* aBuffer) {
+  aBuffer[0] = (char)('0' + aValue / 10);
+  aBuffer[1] = (char)('0' + aValue % 10);
+}
+
+void Response::FormatHttpDate(int64_t aTime, char* aBuffer) {
+  time_t rawtime = (time_t)aTime;
   struct tm t;
-  if (!gmtime_r(&rawtime, &t)) {
-    return "Date: Thu Jan 01 1970 00:00:00 GMT";
+  // Only years 0 to 9999 fit.
+  if (!gmtime_r(&rawtime, &t) || t.tm_year < -1900 || t.tm_year > 8099) {
+    strcpy(aBuffer, "Thu, 01 Jan 1970 00:00:00 GMT");
+    return;
   }
+  // Sun, 06 Nov 1994 08:49:37 GMT
+  int year = 1900 + t.tm_year;
+  memcpy(aBuffer, day[t.tm_wday], 3);
+  memcpy(aBuffer + 3, ", ", 2);
+  FormatTwoDigits(t.tm_mday, aBuffer + 5);
+  aBuffer[7] = ' ';
+  memcpy(aBuffer + 8, month[t.tm_mon], 3);
+  aBuffer[11] = ' ';
+  FormatTwoDigits(year / 100, aBuffer + 12);
+  FormatTwoDigits(year % 100, aBuffer + 14);
+  aBuffer[16] = ' ';
+  FormatTwoDigits(t.tm_hour, aBuffer + 17);
+  aBuffer[19] = ':';
+  FormatTwoDigits(t.tm_min, aBuffer + 20);
+  aBuffer[22] = ':';
+  FormatTwoDigits(t.tm_sec, aBuffer + 23);
+  memcpy(aBuffer + 25, " GMT", 5);
+}
 
-  char buf[128];
-  unsigned len = snprintf(buf, ARRAY_LENGTH(buf),
-    "Date: %s, %d %s %d %.2d:%.2d:%.2d GMT",
-    day[t.tm_wday], t.tm_mday, month[t.tm_mon],
-    1900 + t.tm_year, t.tm_hour, t.tm_min, t.tm_sec);
+// Returns the value of the aLength digits at aDigits, or -1 if they
+// aren't all digits.
+static int ParseFixedDigits(const char* aDigits, unsigned aLength) {
+  int value = 0;
+  for (unsigned i = 0; i < aLength; i++) {
+    if (aDigits[i] < '0' || aDigits[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + (aDigits[i] - '0');
+  }
+  return value;
+}
 
-  return string(buf, len);
+// Days from 1970-01-01 to the given date in the proleptic Gregorian
+// calendar, with aMonth from 1.
+static int64_t DaysFromCivil(int64_t aYear, int aMonth, int aDay) {
+  aYear -= aMonth <= 2;
+  int64_t era = (aYear >= 0 ? aYear : aYear - 399) / 400;
+  int64_t yearOfEra = aYear - era * 400;
+  int64_t dayOfYear = (153 * (aMonth + (aMonth > 2 ? -3 : 9)) + 2) / 5 +
+                      aDay - 1;
+  int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 +
+                     dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+bool Response::ParseHttpDate(const string& aDate, int64_t& aTime) {
+  // Sun, 06 Nov 1994 08:49:37 GMT
+  if (aDate.size() != HTTP_DATE_SIZE - 1 ||
+      aDate.compare(3, 2, ", ") != 0 ||
+      aDate[7] != ' ' || aDate[11] != ' ' || aDate[16] != ' ' ||
+      aDate[19] != ':' || aDate[22] != ':' ||
+      aDate.compare(25, 4, " GMT") != 0) {
+    return false;
+  }
+  const char* s = aDate.c_str();
+  int mday = ParseFixedDigits(s + 5, 2);
+  int year = ParseFixedDigits(s + 12, 4);
+  int hour = ParseFixedDigits(s + 17, 2);
+  int minute = ParseFixedDigits(s + 20, 2);
+  int second = ParseFixedDigits(s + 23, 2);
+  int mon = 0;
+  while (mon < 12 && aDate.compare(8, 3, month[mon]) != 0) {
+    mon++;
+  }
+  if (mday < 1 || mday > 31 || year < 0 || hour < 0 || hour > 23 ||
+      minute < 0 || minute > 59 || second < 0 || second > 60 || mon == 12) {
+    return false;
+  }
+  aTime = DaysFromCivil(year, mon + 1, mday) * 86400 +
+          hour * 3600 + minute * 60 + second;
+  return true;
+}
+
+bool Response::MatchETag(const string& aList,
+                         const string& aETag,
+                         bool aStrong)
+{
+  size_t i = 0;
+  while (i < aList.size()) {
+    char c = aList[i];
+    if (c == ' ' || c == '\t' || c == ',') {
+      i++;
+      continue;
+    }
+    if (c == '*') {
+      return true;
+    }
+    bool weak = aList.compare(i, 2, "W/") == 0;
+    if (weak) {
+      i += 2;
+    }
+    if (i >= aList.size() || aList[i] != '"') {
+      return false;
+    }
+    // Tags may contain commas, so find the closing quote.
+    size_t close = aList.find('"', i + 1);
+    if (close == string::npos) {
+      return false;
+    }
+    if (!(weak && aStrong) && aList.compare(i, close + 1 - i, aETag) == 0) {
+      return true;
+    }
+    i = close + 1;
+  }
+  return false;
+}
+
+void Response::BuildETag(uint64_t aInode) {
+  etag = "\"";
+  AppendHex(etag, (uint64_t)fileLength);
+  etag += '-';
+  AppendHex(etag, (uint64_t)lastModified);
+  etag += '-';
+  AppendHex(etag, aInode);
+  if (gzipped) {
+    etag += "-gz";
+  }
+  etag += '"';
+}
+
+bool Response::IsNotModified() const {
+  if (parser.GetMethod() != GET && parser.GetMethod() != HEAD) {
+    return false;
+  }
+  // If-None-Match takes precedence over If-Modified-Since.
+  const string& ifNoneMatch = parser.GetIfNoneMatch();
+  if (!ifNoneMatch.empty()) {
+    return MatchETag(ifNoneMatch, etag, false);
+  }
+  int64_t since;
+  return !parser.GetIfModifiedSince().empty() &&
+         ParseHttpDate(parser.GetIfModifiedSince(), since) &&
+         lastModified <= since;
+}
+
+bool Response::IfRangeMatches() const {
+  const string& ifRange = parser.GetIfRange();
+  if (ifRange.empty()) {
+    return true;
+  }
+  if (ifRange[0] == '"' || ifRange.compare(0, 2, "W/") == 0) {
+    return MatchETag(ifRange, etag, true);
+  }
+  int64_t date;
+  return ParseHttpDate(ifRange, date) && date == lastModified;
 }
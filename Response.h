@@ -33,8 +33,18 @@
 #define __RESPONSE_H__
 
 #include "Utils.h"
+#include "BufferPool.h"
+#include "FileCache.h"
+#include "GzipCache.h"
+#include "ListingCache.h"
+#include "LiveFanout.h"
+#include "MetadataCache.h"
 #include "RequestParser.h"
 #include "Sockets.h"
+#include "Stats.h"
+
+class PathEnumerator;
+class TokenBucket;
 
 class Response {
 
@@ -42,39 +52,289 @@ class Response {
     GET_ENTIRE_FILE,
     GET_FILE_RANGE,
     DIR_LIST,
+    STATS,
+    NOT_MODIFIED,
     ERROR_FILE_NOT_EXIST,
+    ERROR_RANGE_NOT_SATISFIABLE,
     INTERNAL_ERROR
   };
 
 public:
-  Response(RequestParser p);
+  // Progress reported by SendHeaders() and SendBody(). Both can be called
+  // repeatedly on a non-blocking socket; each call resumes from where the
+  // previous one stopped.
+  enum eStatus {
+    // Some output was sent; call again.
+    SEND_MORE,
+    // The socket's send buffer is full; call again once it's writable.
+    SEND_BLOCKED,
+    // Output is being paced; call again once GetWakeTime() has passed.
+    SEND_WAITING,
+    // This part of the response has been completely sent.
+    SEND_DONE,
+    // Transmission failed, the connection should be dropped.
+    SEND_FAILED
+  };
+
+  // aParser must outlive the response.
+  Response(const RequestParser& aParser);
+  ~Response();
+
+  eStatus SendHeaders(Socket* aSocket);
+
+  eStatus SendBody(Socket *aSocket);
+
+  // Writes the access log line and records the stats for this response,
+  // unless already done. aCompleted is false if the response was cut
+  // short.
+  void Finish(bool aCompleted);
 
-  bool SendHeaders(Socket* aSocket);
+  // True if the connection may be reused once this response is sent.
+  bool KeepAlive() const {
+    return keepAlive;
+  }
 
-  // Returns true if we need to call again.
-  bool SendBody(Socket *aSocket);
+  // Monotonic time (see GetMonotonicTime()) at which a response which
+  // returned SEND_WAITING can next make progress.
+  int64_t GetWakeTime() const {
+    return wakeTime;
+  }
 
 #ifdef _DEBUG
   static void Test();
 #endif
 
 private:
+  // Times private helpers; see bench/MicroBench.cpp.
+  friend class MicroBench;
+
+#ifdef _DEBUG
+  static bool TestRanges(const char* aRange,
+                         int64_t aLength,
+                         const char* aExpected);
+
+  // Sets aHeaders and aBody to the response to aRequest for a directory
+  // listing, streaming it to the end.
+  static void TestListing(const char* aRequest,
+                          string& aHeaders,
+                          string& aBody);
+#endif
+
+  static const char* StatusCode(eMode mode);
+
+  static Stats::eCounter RequestCounter(eMode mode);
+
+  static const char* ExtractContentType(const string& file, eMode mode);
+
+  // Converts the ranges a client asked for into inclusive offsets in a
+  // file of aLength bytes, in aRanges. Unsatisfiable ranges are dropped,
+  // and those which overlap or are adjacent are merged, leaving them in
+  // ascending order. Returns false if no range could be satisfied.
+  static bool ResolveRanges(const vector<ByteRange>& aRequested,
+                            int64_t aLength,
+                            vector<ByteRange>& aRanges);
+
+  // Returns the Date header line, including its CRLF. The string is only
+  // valid until the calling thread's next call.
+  static const char* GetDate();
+
+  // Writes aTime, in seconds since the epoch, to aBuffer as an HTTP date,
+  // e.g. "Sun, 06 Nov 1994 08:49:37 GMT", null terminated. aBuffer must
+  // have room for HTTP_DATE_SIZE characters.
+  static void FormatHttpDate(int64_t aTime, char* aBuffer);
+
+  // Parses an HTTP date in the preferred format, as produced by
+  // FormatHttpDate(), into aTime. Returns false if it isn't one.
+  static bool ParseHttpDate(const string& aDate, int64_t& aTime);
+
+  // True if aList, the value of an If-None-Match or If-Range header, is
+  // "*" or contains aETag. With aStrong, weak tags never match.
+  static bool MatchETag(const string& aList,
+                        const string& aETag,
+                        bool aStrong);
+
+  // True for content types which are worth compressing.
+  static bool IsCompressible(const char* aContentType);
+
+  // Chooses the content coding of the file, from those the client accepts:
+  // a precompressed .br or .gz sibling of the file, if there is one, else
+  // the cached gzip compressed copy of a small file, if it's ready and
+  // smaller. Switches to the sibling's
+  // metadata, setting aInode to its inode, when one is used.
+  void SelectEncoding(uint64_t& aInode);
+
+  // Switches to sending the file's sibling with aSuffix appended to its
+  // path, if it exists. Returns false if it doesn't.
+  bool UseSibling(const char* aSuffix, uint64_t& aInode);
+
+  // Returns the body if it's in memory, either as a cached mapping of the
+  // file or its cached compressed copy, setting aLength to its length.
+  // Returns null if the body is to be sent from the file's descriptor.
+  const char* GetBodyInMemory(int64_t& aLength) const;
 
-  static string StatusCode(eMode mode);
+  // Sets etag from the file's length, modification time and inode.
+  void BuildETag(uint64_t aInode);
 
-  static string ExtractContentType(const string& file, eMode mode);
+  // True if the request's preconditions show the client has the current
+  // version of the file, so we reply 304 Not Modified.
+  bool IsNotModified() const;
 
-  static string GetDate();
+  // True if a range request should be honoured, i.e. if it has no
+  // If-Range header, or that matches the current version of the file.
+  bool IfRangeMatches() const;
+
+  // Opens the file to be sent, from the file cache if possible.
+  bool OpenFile();
+  void CloseFile();
+
+  // Sets up shaper if the client asked for rate limiting.
+  void CreateShaper();
+
+  // Sends the next piece of a live stream from liveSource.
+  eStatus SendLive(Socket* aSocket, int64_t aNow);
+
+  // Serializes the status line and headers into headers.
+  void BuildHeaders();
+
+  // Opens the file and sets up the range and rate limiting, if there's a
+  // file to send, before the headers are sent so that the start of the
+  // body can go out with them. Returns false if the file can't be opened.
+  bool StartBody();
+
+  // Sets aData and aLength to the next part of the body which can be sent
+  // from memory right now, or aLength to 0 if there's none.
+  void GetBufferedBody(int64_t aNow, const char*& aData, int64_t& aLength);
+
+  // Records that aCount bytes from GetBufferedBody() were sent.
+  void BufferedBodySent(int64_t aCount);
+
+  // Prepares to send ranges[aIndex], preceded by its part headers if the
+  // body is multipart. aIndex may be ranges.size(), to finish a multipart
+  // body with its closing delimiter.
+  void StartRange(size_t aIndex);
+
+  // Returns the multipart delimiter and headers which precede
+  // ranges[aIndex], or the closing delimiter if aIndex is ranges.size().
+  string PartHeaders(size_t aIndex) const;
+
+  // Appends the Content-Range value for aRange to aOut.
+  void AppendContentRange(string& aOut, const ByteRange& aRange) const;
+
+  // Sets up the directory listing as the body: a whole HTML listing from
+  // the listing cache if possible, otherwise streamed, starting with its
+  // first piece in chunk.
+  void BuildListing();
+
+  // Generates the next piece of a streamed listing into chunk, starting
+  // with aPrefix, and framed as an HTTP chunk if chunked. Returns false,
+  // leaving chunk alone, once the whole listing has been generated.
+  bool NextListingChunk(const char* aPrefix);
+
+  // Reads the next name to list into aName, skipping "." and ".." at the
+  // top, and the entries before the requested page. Returns false at the
+  // end of the directory.
+  bool NextListingName(string& aName);
+
+  // Makes aBody the body to send from chunk.
+  void SetChunk(const string& aBody);
+
+  // Sends as much of aBuf[aOffset, aLength) as the socket accepts,
+  // advancing aOffset. Returns SEND_DONE once everything is sent.
+  static eStatus Flush(Socket* aSocket,
+                       const char* aBuf,
+                       size_t aLength,
+                       size_t& aOffset);
 
   int64_t fileLength;
-  RequestParser parser;
+  // Modification time of the file, in seconds since the epoch.
+  int64_t lastModified;
+  // Strong entity tag of the file, including its quotes, or empty if the
+  // response has no validators.
+  string etag;
+  // Content-Encoding of the body, or null if it isn't encoded. The body is
+  // gzipped, the file's shared compressed copy, if that's non-null;
+  // otherwise any encoding comes from a precompressed file. varies is true if the
+  // response depends on the client's Accept-Encoding.
+  const char* contentEncoding;
+  GzipCache::Compressed* gzipped;
+  bool varies;
+  // Cached metadata of the requested file, or null.
+  MetadataCache::Entry* entry;
+  // Content type from the metadata cache, or null to work it out.
+  const char* contentType;
+  const RequestParser& parser;
   eMode mode;
   string path;
-  FILE* file;
-  int64_t rangeStart;
-  int64_t rangeEnd;
+  // The file being sent, either as a cached mapping, or else as a
+  // descriptor. Null and -1 respectively when not in use.
+  FileCache::Mapping* mapping;
+  int file;
+  // A live stream is sent from its shared source instead, from
+  // livePosition in the stream.
+  LiveFanout::Source* liveSource;
+  int64_t livePosition;
+  // The ranges to send, and the index of the one being sent. More than
+  // one range is sent as a multipart/byteranges body.
+  vector<ByteRange> ranges;
+  size_t rangeIndex;
+  // For a multipart body: the content type of the parts, and the
+  // delimiter and headers to send before the current range, or the
+  // closing delimiter after the last, with how much of that has been sent.
+  string partType;
+  string partHeaders;
+  size_t partHeadersSent;
+  // Offset of the next byte of the file to send, and the number of bytes
+  // left to send, or -1 if we send until the end of the file.
   int64_t offset;
   int64_t bytesRemaining;
+
+  // Paces the body when the rate parameter is given, else null. Bytes are
+  // sent in pieces of at least quantum bytes.
+  TokenBucket* shaper;
+  int64_t quantum;
+
+  // Time before which no further output may be sent, used for the delay
+  // and rate parameters.
+  int64_t wakeTime;
+
+  // Serialized headers, and how much of them has been sent.
+  string headers;
+  size_t headersSent;
+
+  // Generated directory listing or stats. It's kept until it has been completely
+  // sent, so that a send which would block can be resumed. chunkData points
+  // at chunk's data, or at the shared listing when that's being sent, and
+  // is null once the body has been sent.
+  Buffer chunk;
+  ListingCache::Listing* listing;
+  // For a streamed listing: the directory being read, and whether there's
+  // more of the listing to generate, and whether it's sent with chunked
+  // transfer encoding. The listing is JSON if listJson, and starts at
+  // entry listOffset, listing at most listLimit entries, or all if -1.
+  // listIndex is the number of entries read so far.
+  PathEnumerator* enumerator;
+  bool streaming;
+  bool chunked;
+  bool listJson;
+  int64_t listOffset;
+  int64_t listLimit;
+  int64_t listIndex;
+  const char* chunkData;
+  size_t chunkLength;
+  size_t chunkSent;
+
+  bool keepAlive;
+
+  // For the access log and stats: when the response started, how many
+  // body bytes have been sent, and whether Finish() has been called.
+  int64_t startTime;
+  int64_t bodySent;
+  bool finished;
+
+  // When the shaper was created, and when the current wait for it began,
+  // or 0 if not waiting.
+  int64_t bodyStartTime;
+  int64_t sleepStart;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,368 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "Log.h"
+#include "Scheduler.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+// Longest we sleep with no timers due, in microseconds.
+#define MAX_WAIT 1000000
+
+#ifdef _WIN32
+// Longest we poll sockets for, in microseconds. There's nothing to wake us
+// from WSAPoll() when a job is scheduled, so we check regularly instead.
+#define MAX_SOCKET_WAIT 10000
+#endif
+
+// Interval between lateness reports, in microseconds.
+#define REPORT_INTERVAL 1000000
+
+#ifdef __linux__
+// Most epoll events handled per wait.
+#define MAX_EVENTS 256
+#endif
+
+Scheduler::Scheduler(ThreadPool* aPool)
+  : mPool(aPool),
+    mMonitor(Monitor::Create()),
+    mWheel(GetMonotonicTime()),
+    mEpoll(-1),
+    mWaiting(false),
+    mWaitUntil(0),
+    mShutdown(false)
+{
+  mWakePipe[0] = mWakePipe[1] = -1;
+#ifndef _WIN32
+  if (pipe(mWakePipe) < 0) {
+    perror("pipe");
+  } else {
+    for (int i = 0; i < 2; i++) {
+      fcntl(mWakePipe[i], F_SETFL, O_NONBLOCK);
+      fcntl(mWakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  }
+#endif
+#ifdef __linux__
+  if (mWakePipe[0] != -1) {
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpoll < 0) {
+      perror("epoll_create1");
+    } else {
+      // The wake pipe stays registered, with no timer.
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = 0;
+      if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWakePipe[0], &ev) < 0) {
+        perror("epoll_ctl");
+        close(mEpoll);
+        mEpoll = -1;
+      }
+    }
+  }
+#endif
+  mThread = Thread::Create(this);
+  mThread->Start();
+}
+
+Scheduler::~Scheduler() {
+  Shutdown();
+  delete mThread;
+  delete mMonitor;
+#ifndef _WIN32
+  if (mEpoll != -1) {
+    close(mEpoll);
+  }
+  for (int i = 0; i < 2; i++) {
+    if (mWakePipe[i] != -1) {
+      close(mWakePipe[i]);
+    }
+  }
+#endif
+}
+
+void Scheduler::Schedule(Runnable* aJob, int64_t aDeadline) {
+  Add(new Timer(aJob, -1, false), aDeadline);
+}
+
+void Scheduler::ScheduleReadable(Runnable* aJob,
+                                 int aSocket,
+                                 int64_t aDeadline)
+{
+  Add(new Timer(aJob, aSocket, false), aDeadline);
+}
+
+void Scheduler::ScheduleWritable(Runnable* aJob,
+                                 int aSocket,
+                                 int64_t aDeadline)
+{
+  Add(new Timer(aJob, aSocket, true), aDeadline);
+}
+
+void Scheduler::Add(Timer* aTimer, int64_t aDeadline) {
+  MonitorAutoLock lock(mMonitor);
+  if (mShutdown) {
+    delete aTimer->mJob;
+    delete aTimer;
+    return;
+  }
+  mWheel.Schedule(aTimer, aDeadline);
+  // The scheduler thread only needs waking if the new timer is due before
+  // it would wake anyway, or if its socket can't be added to the wait in
+  // progress. If it isn't waiting, it'll see the timer before it next
+  // waits.
+  bool wake = mWaiting && aDeadline < mWaitUntil;
+  if (aTimer->mSocket != -1) {
+    mWatched.insert(aTimer);
+    if (!Arm(aTimer)) {
+      wake = mWaiting;
+    }
+  }
+  if (!wake) {
+    return;
+  }
+  lock.Notify();
+#ifndef _WIN32
+  if (mWakePipe[1] != -1 && write(mWakePipe[1], "", 1) < 0) {
+    // The pipe is already full, so the scheduler will wake anyway.
+  }
+#endif
+}
+
+void Scheduler::Shutdown() {
+  {
+    MonitorAutoLock lock(mMonitor);
+    if (mShutdown) {
+      return;
+    }
+    mShutdown = true;
+    lock.Notify();
+#ifndef _WIN32
+    if (mWakePipe[1] != -1 && write(mWakePipe[1], "", 1) < 0) {
+      // Already woken.
+    }
+#endif
+  }
+  mThread->Join();
+}
+
+void Scheduler::Run() {
+  std::vector<TimerWheel::Entry*> expired;
+  int64_t nextReport = GetMonotonicTime() + REPORT_INTERVAL;
+  while (true) {
+    {
+      MonitorAutoLock lock(mMonitor);
+      if (mShutdown) {
+        // Delete the pending jobs unrun.
+        mWheel.TakeAll(expired);
+        mWatched.clear();
+        break;
+      }
+      int64_t now = GetMonotonicTime();
+      mWheel.Advance(now, expired);
+      Unwatch(expired);
+      if (expired.empty()) {
+        if (now >= nextReport) {
+          if (mWheel.Lateness().Count() > 0) {
+            LOG(LOG_INFO, "Scheduler lateness (us): %s",
+                mWheel.Lateness().Summary().c_str());
+            mWheel.Lateness().Reset();
+          }
+          nextReport = now + REPORT_INTERVAL;
+        }
+        Wait(lock, mWheel.NextTimeout(now, MAX_WAIT), expired);
+        if (expired.empty()) {
+          continue;
+        }
+      }
+    }
+    // Dispatch outside the lock; Dispatch() blocks if the pool's queue is
+    // full, and connections may be scheduling more timers meanwhile.
+    for (size_t i = 0; i < expired.size(); i++) {
+      Timer* t = static_cast<Timer*>(expired[i]);
+      mPool->Dispatch(t->mJob);
+      delete t;
+    }
+    expired.clear();
+  }
+  for (size_t i = 0; i < expired.size(); i++) {
+    Timer* t = static_cast<Timer*>(expired[i]);
+    delete t->mJob;
+    delete t;
+  }
+}
+
+bool Scheduler::Arm(Timer* aTimer) {
+#ifdef __linux__
+  if (mEpoll == -1) {
+    return false;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLONESHOT | (aTimer->mWritable ? EPOLLOUT
+                                                : EPOLLIN | EPOLLRDHUP);
+  ev.data.ptr = aTimer;
+  // A socket which has waited here before is still registered, disabled
+  // since its event fired, so usually it only needs re-arming.
+  if (epoll_ctl(mEpoll, EPOLL_CTL_MOD, aTimer->mSocket, &ev) == 0) {
+    return true;
+  }
+  if (errno == ENOENT &&
+      epoll_ctl(mEpoll, EPOLL_CTL_ADD, aTimer->mSocket, &ev) == 0) {
+    return true;
+  }
+  LOG(LOG_ERROR, "Scheduler failed to watch socket %d", aTimer->mSocket);
+  // It still fires at its deadline.
+  mWatched.erase(aTimer);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Scheduler::Unwatch(const std::vector<TimerWheel::Entry*>& aExpired) {
+  if (mWatched.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < aExpired.size(); i++) {
+    Timer* t = static_cast<Timer*>(aExpired[i]);
+    if (!mWatched.erase(t)) {
+      continue;
+    }
+#ifdef __linux__
+    if (mEpoll != -1) {
+      // Its registration still points at the timer, which is about to be
+      // deleted.
+      epoll_ctl(mEpoll, EPOLL_CTL_DEL, t->mSocket, 0);
+    }
+#endif
+  }
+}
+
+void Scheduler::Wait(MonitorAutoLock& aLock,
+                     int64_t aTimeout,
+                     std::vector<TimerWheel::Entry*>& aReady)
+{
+  int ms = (int)((aTimeout + 999) / 1000);
+  mWaiting = true;
+  mWaitUntil = GetMonotonicTime() + aTimeout;
+#ifdef __linux__
+  if (mEpoll != -1) {
+    struct epoll_event events[MAX_EVENTS];
+    // Only this thread removes timers, so they outlive the wait.
+    mMonitor->Unlock();
+    int n = epoll_wait(mEpoll, events, MAX_EVENTS, ms);
+    mMonitor->Lock();
+    mWaiting = false;
+    for (int i = 0; i < n; i++) {
+      Timer* t = static_cast<Timer*>(events[i].data.ptr);
+      if (!t) {
+        char buf[64];
+        while (read(mWakePipe[0], buf, sizeof(buf)) > 0) {
+        }
+      } else if (mWatched.erase(t)) {
+        // Its registration is disabled until it's re-armed.
+        mWheel.Cancel(t);
+        aReady.push_back(t);
+      }
+    }
+    return;
+  }
+#endif
+#ifdef _WIN32
+  if (mWatched.empty()) {
+    aLock.TimedWait(aTimeout);
+    mWaiting = false;
+    return;
+  }
+  if (aTimeout > MAX_SOCKET_WAIT) {
+    ms = MAX_SOCKET_WAIT / 1000;
+  }
+  std::vector<WSAPOLLFD> fds(mWatched.size());
+  std::vector<Timer*> timers(mWatched.begin(), mWatched.end());
+  for (size_t i = 0; i < timers.size(); i++) {
+    fds[i].fd = (SOCKET)timers[i]->mSocket;
+    fds[i].events = timers[i]->mWritable ? POLLWRNORM : POLLRDNORM;
+    fds[i].revents = 0;
+  }
+  // Only this thread removes timers, so they outlive the wait.
+  mMonitor->Unlock();
+  int n = WSAPoll(&fds[0], (ULONG)fds.size(), ms);
+  mMonitor->Lock();
+  size_t first = 0;
+#else
+  if (mWakePipe[0] == -1) {
+    aLock.TimedWait(aTimeout);
+    mWaiting = false;
+    return;
+  }
+  // The wake pipe comes first, followed by the watched sockets.
+  std::vector<struct pollfd> fds(mWatched.size() + 1);
+  std::vector<Timer*> timers(mWatched.begin(), mWatched.end());
+  fds[0].fd = mWakePipe[0];
+  fds[0].events = POLLIN;
+  for (size_t i = 0; i < timers.size(); i++) {
+    fds[i + 1].fd = timers[i]->mSocket;
+    fds[i + 1].events = timers[i]->mWritable ? POLLOUT : POLLIN;
+  }
+  // Only this thread removes timers, so they outlive the wait.
+  mMonitor->Unlock();
+  int n = poll(&fds[0], fds.size(), ms);
+  mMonitor->Lock();
+  if (n > 0 && fds[0].revents) {
+    char buf[64];
+    while (read(mWakePipe[0], buf, sizeof(buf)) > 0) {
+    }
+  }
+  size_t first = 1;
+#endif
+  mWaiting = false;
+  if (n <= 0) {
+    return;
+  }
+  for (size_t i = 0; i < timers.size(); i++) {
+    if (fds[first + i].revents && mWatched.erase(timers[i])) {
+      mWheel.Cancel(timers[i]);
+      aReady.push_back(timers[i]);
+    }
+  }
+}
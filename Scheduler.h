@@ -0,0 +1,122 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <set>
+
+#include "Thread.h"
+#include "ThreadPool.h"
+#include "TimerWheel.h"
+
+// Dispatches jobs to a thread pool once their deadline has passed, or
+// once a socket they're waiting on is ready. A connection which is
+// waiting to send (for delay= or rate=, or for room in its socket's send
+// buffer), or waiting for its next request, hands itself to the scheduler
+// rather than sleeping, so its pool thread is free to serve other
+// connections in the meantime. On Linux, watched sockets are registered
+// one-shot with epoll, so waking costs nothing per idle connection. Timer
+// lateness percentiles are printed once per second while timers are
+// firing.
+class Scheduler : public Runnable {
+public:
+  Scheduler(ThreadPool* aPool);
+
+  // Shuts down the scheduler; jobs still pending are deleted unrun.
+  ~Scheduler();
+
+  // Dispatches aJob to the pool at time aDeadline (see
+  // GetMonotonicTime()). The scheduler takes ownership of aJob.
+  void Schedule(Runnable* aJob, int64_t aDeadline);
+
+  // Dispatches aJob to the pool once aSocket is readable or has been
+  // closed by its peer, or at aDeadline if that comes first. The
+  // scheduler takes ownership of aJob.
+  void ScheduleReadable(Runnable* aJob, int aSocket, int64_t aDeadline);
+
+  // Dispatches aJob to the pool once aSocket is writable, or at aDeadline
+  // if that comes first. The scheduler takes ownership of aJob.
+  void ScheduleWritable(Runnable* aJob, int aSocket, int64_t aDeadline);
+
+  void Shutdown();
+
+  virtual void Run();
+
+private:
+  class Timer : public TimerWheel::Entry {
+  public:
+    Timer(Runnable* aJob, int aSocket, bool aWritable)
+      : mJob(aJob), mSocket(aSocket), mWritable(aWritable) {}
+    Runnable* mJob;
+    // Socket whose readiness also fires the timer, or -1.
+    int mSocket;
+    // Whether the timer fires when mSocket is writable, not readable.
+    bool mWritable;
+  };
+
+  void Add(Timer* aTimer, int64_t aDeadline);
+
+  // Registers aTimer's socket with mEpoll, so that a wait in progress
+  // notices it becoming ready. Returns false if there's no epoll, in which
+  // case the socket is only watched from the next wait.
+  bool Arm(Timer* aTimer);
+
+  // Stops watching the sockets of timers which have expired.
+  void Unwatch(const std::vector<TimerWheel::Entry*>& aExpired);
+
+  // Waits for at most aTimeout microseconds, or until a watched socket is
+  // ready or a job is scheduled which is due sooner, and appends the
+  // timers of ready sockets to aReady. Called with the lock held, which is
+  // released while waiting.
+  void Wait(MonitorAutoLock& aLock,
+            int64_t aTimeout,
+            std::vector<TimerWheel::Entry*>& aReady);
+
+  ThreadPool* mPool;
+  Monitor* mMonitor;
+  TimerWheel mWheel;
+  Thread* mThread;
+  // Timers which also fire when their socket is ready.
+  std::set<Timer*> mWatched;
+  // Written to wake the scheduler thread from epoll_wait() or poll(),
+  // where available.
+  int mWakePipe[2];
+  // Watched sockets and the wake pipe, on Linux; otherwise -1.
+  int mEpoll;
+  // Whether the scheduler thread is waiting, and until when. Jobs due
+  // after that don't need to wake it.
+  bool mWaiting;
+  int64_t mWaitUntil;
+  bool mShutdown;
+};
+
+#endif
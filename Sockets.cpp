@@ -37,30 +37,51 @@
 
 #include <iostream>
 
+#include "BufferPool.h"
+#include "Log.h"
 #include "Sockets.h"
+#include "Thread.h"
 #include "Utils.h"
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+// Size of the bounce buffer used where the OS can't send from a file
+// directly.
+#define SENDFILE_BUFLEN (64 * 1024)
+
 #ifdef _WIN32
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <io.h>
 
 #pragma comment(lib, "Ws2_32.lib")
 
+// How often a thread waiting for a connection checks whether it has been
+// interrupted, in milliseconds.
+#define INTERRUPT_POLL 500
+
 class Win32Socket : public Socket {
 public:
   virtual ~Win32Socket();
-  Socket* Accept();
+  bool WaitForConnection();
+  Socket* Accept(bool aNonBlocking);
   Win32Socket(SOCKET aSocket);
   void Close();
   int Send(const char* aBuf, int aSize);
+  int Send(const char* aBuf, int aSize, const char* aBuf2, int aSize2);
+  int SendMore(const char* aBuf, int aSize);
   int Receive(char* aBuf, int aSize);
+  int64_t SendFile(int aFile, int64_t& aOffset, int64_t aLength);
+  bool SetNonBlocking(bool aNonBlocking);
 
   static WSADATA sWsaData;
 };
 
 WSADATA Win32Socket::sWsaData = {0};
 
+static volatile bool sInterrupted = false;
+
 Win32Socket::Win32Socket(SOCKET aSocket)
   : Socket((int)aSocket)
 { }
@@ -70,7 +91,12 @@ Win32Socket::~Win32Socket()
   Close();
 }
 
-Socket* Socket::Open(int aPort) {
+Socket* Socket::Open(int aPort, const ListenOptions& aOptions) {
+  if (aOptions.mReusePort) {
+    cerr << "SO_REUSEPORT is not supported on Windows" << std::endl;
+    return 0;
+  }
+
   // Init a server port.
   struct addrinfo *addr = NULL, *ptr = NULL, hints;
 
@@ -110,23 +136,62 @@ Socket* Socket::Open(int aPort) {
   // Address info is no longer needed, we've bound the socket.
   freeaddrinfo(addr);
 
-  if ( listen( serverSocket, SOMAXCONN ) == SOCKET_ERROR ) {
+#ifdef TCP_FASTOPEN
+  if (aOptions.mFastOpen) {
+    DWORD enable = 1;
+    setsockopt(serverSocket, IPPROTO_TCP, TCP_FASTOPEN,
+               (const char*)&enable, sizeof(enable));
+  }
+#endif
+
+  if ( listen( serverSocket, aOptions.mBacklog ) == SOCKET_ERROR ) {
     cerr << "Listen failed with error: " << WSAGetLastError() << std::endl;
     closesocket(serverSocket);
     return 0;
   }
 
-  return new Win32Socket(serverSocket);
+  Win32Socket* listener = new Win32Socket(serverSocket);
+  if (!listener->SetNonBlocking(true)) {
+    cerr << "Can't make listener non-blocking" << std::endl;
+    delete listener;
+    return 0;
+  }
+  return listener;
 }
 
-Socket* Win32Socket::Accept() {
-  SOCKET client = accept(mSocket, NULL, NULL);
-  if (client == INVALID_SOCKET) {
-    cerr << "accept failed: " << WSAGetLastError() << std::endl;
-    closesocket(mSocket);
+bool Win32Socket::WaitForConnection() {
+  // Winsock can't wait on a socket and a signal together, so poll for
+  // interruption.
+  while (!sInterrupted) {
+    if (WaitForRead(INTERRUPT_POLL)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Socket* Win32Socket::Accept(bool aNonBlocking) {
+  while (true) {
+    SOCKET client = accept(mSocket, NULL, NULL);
+    if (client != INVALID_SOCKET) {
+      // Accepted sockets inherit the listener's non-blocking mode.
+      Win32Socket* socket = new Win32Socket(client);
+      if (!aNonBlocking && !socket->SetNonBlocking(false)) {
+        delete socket;
+        continue;
+      }
+      return socket;
+    }
+    int err = WSAGetLastError();
+    if (err == WSAECONNRESET) {
+      // The client gave up while waiting to be accepted.
+      continue;
+    }
+    if (err != WSAEWOULDBLOCK) {
+      LOG(LOG_ERROR, "accept failed: %d", err);
+    }
     return 0;
   }
-  return new Win32Socket(client);
 }
 
 void Win32Socket::Close() {
@@ -137,16 +202,66 @@ void Win32Socket::Close() {
 }
 
 int Win32Socket::Receive(char* aBuf, int aSize) {
-  memset(aBuf, 0, aSize);
   int r = recv(mSocket, aBuf, aSize, 0);
   if (r < 0) {
-    cerr << "recv failed: " << WSAGetLastError() << std::endl;
+    int err = WSAGetLastError();
+    if (err == WSAEWOULDBLOCK || err == WSAETIMEDOUT) {
+      return WOULD_BLOCK;
+    }
+    LOG(LOG_WARNING, "recv failed: %d", err);
   }
   return r;
 }
 
 int Win32Socket::Send(const char* aBuf, int aSize) {
-  return send(mSocket, aBuf, aSize, 0);
+  int r = send(mSocket, aBuf, aSize, 0);
+  if (r < 0 && WSAGetLastError() == WSAEWOULDBLOCK) {
+    return WOULD_BLOCK;
+  }
+  return r;
+}
+
+int Win32Socket::Send(const char* aBuf, int aSize,
+                      const char* aBuf2, int aSize2)
+{
+  WSABUF bufs[2];
+  bufs[0].buf = const_cast<char*>(aBuf);
+  bufs[0].len = aSize;
+  bufs[1].buf = const_cast<char*>(aBuf2);
+  bufs[1].len = aSize2;
+  DWORD sent = 0;
+  if (WSASend(mSocket, bufs, 2, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+    return WSAGetLastError() == WSAEWOULDBLOCK ? WOULD_BLOCK : -1;
+  }
+  return (int)sent;
+}
+
+int Win32Socket::SendMore(const char* aBuf, int aSize) {
+  return Send(aBuf, aSize);
+}
+
+int64_t Win32Socket::SendFile(int aFile, int64_t& aOffset, int64_t aLength) {
+  // TransmitFile() needs overlapped I/O to be useful on a non-blocking
+  // socket, so copy through a buffer instead.
+  Buffer buf((size_t)MIN(aLength, SENDFILE_BUFLEN));
+  if (_lseeki64(aFile, aOffset, SEEK_SET) < 0) {
+    return -1;
+  }
+  unsigned count = (unsigned)MIN(aLength, (int64_t)buf.Capacity());
+  int n = _read(aFile, buf.Data(), count);
+  if (n <= 0) {
+    return n;
+  }
+  int r = Send(buf.Data(), n);
+  if (r > 0) {
+    aOffset += r;
+  }
+  return r;
+}
+
+bool Win32Socket::SetNonBlocking(bool aNonBlocking) {
+  u_long mode = aNonBlocking ? 1 : 0;
+  return ioctlsocket(mSocket, FIONBIO, &mode) == 0;
 }
 
 int Socket::Init() {
@@ -164,28 +279,94 @@ int Socket::Shutdown() {
   return 0;
 }
 
+void Socket::Interrupt() {
+  sInterrupted = true;
+}
+
 #else
 
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+
+// Linux transfers at most this many bytes per sendfile() call.
+#define MAX_SENDFILE 0x7ffff000
+#endif
 
 #define SOCKET_ERROR -1
 
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
 class UnixSocket : public Socket {
 public:
   virtual ~UnixSocket();
-  Socket* Accept();
+  bool WaitForConnection();
+  Socket* Accept(bool aNonBlocking);
   UnixSocket(int aSocket);
   void Close();
   int Send(const char* aBuf, int aSize);
+  int Send(const char* aBuf, int aSize, const char* aBuf2, int aSize2);
+  int SendMore(const char* aBuf, int aSize);
   int Receive(char* aBuf, int aSize);
+  int64_t SendFile(int aFile, int64_t& aOffset, int64_t aLength);
+  bool SetNonBlocking(bool aNonBlocking);
 };
 
-Socket* Socket::Open(int aPort) {
+// Written to by Interrupt(), and never read, so that it stays readable
+// and wakes every WaitForConnection().
+static int sInterruptPipe[2] = { -1, -1 };
+
+// Descriptor held in reserve, to be freed when we run out, so that a
+// connection can still be accepted and dropped. Guarded by sSpareMonitor.
+static int sSpareDescriptor = -1;
+static Monitor* sSpareMonitor = 0;
+
+static void SetCloseOnExec(int aFd) {
+  fcntl(aFd, F_SETFD, fcntl(aFd, F_GETFD) | FD_CLOEXEC);
+}
+
+// Called when we're out of file descriptors, so can't accept the
+// connection at the head of the backlog. It would otherwise keep the
+// listener readable forever; briefly free our spare descriptor to accept
+// and close it, so the client sees the connection reset rather than
+// hanging. Returns false if no connection was dropped, either because
+// none was pending, or there's no spare descriptor.
+static bool DropConnection(int aListener) {
+  if (!sSpareMonitor) {
+    return false;
+  }
+  MonitorAutoLock lock(sSpareMonitor);
+  if (sSpareDescriptor == -1) {
+    return false;
+  }
+  close(sSpareDescriptor);
+  // Linux fails with EMFILE before looking at the backlog, so there may
+  // be nothing to accept.
+  int client = accept(aListener, 0, 0);
+  if (client >= 0) {
+    close(client);
+  }
+  sSpareDescriptor = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (client < 0) {
+    return false;
+  }
+  LOG(LOG_WARNING, "Out of file descriptors, dropped a connection");
+  return true;
+}
+
+Socket* Socket::Open(int aPort, const ListenOptions& aOptions) {
   int sockfd;
   struct sockaddr_in serv_addr;
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -193,6 +374,23 @@ Socket* Socket::Open(int aPort) {
     perror("ERROR opening socket");
     return 0;
   }
+  // Allow the server to be restarted while old connections linger in
+  // TIME_WAIT.
+  int one = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (aOptions.mReusePort) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+      perror("ERROR setting SO_REUSEPORT");
+      close(sockfd);
+      return 0;
+    }
+#else
+    cerr << "SO_REUSEPORT is not supported on this platform" << std::endl;
+    close(sockfd);
+    return 0;
+#endif
+  }
   bzero((char *) &serv_addr, sizeof(serv_addr));
   serv_addr.sin_family = AF_INET;
   serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -202,11 +400,39 @@ Socket* Socket::Open(int aPort) {
            sizeof(serv_addr)) < 0)
   {
     perror("ERROR on binding");
+    close(sockfd);
+    return 0;
+  }
+#ifdef TCP_DEFER_ACCEPT
+  if (aOptions.mDeferAccept) {
+    int seconds = aOptions.mDeferAccept;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+               &seconds, sizeof(seconds));
+  }
+#endif
+#ifdef TCP_FASTOPEN
+  if (aOptions.mFastOpen) {
+    int queue = aOptions.mFastOpen;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+                   &queue, sizeof(queue)) < 0) {
+      perror("Can't enable TCP_FASTOPEN");
+    }
+  }
+#endif
+  if (listen(sockfd, aOptions.mBacklog) < 0) {
+    perror("ERROR on listen");
+    close(sockfd);
     return 0;
   }
-  listen(sockfd,5);
 
-  return new UnixSocket(sockfd);
+  SetCloseOnExec(sockfd);
+  UnixSocket* listener = new UnixSocket(sockfd);
+  if (!listener->SetNonBlocking(true)) {
+    perror("Can't make listener non-blocking");
+    delete listener;
+    return 0;
+  }
+  return listener;
 }
 
 UnixSocket::UnixSocket(int aSocket)
@@ -218,24 +444,62 @@ UnixSocket::~UnixSocket() {
   Close();
 }
 
-Socket* UnixSocket::Accept() {
-  socklen_t clilen;
-  struct sockaddr_in cli_addr;
-  clilen = sizeof(cli_addr);
-
-  if (!WaitForRead(500)) {
-    return 0;
+bool UnixSocket::WaitForConnection() {
+  struct pollfd fds[2];
+  fds[0].fd = mSocket;
+  fds[0].events = POLLIN;
+  fds[1].fd = sInterruptPipe[0];
+  fds[1].events = POLLIN;
+  int n = poll(fds, sInterruptPipe[0] != -1 ? 2 : 1, -1);
+  if (n <= 0 || fds[1].revents) {
+    // Interrupted, possibly by a signal delivered to this thread.
+    return false;
   }
+  return true;
+}
 
-  int client = accept(mSocket, 
-                      (struct sockaddr *) &cli_addr, 
-                      &clilen);
-  if (client < 0)  {
-    perror("ERROR on accept");
-    close(mSocket);
-    return 0;
+Socket* UnixSocket::Accept(bool aNonBlocking) {
+  while (true) {
+#ifdef __linux__
+    int flags = SOCK_CLOEXEC | (aNonBlocking ? SOCK_NONBLOCK : 0);
+    int client = accept4(mSocket, 0, 0, flags);
+#else
+    int client = accept(mSocket, 0, 0);
+#endif
+    if (client >= 0) {
+      UnixSocket* socket = new UnixSocket(client);
+#ifndef __linux__
+      SetCloseOnExec(client);
+      // Accepted sockets may inherit the listener's non-blocking mode.
+      socket->SetNonBlocking(aNonBlocking);
+#endif
+      return socket;
+    }
+    switch (errno) {
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+        // The client gave up while waiting to be accepted.
+        continue;
+      case EMFILE:
+      case ENFILE:
+      case ENOBUFS:
+      case ENOMEM:
+        if (DropConnection(mSocket)) {
+          continue;
+        }
+        return 0;
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+        // Nothing pending, or another thread got there first.
+        return 0;
+      default:
+        LOG(LOG_ERROR, "ERROR on accept: %s", strerror(errno));
+        return 0;
+    }
   }
-  return new UnixSocket(client);
 }
 
 void UnixSocket::Close() {
@@ -246,36 +510,144 @@ void UnixSocket::Close() {
 }
 
 int UnixSocket::Receive(char* aBuf, int aSize) {
-  memset(aBuf, 0, aSize);
   int r = read(mSocket, aBuf, aSize);
   if (r < 0) {
-    fprintf(stderr, "Receive failed\n");
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return WOULD_BLOCK;
+    }
+    LOG(LOG_WARNING, "Receive failed: %s", strerror(errno));
   }
   return r;
 }
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 int UnixSocket::Send(const char* aBuf, int aSize) {
-  return write(mSocket, aBuf, aSize);
+  int r = send(mSocket, aBuf, aSize, MSG_NOSIGNAL);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return WOULD_BLOCK;
+  }
+  return r;
+}
+
+int UnixSocket::Send(const char* aBuf, int aSize,
+                     const char* aBuf2, int aSize2)
+{
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<char*>(aBuf);
+  iov[0].iov_len = aSize;
+  iov[1].iov_base = const_cast<char*>(aBuf2);
+  iov[1].iov_len = aSize2;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  int r = (int)sendmsg(mSocket, &msg, MSG_NOSIGNAL);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return WOULD_BLOCK;
+  }
+  return r;
+}
+
+int UnixSocket::SendMore(const char* aBuf, int aSize) {
+  int r = send(mSocket, aBuf, aSize, MSG_NOSIGNAL | MSG_MORE);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return WOULD_BLOCK;
+  }
+  return r;
+}
+
+int64_t UnixSocket::SendFile(int aFile, int64_t& aOffset, int64_t aLength) {
+#ifdef __linux__
+  off64_t offset = aOffset;
+  size_t count = (size_t)MIN(aLength, MAX_SENDFILE);
+  ssize_t r = sendfile64(mSocket, aFile, &offset, count);
+  if (r < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return WOULD_BLOCK;
+    }
+    LOG(LOG_WARNING, "sendfile failed: %s", strerror(errno));
+    return -1;
+  }
+  aOffset = offset;
+  return r;
+#else
+  Buffer buf((size_t)MIN(aLength, SENDFILE_BUFLEN));
+  size_t count = (size_t)MIN(aLength, (int64_t)buf.Capacity());
+  ssize_t n = pread(aFile, buf.Data(), count, aOffset);
+  if (n <= 0) {
+    return n;
+  }
+  int r = Send(buf.Data(), (int)n);
+  if (r > 0) {
+    aOffset += r;
+  }
+  return r;
+#endif
+}
+
+bool UnixSocket::SetNonBlocking(bool aNonBlocking) {
+  int flags = fcntl(mSocket, F_GETFL, 0);
+  if (flags < 0) {
+    return false;
+  }
+  flags = aNonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return fcntl(mSocket, F_SETFL, flags) == 0;
 }
 
 int Socket::Init() {
+  if (pipe(sInterruptPipe) < 0) {
+    perror("pipe");
+    sInterruptPipe[0] = sInterruptPipe[1] = -1;
+    return 1;
+  }
+  SetCloseOnExec(sInterruptPipe[0]);
+  SetCloseOnExec(sInterruptPipe[1]);
+  fcntl(sInterruptPipe[1], F_SETFL, O_NONBLOCK);
+  sSpareDescriptor = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  sSpareMonitor = Monitor::Create();
   return 0;
 }
 
 int Socket::Shutdown() {
+  for (int i = 0; i < 2; i++) {
+    if (sInterruptPipe[i] != -1) {
+      close(sInterruptPipe[i]);
+      sInterruptPipe[i] = -1;
+    }
+  }
+  if (sSpareDescriptor != -1) {
+    close(sSpareDescriptor);
+    sSpareDescriptor = -1;
+  }
+  delete sSpareMonitor;
+  sSpareMonitor = 0;
   return 0;
 }
 
+void Socket::Interrupt() {
+  if (sInterruptPipe[1] != -1) {
+    char c = 0;
+    ssize_t r = write(sInterruptPipe[1], &c, 1);
+    (void)r;
+  }
+}
+
 #endif
 
-bool Socket::WaitForRead(unsigned timeout) {
+bool Socket::WaitForRead(unsigned aTimeout) {
   fd_set socks;
   FD_ZERO(&socks);
   FD_SET((unsigned)mSocket, &socks);
 
   struct timeval to;
-  to.tv_sec = 0;
-  to.tv_usec = timeout;
+  to.tv_sec = aTimeout / 1000;
+  to.tv_usec = (aTimeout % 1000) * 1000;
   
   return select(mSocket + 1, &socks, 0, 0, &to) > 0;
 }
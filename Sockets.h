@@ -34,6 +34,8 @@
 
 #include <string>
 
+#include "Utils.h"
+
 using std::string;
 
 // Wraps platform-specific socket API.
@@ -43,36 +45,104 @@ protected:
 
   Socket(int aSocket) : mSocket(aSocket) {}
 
-  // Wait on the socket for a read to become available
-  bool WaitForRead(unsigned timeout);
+  // Wait on the socket for a read to become available, for at most
+  // aTimeout milliseconds.
+  bool WaitForRead(unsigned aTimeout);
 
 public:
+  // Returned by Send() and Receive() on a non-blocking socket when the
+  // operation can't proceed without waiting.
+  static const int WOULD_BLOCK = -2;
+
   // Initialize sockets library.
   static int Init();
   
   // Shutdown sockets library.
   static int Shutdown();
+
+  // Wakes every thread blocked in WaitForConnection(), and makes later
+  // calls return immediately. Safe to call from a signal handler.
+  static void Interrupt();
+
+  struct ListenOptions {
+    ListenOptions()
+      : mBacklog(128),
+        mReusePort(false),
+        mDeferAccept(0),
+        mFastOpen(0)
+    {}
+    // Connections which may wait to be accepted.
+    int mBacklog;
+    // Allow several sockets to be opened on the same port, and have the
+    // kernel spread incoming connections between them. Fails where
+    // SO_REUSEPORT isn't supported.
+    bool mReusePort;
+    // If non-zero, don't report a connection until the client has sent
+    // data, or this many seconds have passed (TCP_DEFER_ACCEPT, Linux).
+    int mDeferAccept;
+    // If non-zero, accept data in the SYN, allowing up to this many such
+    // connections to be pending (TCP_FASTOPEN).
+    int mFastOpen;
+  };
   
   virtual ~Socket() {}
   
   // Opens a port for inbound connections. Use this to create a socket
-  // and open an inbound port.
-  static Socket* Open(int aPort);
-  
-  // Accepts connections on an open port.
-  virtual Socket* Accept() = 0;
+  // and open an inbound port. The socket is non-blocking, so use
+  // WaitForConnection() to wait for clients.
+  static Socket* Open(int aPort, const ListenOptions& aOptions);
+
+  // Blocks until a connection may be ready to accept, or Interrupt() is
+  // called. Returns false if interrupted.
+  virtual bool WaitForConnection() = 0;
+
+  // Accepts a pending connection on an open port, or returns null if
+  // there are none. Call repeatedly to drain all pending connections.
+  // Clients which have already given up are skipped, and if we're out of
+  // file descriptors the next pending connection is dropped, so a full
+  // backlog can't leave the listener spinning. The accepted socket is
+  // non-blocking if aNonBlocking is true.
+  virtual Socket* Accept(bool aNonBlocking) = 0;
 
   // Shutsdown connection.
   virtual void Close() = 0;
 
   // Sends data over socket. Returns number of bytes sent, or -1 on error.
-  // Blocking.
+  // Blocking, unless SetNonBlocking() has been called, in which case
+  // WOULD_BLOCK is returned if the send buffer is full.
   virtual int Send(const char* aBuf, int aSize) = 0;
 
+  // Sends aBuf followed by aBuf2 in a single gathered write, so both can
+  // go out in the same packet. Returns the total number of bytes sent,
+  // as Send().
+  virtual int Send(const char* aBuf, int aSize,
+                   const char* aBuf2, int aSize2) = 0;
+
+  // As Send(), but hints that more data will follow immediately, so a
+  // partly filled packet needn't be sent yet.
+  virtual int SendMore(const char* aBuf, int aSize) = 0;
+
   // Reads data from an open socket. Returns number of bytes read, or 0 if
-  // connection is closing. <0 on error. Blocking.
+  // connection is closing. <0 on error. Blocking, unless SetNonBlocking()
+  // has been called, in which case WOULD_BLOCK is returned if there's no
+  // data available.
   virtual int Receive(char* aBuf, int aSize) = 0;
 
+  // Sends up to aLength bytes of the open file aFile starting at aOffset,
+  // without copying them through user space where the platform allows.
+  // aOffset is advanced past the bytes sent. Returns the number of bytes
+  // sent, 0 at end of file, WOULD_BLOCK, or -1 on error.
+  virtual int64_t SendFile(int aFile, int64_t& aOffset, int64_t aLength) = 0;
+
+  // Switches the socket into or out of non-blocking mode. Returns false
+  // on failure.
+  virtual bool SetNonBlocking(bool aNonBlocking) = 0;
+
+  // Returns the OS socket handle, for use with readiness APIs.
+  int GetDescriptor() const {
+    return mSocket;
+  }
+
   // Returns a string representation of the local IP address.
   string GetIP() const;
 
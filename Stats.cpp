@@ -0,0 +1,390 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Histogram.h"
+#include "Stats.h"
+#include "Thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+struct StatsTotals {
+  StatsTotals() {
+    memset(mCounters, 0, sizeof(mCounters));
+  }
+
+  void Add(const StatsTotals& aOther) {
+    for (int i = 0; i < Stats::NUM_COUNTERS; i++) {
+      mCounters[i] += aOther.mCounters[i];
+    }
+    for (int i = 0; i < Stats::NUM_HISTOGRAMS; i++) {
+      mHistograms[i].Add(aOther.mHistograms[i]);
+    }
+  }
+
+  int64_t mCounters[Stats::NUM_COUNTERS];
+  Histogram mHistograms[Stats::NUM_HISTOGRAMS];
+};
+
+// One thread's stats. Only the owning thread records into it; mMonitor
+// keeps Format() from reading it mid-update.
+struct StatsShard : public StatsTotals {
+  StatsShard() : mMonitor(Monitor::Create()), mNext(0) {}
+  ~StatsShard() {
+    delete mMonitor;
+  }
+  Monitor* mMonitor;
+  StatsShard* mNext;
+};
+
+// Guards the list of shards and the totals of exited threads.
+static Monitor* sMonitor = 0;
+static StatsShard* sShards = 0;
+static StatsTotals* sRetired = 0;
+
+// Folds an exited thread's shard into sRetired, so totals never go
+// backwards.
+static void RetireShard(StatsShard* aShard) {
+  MonitorAutoLock lock(sMonitor);
+  StatsShard** link = &sShards;
+  while (*link != aShard) {
+    link = &(*link)->mNext;
+  }
+  *link = aShard->mNext;
+  sRetired->Add(*aShard);
+  delete aShard;
+}
+
+#ifdef _WIN32
+
+// Fiber local storage, rather than TLS, so we're told when threads exit.
+static DWORD sShardKey = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI ShardDestructor(PVOID aShard) {
+  if (aShard) {
+    RetireShard(static_cast<StatsShard*>(aShard));
+  }
+}
+
+static bool CreateShardKey() {
+  sShardKey = FlsAlloc(ShardDestructor);
+  return sShardKey != FLS_OUT_OF_INDEXES;
+}
+
+static void DeleteShardKey() {
+  FlsFree(sShardKey);
+  sShardKey = FLS_OUT_OF_INDEXES;
+}
+
+static StatsShard* GetShard() {
+  return static_cast<StatsShard*>(FlsGetValue(sShardKey));
+}
+
+static void SetShard(StatsShard* aShard) {
+  FlsSetValue(sShardKey, aShard);
+}
+
+#else
+
+static pthread_key_t sShardKey;
+
+static void ShardDestructor(void* aShard) {
+  RetireShard(static_cast<StatsShard*>(aShard));
+}
+
+static bool CreateShardKey() {
+  return pthread_key_create(&sShardKey, ShardDestructor) == 0;
+}
+
+static void DeleteShardKey() {
+  pthread_key_delete(sShardKey);
+}
+
+static StatsShard* GetShard() {
+  return static_cast<StatsShard*>(pthread_getspecific(sShardKey));
+}
+
+static void SetShard(StatsShard* aShard) {
+  pthread_setspecific(sShardKey, aShard);
+}
+
+#endif
+
+// Returns the calling thread's shard, creating it if need be, or null if
+// stats aren't initialized.
+static StatsShard* GetThreadShard() {
+  if (!sMonitor) {
+    return 0;
+  }
+  StatsShard* shard = GetShard();
+  if (!shard) {
+    shard = new StatsShard();
+    SetShard(shard);
+    MonitorAutoLock lock(sMonitor);
+    shard->mNext = sShards;
+    sShards = shard;
+  }
+  return shard;
+}
+
+void Stats::Init() {
+  if (sMonitor || !CreateShardKey()) {
+    return;
+  }
+  sMonitor = Monitor::Create();
+  sRetired = new StatsTotals();
+}
+
+void Stats::Shutdown() {
+  if (!sMonitor) {
+    return;
+  }
+  StatsShard* shard = GetShard();
+  if (shard) {
+    SetShard(0);
+    RetireShard(shard);
+  }
+  DeleteShardKey();
+  // Other threads should have exited by now; discard anything left.
+  while (sShards) {
+    shard = sShards;
+    sShards = shard->mNext;
+    delete shard;
+  }
+  delete sRetired;
+  sRetired = 0;
+  delete sMonitor;
+  sMonitor = 0;
+}
+
+void Stats::Increment(eCounter aCounter, int64_t aAmount) {
+  StatsShard* shard = GetThreadShard();
+  if (shard) {
+    MonitorAutoLock lock(shard->mMonitor);
+    shard->mCounters[aCounter] += aAmount;
+  }
+}
+
+void Stats::Record(eHistogram aHistogram, int64_t aValue) {
+  StatsShard* shard = GetThreadShard();
+  if (shard) {
+    MonitorAutoLock lock(shard->mMonitor);
+    shard->mHistograms[aHistogram].Record(aValue);
+  }
+}
+
+#define PREFIX "httpmediaserver_"
+
+static void AppendHeader(string& aOut,
+                         const char* aName,
+                         const char* aType,
+                         const char* aHelp)
+{
+  char buf[256];
+  snprintf(buf, ARRAY_LENGTH(buf),
+           "# HELP " PREFIX "%s %s\n# TYPE " PREFIX "%s %s\n",
+           aName, aHelp, aName, aType);
+  aOut.append(buf);
+}
+
+static void AppendValue(string& aOut,
+                        const char* aName,
+                        const char* aLabels,
+                        double aValue)
+{
+  char buf[256];
+  snprintf(buf, ARRAY_LENGTH(buf), PREFIX "%s%s %.9g\n",
+           aName, aLabels, aValue);
+  aOut.append(buf);
+}
+
+// Appends aHistogram as a summary, dividing its values by aScale.
+static void AppendSummary(string& aOut,
+                          const char* aName,
+                          const char* aHelp,
+                          const Histogram& aHistogram,
+                          double aScale)
+{
+  static const char* quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+  AppendHeader(aOut, aName, "summary", aHelp);
+  string name(aName);
+  for (unsigned i = 0; i < ARRAY_LENGTH(quantiles); i++) {
+    string labels = string("{quantile=\"") + quantiles[i] + "\"}";
+    double percentile = atof(quantiles[i]) * 100;
+    AppendValue(aOut, aName, labels.c_str(),
+                aHistogram.Percentile(percentile) / aScale);
+  }
+  AppendValue(aOut, aName, "{quantile=\"1\"}", aHistogram.Max() / aScale);
+  AppendValue(aOut, (name + "_sum").c_str(), "",
+              aHistogram.Sum() / aScale);
+  AppendValue(aOut, (name + "_count").c_str(), "",
+              (double)aHistogram.Count());
+}
+
+string Stats::Format() {
+  if (!sMonitor) {
+    return "";
+  }
+  StatsTotals* totals = new StatsTotals();
+  {
+    MonitorAutoLock lock(sMonitor);
+    totals->Add(*sRetired);
+    for (StatsShard* shard = sShards; shard; shard = shard->mNext) {
+      MonitorAutoLock shardLock(shard->mMonitor);
+      totals->Add(*shard);
+    }
+  }
+  const int64_t* c = totals->mCounters;
+  const Histogram* h = totals->mHistograms;
+
+  string out;
+  AppendHeader(out, "connections_active", "gauge",
+               "Connections currently open.");
+  AppendValue(out, "connections_active", "",
+              (double)(c[CONNECTIONS_OPENED] - c[CONNECTIONS_CLOSED]));
+  AppendHeader(out, "connections_total", "counter",
+               "Connections accepted.");
+  AppendValue(out, "connections_total", "", (double)c[CONNECTIONS_OPENED]);
+
+  static const char* modes[] = {
+    "entire_file", "file_range", "dir_list", "stats", "not_modified",
+    "not_found", "range_not_satisfiable", "internal_error"
+  };
+  AppendHeader(out, "requests_total", "counter",
+               "Requests, by kind of response.");
+  for (unsigned i = 0; i < ARRAY_LENGTH(modes); i++) {
+    string labels = string("{mode=\"") + modes[i] + "\"}";
+    AppendValue(out, "requests_total", labels.c_str(),
+                (double)c[REQUESTS_ENTIRE_FILE + i]);
+  }
+
+  AppendHeader(out, "sent_bytes_total", "counter",
+               "Header and body bytes sent.");
+  AppendValue(out, "sent_bytes_total", "", (double)c[BYTES_SENT]);
+
+  AppendHeader(out, "paced_seconds_total", "counter",
+               "Time responses spent waiting for the delay and rate "
+               "parameters.");
+  AppendValue(out, "paced_seconds_total", "{reason=\"delay\"}",
+              c[DELAY_SLEEP] / 1e6);
+  AppendValue(out, "paced_seconds_total", "{reason=\"rate\"}",
+              c[RATE_SLEEP] / 1e6);
+
+  AppendHeader(out, "live_skipped_bytes_total", "counter",
+               "Bytes of live streams skipped by subscribers which fell "
+               "behind.");
+  AppendValue(out, "live_skipped_bytes_total", "",
+              (double)c[LIVE_SKIPPED_BYTES]);
+  AppendHeader(out, "live_dropped_total", "counter",
+               "Live stream subscribers dropped for falling behind.");
+  AppendValue(out, "live_dropped_total", "", (double)c[LIVE_DROPPED]);
+
+  AppendSummary(out, "time_to_first_byte_seconds",
+                "Time from request to the first byte of the response.",
+                h[TIME_TO_FIRST_BYTE], 1e6);
+  AppendSummary(out, "time_to_last_byte_seconds",
+                "Time from request to the last byte of the response.",
+                h[TIME_TO_LAST_BYTE], 1e6);
+  AppendSummary(out, "rate_achieved_ratio",
+                "Body rate achieved by rate limited responses, as a "
+                "fraction of the requested rate.",
+                h[RATE_ACHIEVED], 1e3);
+  delete totals;
+  return out;
+}
+
+#ifdef _DEBUG
+
+class StatsRecorder : public Runnable {
+public:
+  virtual void Run() {
+    for (int i = 0; i < 1000; i++) {
+      Stats::Increment(Stats::BYTES_SENT, 2);
+      Stats::Record(Stats::TIME_TO_FIRST_BYTE, 1000);
+    }
+  }
+};
+
+void Stats::Test() {
+  // Start from zero, and leave zeroed stats for the server.
+  bool initialized = sMonitor != 0;
+  Shutdown();
+  Init();
+
+  Increment(CONNECTIONS_OPENED, 3);
+  Increment(CONNECTIONS_CLOSED);
+  Increment(REQUESTS_DIR_LIST);
+  Record(TIME_TO_LAST_BYTE, 250000);
+
+  // Exited threads' counts are kept.
+  const unsigned numThreads = 4;
+  StatsRecorder recorder;
+  Thread* threads[numThreads];
+  for (unsigned i = 0; i < numThreads; i++) {
+    threads[i] = Thread::Create(&recorder);
+    threads[i]->Start();
+  }
+  for (unsigned i = 0; i < numThreads; i++) {
+    threads[i]->Join();
+    delete threads[i];
+  }
+
+  string out = Format();
+  assert(out.find("\n" PREFIX "connections_active 2\n") != string::npos);
+  assert(out.find("\n" PREFIX "connections_total 3\n") != string::npos);
+  assert(out.find(PREFIX "requests_total{mode=\"dir_list\"} 1\n")
+         != string::npos);
+  assert(out.find(PREFIX "requests_total{mode=\"stats\"} 0\n")
+         != string::npos);
+  assert(out.find(PREFIX "sent_bytes_total 8000\n") != string::npos);
+  assert(out.find(PREFIX "time_to_first_byte_seconds_count 4000\n")
+         != string::npos);
+  assert(out.find(PREFIX "time_to_first_byte_seconds_sum 4\n")
+         != string::npos);
+  assert(out.find(PREFIX "time_to_last_byte_seconds{quantile=\"1\"} 0.25")
+         != string::npos);
+
+  Shutdown();
+  assert(Format().empty());
+  if (initialized) {
+    Init();
+  }
+}
+
+#endif
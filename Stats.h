@@ -0,0 +1,97 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "Utils.h"
+
+// Server wide counters and latency histograms, reported in the Prometheus
+// text format. Each thread records into its own shard, guarded by a lock
+// which only the reporting thread contends for, so instrumentation
+// doesn't serialize the threads serving requests. Shards are merged when
+// the stats are formatted. Until Init() is called, and after Shutdown(),
+// nothing is recorded.
+class Stats {
+public:
+  enum eCounter {
+    CONNECTIONS_OPENED,
+    CONNECTIONS_CLOSED,
+    // Requests, by the kind of response sent.
+    REQUESTS_ENTIRE_FILE,
+    REQUESTS_FILE_RANGE,
+    REQUESTS_DIR_LIST,
+    REQUESTS_STATS,
+    REQUESTS_NOT_MODIFIED,
+    REQUESTS_NOT_FOUND,
+    REQUESTS_RANGE_NOT_SATISFIABLE,
+    REQUESTS_INTERNAL_ERROR,
+    // Header and body bytes sent.
+    BYTES_SENT,
+    // Microseconds responses spent waiting for the delay and rate
+    // parameters.
+    DELAY_SLEEP,
+    RATE_SLEEP,
+    // Bytes of live streams skipped by subscribers which fell behind, and
+    // subscribers dropped because their data was overwritten.
+    LIVE_SKIPPED_BYTES,
+    LIVE_DROPPED,
+    NUM_COUNTERS
+  };
+
+  enum eHistogram {
+    // Microseconds from receiving a request to sending the first byte,
+    // and the last byte, of its response.
+    TIME_TO_FIRST_BYTE,
+    TIME_TO_LAST_BYTE,
+    // Body rate achieved by rate limited responses, in thousandths of the
+    // requested rate.
+    RATE_ACHIEVED,
+    NUM_HISTOGRAMS
+  };
+
+  static void Init();
+  static void Shutdown();
+
+  static void Increment(eCounter aCounter, int64_t aAmount = 1);
+
+  static void Record(eHistogram aHistogram, int64_t aValue);
+
+  // Returns the merged totals of all threads in the Prometheus text
+  // exposition format.
+  static string Format();
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+};
+
+#endif
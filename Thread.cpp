@@ -115,10 +115,70 @@ Thread* Thread::Create(Runnable *aRunnable) {
   return new Win32Thread(aRunnable);
 }
 
+class Win32Monitor : public Monitor {
+public:
+  Win32Monitor() {
+    InitializeCriticalSection(&mLock);
+    InitializeConditionVariable(&mCondVar);
+  }
+  ~Win32Monitor() {
+    DeleteCriticalSection(&mLock);
+  }
+  void Lock() {
+    EnterCriticalSection(&mLock);
+  }
+  void Unlock() {
+    LeaveCriticalSection(&mLock);
+  }
+  void Wait() {
+    SleepConditionVariableCS(&mCondVar, &mLock, INFINITE);
+  }
+  void TimedWait(int64_t aTimeout) {
+    DWORD ms = (DWORD)((aTimeout + 999) / 1000);
+    SleepConditionVariableCS(&mCondVar, &mLock, ms);
+  }
+  void Notify() {
+    WakeConditionVariable(&mCondVar);
+  }
+  void NotifyAll() {
+    WakeAllConditionVariable(&mCondVar);
+  }
+private:
+  CRITICAL_SECTION mLock;
+  CONDITION_VARIABLE mCondVar;
+};
+
+Monitor* Monitor::Create() {
+  return new Win32Monitor();
+}
+
+int AtomicAdd(volatile int* aValue, int aDelta) {
+  return InterlockedExchangeAdd((volatile LONG*)aValue, aDelta) + aDelta;
+}
+
+unsigned GetProcessorCount() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+bool PinCurrentThread(unsigned aCpu) {
+  if (aCpu >= sizeof(DWORD_PTR) * 8) {
+    return false;
+  }
+  return SetThreadAffinityMask(GetCurrentThread(),
+                               (DWORD_PTR)1 << aCpu) != 0;
+}
+
 #else
 // Assume pthreads are supported...
 
 #include "pthread.h"
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 class PThread : public Thread {
 public:
@@ -126,17 +186,49 @@ public:
   static void* PThreadRunner(void* aThread);
 
   PThread(Runnable* aRunnable) 
-    : Thread(aRunnable) {}
+    : Thread(aRunnable),
+      mStarted(false),
+      mJoinState(eNotJoined)
+  {
+    pthread_mutex_init(&mLock, 0);
+    pthread_cond_init(&mStateCond, 0);
+  }
 
   ~PThread() {
+    pthread_cond_destroy(&mStateCond);
+    pthread_mutex_destroy(&mLock);
   }
 
   void Join() {
-    pthread_join(mThread, NULL);
+    // Joining may be attempted before the thread is started, in which
+    // case there's no pthread to join yet. A pthread may only be joined
+    // once, so any other joiners wait for the first to finish.
+    pthread_mutex_lock(&mLock);
+    while (!mStarted) {
+      pthread_cond_wait(&mStateCond, &mLock);
+    }
+    if (mJoinState == eNotJoined) {
+      mJoinState = eJoining;
+      pthread_mutex_unlock(&mLock);
+      pthread_join(mThread, NULL);
+      pthread_mutex_lock(&mLock);
+      mJoinState = eJoined;
+      pthread_cond_broadcast(&mStateCond);
+    }
+    while (mJoinState != eJoined) {
+      pthread_cond_wait(&mStateCond, &mLock);
+    }
+    pthread_mutex_unlock(&mLock);
   }
 
   void Start() {
-    pthread_create(&mThread, 0, &PThreadRunner, this);
+    pthread_mutex_lock(&mLock);
+    if (!mStarted) {
+      pthread_create(&mThread, 0, &PThreadRunner, this);
+      mStarted = true;
+      pthread_cond_broadcast(&mStateCond);
+    }
+    pthread_mutex_unlock(&mLock);
   }
 
   void CallRun() {
@@ -144,18 +236,105 @@ public:
   }
 
 private:
+  enum JoinState {
+    eNotJoined,
+    eJoining,
+    eJoined
+  };
+
   pthread_t mThread;
+  pthread_mutex_t mLock;
+  pthread_cond_t mStateCond;
+  bool mStarted;
+  JoinState mJoinState;
 };
 
 void* PThread::PThreadRunner(void* aThread) {
   PThread* p = static_cast<PThread*>(aThread);
   p->CallRun();
+  return 0;
 }
 
 Thread* Thread::Create(Runnable *aRunnable) {
   return new PThread(aRunnable);
 }
 
+class PThreadMonitor : public Monitor {
+public:
+  PThreadMonitor() {
+    pthread_mutex_init(&mLock, 0);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifdef __linux__
+    // Time out against the same clock as GetMonotonicTime().
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&mCondVar, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  ~PThreadMonitor() {
+    pthread_cond_destroy(&mCondVar);
+    pthread_mutex_destroy(&mLock);
+  }
+  void Lock() {
+    pthread_mutex_lock(&mLock);
+  }
+  void Unlock() {
+    pthread_mutex_unlock(&mLock);
+  }
+  void Wait() {
+    pthread_cond_wait(&mCondVar, &mLock);
+  }
+  void TimedWait(int64_t aTimeout) {
+    struct timespec ts;
+#ifdef __linux__
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    int64_t ns = ts.tv_nsec + (aTimeout % 1000000) * 1000;
+    ts.tv_sec += (time_t)(aTimeout / 1000000 + ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    pthread_cond_timedwait(&mCondVar, &mLock, &ts);
+  }
+  void Notify() {
+    pthread_cond_signal(&mCondVar);
+  }
+  void NotifyAll() {
+    pthread_cond_broadcast(&mCondVar);
+  }
+private:
+  pthread_mutex_t mLock;
+  pthread_cond_t mCondVar;
+};
+
+Monitor* Monitor::Create() {
+  return new PThreadMonitor();
+}
+
+int AtomicAdd(volatile int* aValue, int aDelta) {
+  return __sync_add_and_fetch(aValue, aDelta);
+}
+
+unsigned GetProcessorCount() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (unsigned)n : 1;
+}
+
+bool PinCurrentThread(unsigned aCpu) {
+#ifdef __linux__
+  if (aCpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(aCpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
 #endif // LINUX
 
 
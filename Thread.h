@@ -34,8 +34,11 @@
 
 // Platform independent thread wrapper.
 
+#include "Utils.h"
+
 class Runnable {
 public:
+  virtual ~Runnable() {}
   virtual void Run() = 0;
 };
 
@@ -51,6 +54,73 @@ protected:
   Runnable* mRunnable;
 };
 
+// Platform independent mutex with an associated condition variable.
+class Monitor {
+public:
+  static Monitor* Create();
+  virtual ~Monitor() {}
+  virtual void Lock() = 0;
+  virtual void Unlock() = 0;
+
+  // Atomically releases the lock and waits to be notified, then reacquires
+  // the lock. Must be called with the lock held. May wake spuriously.
+  virtual void Wait() = 0;
+
+  // As Wait(), but gives up after aTimeout microseconds.
+  virtual void TimedWait(int64_t aTimeout) = 0;
+
+  // Wakes one/all threads waiting on the monitor.
+  virtual void Notify() = 0;
+  virtual void NotifyAll() = 0;
+protected:
+  Monitor() {}
+};
+
+// Holds a monitor's lock for the lifetime of the object.
+class MonitorAutoLock {
+public:
+  MonitorAutoLock(Monitor* aMonitor)
+    : mMonitor(aMonitor)
+  {
+    mMonitor->Lock();
+  }
+  ~MonitorAutoLock() {
+    mMonitor->Unlock();
+  }
+  void Wait() {
+    mMonitor->Wait();
+  }
+  void TimedWait(int64_t aTimeout) {
+    mMonitor->TimedWait(aTimeout);
+  }
+  void Notify() {
+    mMonitor->Notify();
+  }
+  void NotifyAll() {
+    mMonitor->NotifyAll();
+  }
+private:
+  Monitor* mMonitor;
+};
+
+// Declares a variable with a separate instance in each thread. Only for
+// plain data, which is zero initialized and never destroyed.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Atomically adds aDelta to *aValue, and returns the new value.
+int AtomicAdd(volatile int* aValue, int aDelta);
+
+// Returns the number of processors available, at least 1.
+unsigned GetProcessorCount();
+
+// Restricts the calling thread to running on processor aCpu. Returns false
+// if that's not possible.
+bool PinCurrentThread(unsigned aCpu);
+
 #ifdef _DEBUG
 void Thread_Test();
 #endif
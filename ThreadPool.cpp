@@ -0,0 +1,149 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned aThreads, unsigned aQueueLimit)
+  : mMonitor(Monitor::Create()),
+    mQueueLimit(aQueueLimit),
+    mWorker(this),
+    mShutdown(false)
+{
+  assert(aThreads > 0);
+  assert(aQueueLimit > 0);
+  for (unsigned i = 0; i < aThreads; i++) {
+    Thread* t = Thread::Create(&mWorker);
+    mThreads.push_back(t);
+    t->Start();
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  Shutdown();
+  delete mMonitor;
+}
+
+bool ThreadPool::Dispatch(Runnable* aJob) {
+  MonitorAutoLock lock(mMonitor);
+  while (!mShutdown && mQueue.size() >= mQueueLimit) {
+    lock.Wait();
+  }
+  if (mShutdown) {
+    delete aJob;
+    return false;
+  }
+  mQueue.push_back(aJob);
+  // Dispatchers and workers share the monitor, so wake everyone to be sure
+  // a worker sees the new job.
+  lock.NotifyAll();
+  return true;
+}
+
+void ThreadPool::Shutdown() {
+  {
+    MonitorAutoLock lock(mMonitor);
+    if (mShutdown) {
+      return;
+    }
+    mShutdown = true;
+    lock.NotifyAll();
+  }
+  for (unsigned i = 0; i < mThreads.size(); i++) {
+    mThreads[i]->Join();
+    delete mThreads[i];
+  }
+  mThreads.clear();
+}
+
+void ThreadPool::RunJobs() {
+  while (true) {
+    Runnable* job = 0;
+    {
+      MonitorAutoLock lock(mMonitor);
+      while (mQueue.empty() && !mShutdown) {
+        lock.Wait();
+      }
+      if (mQueue.empty()) {
+        // Shutting down, and no work left.
+        return;
+      }
+      job = mQueue.front();
+      mQueue.pop_front();
+      // Let a blocked dispatcher know there's room in the queue.
+      lock.NotifyAll();
+    }
+    job->Run();
+    delete job;
+  }
+}
+
+#ifdef _DEBUG
+
+// Adds the numbers in a range to a shared total.
+class SumJob : public Runnable {
+public:
+  SumJob(int aStart, int aEnd, int* aTotal, Monitor* aMonitor)
+    : mStart(aStart), mEnd(aEnd), mTotal(aTotal), mMonitor(aMonitor) {}
+  virtual void Run() {
+    int sum = 0;
+    for (int i = mStart; i < mEnd; i++) {
+      sum += i;
+    }
+    MonitorAutoLock lock(mMonitor);
+    *mTotal += sum;
+  }
+private:
+  int mStart, mEnd;
+  int* mTotal;
+  Monitor* mMonitor;
+};
+
+void ThreadPool::Test() {
+  Monitor* monitor = Monitor::Create();
+  int total = 0;
+  {
+    // More jobs than queue slots, so Dispatch() must block and resume.
+    ThreadPool pool(3, 2);
+    for (int i = 0; i < 100; i++) {
+      bool ok = pool.Dispatch(new SumJob(i * 10, (i + 1) * 10, &total, monitor));
+      assert(ok);
+    }
+    pool.Shutdown();
+    bool ok = pool.Dispatch(new SumJob(0, 10, &total, monitor));
+    assert(!ok);
+  }
+  assert(total == 499500);
+  delete monitor;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <deque>
+#include <vector>
+
+#include "Thread.h"
+
+// Fixed set of worker threads servicing a bounded queue of jobs.
+class ThreadPool {
+public:
+  // Starts aThreads workers. At most aQueueLimit jobs may be waiting for
+  // a worker at any time.
+  ThreadPool(unsigned aThreads, unsigned aQueueLimit);
+
+  // Shuts down the pool, waiting for running and queued jobs to finish.
+  ~ThreadPool();
+
+  // Queues aJob to be run on a worker thread. The pool takes ownership of
+  // aJob and deletes it once it has run. Blocks while the queue is full.
+  // Returns false, and deletes aJob, if the pool is shutting down.
+  bool Dispatch(Runnable* aJob);
+
+  // Stops accepting new jobs, and waits for the workers to drain the
+  // queue and exit.
+  void Shutdown();
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  class Worker : public Runnable {
+  public:
+    Worker(ThreadPool* aPool) : mPool(aPool) {}
+    virtual void Run() {
+      mPool->RunJobs();
+    }
+  private:
+    ThreadPool* mPool;
+  };
+
+  // Main loop of the worker threads.
+  void RunJobs();
+
+  Monitor* mMonitor;
+  std::deque<Runnable*> mQueue;
+  unsigned mQueueLimit;
+  std::vector<Thread*> mThreads;
+  Worker mWorker;
+  bool mShutdown;
+};
+
+#endif
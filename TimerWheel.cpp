@@ -0,0 +1,240 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel(int64_t aNow)
+  : mTick(aNow / TICK),
+    mSize(0)
+{
+  for (unsigned l = 0; l < LEVELS; l++) {
+    for (unsigned s = 0; s < SLOTS; s++) {
+      mSlots[l][s].mPrev = mSlots[l][s].mNext = &mSlots[l][s];
+    }
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  // Detach any remaining entries, so they don't point into freed memory.
+  std::vector<Entry*> entries;
+  TakeAll(entries);
+}
+
+void TimerWheel::TakeAll(std::vector<Entry*>& aEntries) {
+  for (unsigned l = 0; l < LEVELS; l++) {
+    for (unsigned s = 0; s < SLOTS; s++) {
+      Entry* head = &mSlots[l][s];
+      while (head->mNext != head) {
+        Entry* e = head->mNext;
+        Unlink(e);
+        aEntries.push_back(e);
+      }
+    }
+  }
+}
+
+void TimerWheel::Schedule(Entry* aEntry, int64_t aDeadline) {
+  if (aEntry->IsScheduled()) {
+    Unlink(aEntry);
+  }
+  aEntry->mDeadline = aDeadline;
+  Insert(aEntry);
+}
+
+void TimerWheel::Cancel(Entry* aEntry) {
+  if (aEntry->IsScheduled()) {
+    Unlink(aEntry);
+  }
+}
+
+void TimerWheel::Insert(Entry* aEntry) {
+  // Round up, so entries never expire early.
+  int64_t tick = (aEntry->mDeadline + TICK - 1) / TICK;
+  if (tick <= mTick) {
+    // Already due; expire on the next tick.
+    tick = mTick + 1;
+  }
+  int64_t delta = tick - mTick;
+  unsigned level = 0;
+  while (level < LEVELS - 1 &&
+         delta >= ((int64_t)1 << (LEVEL_BITS * (level + 1)))) {
+    level++;
+  }
+  int64_t maxDelta = ((int64_t)1 << (LEVEL_BITS * LEVELS)) - 1;
+  if (delta > maxDelta) {
+    // Too far in the future; park in the furthest slot and cascade again
+    // when it comes round.
+    tick = mTick + maxDelta;
+  }
+  unsigned slot = (unsigned)(tick >> (LEVEL_BITS * level)) & (SLOTS - 1);
+  Entry* head = &mSlots[level][slot];
+  aEntry->mNext = head;
+  aEntry->mPrev = head->mPrev;
+  head->mPrev->mNext = aEntry;
+  head->mPrev = aEntry;
+  mSize++;
+}
+
+void TimerWheel::Unlink(Entry* aEntry) {
+  aEntry->mPrev->mNext = aEntry->mNext;
+  aEntry->mNext->mPrev = aEntry->mPrev;
+  aEntry->mPrev = aEntry->mNext = 0;
+  mSize--;
+}
+
+void TimerWheel::Cascade(unsigned aLevel, unsigned aSlot) {
+  Entry* head = &mSlots[aLevel][aSlot];
+  while (head->mNext != head) {
+    Entry* e = head->mNext;
+    Unlink(e);
+    Insert(e);
+  }
+}
+
+void TimerWheel::Advance(int64_t aNow, std::vector<Entry*>& aExpired) {
+  int64_t target = aNow / TICK;
+  while (mTick < target) {
+    if (mSize == 0) {
+      // Nothing to expire, skip straight to the target tick.
+      mTick = target;
+      break;
+    }
+    mTick++;
+    unsigned slot = (unsigned)mTick & (SLOTS - 1);
+    // Each time a level wraps, pull the next slot of the level above
+    // down into the lower levels.
+    for (unsigned l = 1; l < LEVELS; l++) {
+      if (((mTick >> (LEVEL_BITS * (l - 1))) & (SLOTS - 1)) != 0) {
+        break;
+      }
+      Cascade(l, (unsigned)(mTick >> (LEVEL_BITS * l)) & (SLOTS - 1));
+    }
+    Entry* head = &mSlots[0][slot];
+    while (head->mNext != head) {
+      Entry* e = head->mNext;
+      Unlink(e);
+      if (e->mDeadline > aNow) {
+        // Parked because it was beyond the wheel's range.
+        Insert(e);
+        continue;
+      }
+      mLateness.Record(aNow - e->mDeadline);
+      aExpired.push_back(e);
+    }
+  }
+}
+
+int64_t TimerWheel::NextTimeout(int64_t aNow, int64_t aMax) const {
+  if (mSize == 0) {
+    return aMax;
+  }
+  // Look for the first occupied slot in the lowest level. If there is
+  // none, the earliest entry is in a higher level, and we need to wake at
+  // the latest when the lowest level wraps to cascade it.
+  int64_t ticks = SLOTS - (mTick & (SLOTS - 1));
+  for (int64_t i = 1; i < SLOTS; i++) {
+    unsigned slot = (unsigned)(mTick + i) & (SLOTS - 1);
+    const Entry* head = &mSlots[0][slot];
+    if (head->mNext != head) {
+      ticks = i;
+      break;
+    }
+    if (slot == SLOTS - 1) {
+      break;
+    }
+  }
+  int64_t timeout = (mTick + ticks) * TICK - aNow;
+  if (timeout < 0) {
+    timeout = 0;
+  }
+  return timeout < aMax ? timeout : aMax;
+}
+
+#ifdef _DEBUG
+void TimerWheel::Test() {
+  const int64_t start = 123456789;
+  TimerWheel wheel(start);
+  assert(wheel.IsEmpty());
+  assert(wheel.NextTimeout(start, 500000) == 500000);
+
+  // Deadlines spread over every level, scheduled out of order.
+  const int N = 6;
+  const int64_t offsets[N] = { 7000000000LL, 300, 5000, 300000, 90000000, 0 };
+  Entry entries[N];
+  for (int i = 0; i < N; i++) {
+    wheel.Schedule(&entries[i], start + offsets[i]);
+  }
+  Entry cancelled;
+  wheel.Schedule(&cancelled, start + 5000);
+  wheel.Cancel(&cancelled);
+  assert(!cancelled.IsScheduled());
+
+  std::vector<Entry*> expired;
+  int64_t now = start;
+  int64_t last = 0;
+  while (expired.size() < (size_t)N) {
+    int64_t timeout = wheel.NextTimeout(now, 1000000000LL);
+    assert(timeout >= 0);
+    now += timeout > 0 ? timeout : 1;
+    size_t before = expired.size();
+    wheel.Advance(now, expired);
+    for (size_t i = before; i < expired.size(); i++) {
+      // Never early, never more than a tick late when driven by
+      // NextTimeout(), and in order.
+      assert(expired[i]->GetDeadline() <= now);
+      assert(now - expired[i]->GetDeadline() <= TICK);
+      assert(expired[i]->GetDeadline() >= last);
+      last = expired[i]->GetDeadline();
+      assert(!expired[i]->IsScheduled());
+    }
+  }
+  assert(wheel.IsEmpty());
+  assert(wheel.Lateness().Count() == N);
+  assert(wheel.Lateness().Max() <= TICK);
+
+  // Advancing a long way in one step expires everything due.
+  TimerWheel wheel2(0);
+  wheel2.Schedule(&entries[0], 10 * TICK);
+  wheel2.Schedule(&entries[1], 100000 * TICK);
+  expired.clear();
+  wheel2.Advance(1000000 * TICK, expired);
+  assert(expired.size() == 2 && wheel2.IsEmpty());
+
+  wheel2.Schedule(&entries[0], 2000000 * TICK);
+  wheel2.Schedule(&entries[1], 1000001 * TICK);
+  expired.clear();
+  wheel2.TakeAll(expired);
+  assert(expired.size() == 2 && wheel2.IsEmpty());
+  assert(!entries[0].IsScheduled() && !entries[1].IsScheduled());
+}
+#endif
@@ -0,0 +1,125 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <vector>
+
+#include "Histogram.h"
+#include "Utils.h"
+
+// Hierarchical timing wheel. Scheduling and cancelling a timer are O(1),
+// and advancing the wheel costs O(1) per elapsed tick plus the expired
+// timers, however many timers are pending. Deadlines are in the units of
+// GetMonotonicTime() (microseconds) and are rounded up to a whole tick.
+// Not thread safe.
+class TimerWheel {
+public:
+  // A pending timer. Users derive from this and schedule instances; an
+  // entry can be in at most one wheel at a time.
+  class Entry {
+  public:
+    Entry() : mPrev(0), mNext(0), mDeadline(0) {}
+    virtual ~Entry() {}
+    bool IsScheduled() const {
+      return mPrev != 0;
+    }
+    int64_t GetDeadline() const {
+      return mDeadline;
+    }
+  private:
+    friend class TimerWheel;
+    Entry* mPrev;
+    Entry* mNext;
+    int64_t mDeadline;
+  };
+
+  // Tick length in microseconds.
+  static const int64_t TICK = 1000;
+
+  TimerWheel(int64_t aNow);
+  ~TimerWheel();
+
+  // Schedules aEntry to expire at aDeadline, rescheduling it if it's
+  // already pending.
+  void Schedule(Entry* aEntry, int64_t aDeadline);
+
+  void Cancel(Entry* aEntry);
+
+  // Removes every pending entry, appending them to aEntries.
+  void TakeAll(std::vector<Entry*>& aEntries);
+
+  // Advances the wheel to aNow, appending entries whose deadline has
+  // passed to aExpired, in deadline order to within a tick. Records how
+  // late each expired entry is in the lateness histogram.
+  void Advance(int64_t aNow, std::vector<Entry*>& aExpired);
+
+  // Returns an upper bound on the time until the next entry expires, in
+  // microseconds, or aMax if that's sooner.
+  int64_t NextTimeout(int64_t aNow, int64_t aMax) const;
+
+  bool IsEmpty() const {
+    return mSize == 0;
+  }
+
+  // Lateness of expired entries (time between deadline and the Advance()
+  // which expired them, in microseconds) since the last reset.
+  Histogram& Lateness() {
+    return mLateness;
+  }
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  enum {
+    LEVEL_BITS = 8,
+    SLOTS = 1 << LEVEL_BITS,
+    LEVELS = 4
+  };
+
+  void Insert(Entry* aEntry);
+  void Unlink(Entry* aEntry);
+
+  // Redistributes the entries of a higher level slot into lower levels.
+  void Cascade(unsigned aLevel, unsigned aSlot);
+
+  // Sentinel heads of circular lists, one per slot.
+  Entry mSlots[LEVELS][SLOTS];
+  // Tick up to which the wheel has been advanced.
+  int64_t mTick;
+  unsigned mSize;
+  Histogram mLateness;
+};
+
+#endif
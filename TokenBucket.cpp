@@ -0,0 +1,101 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <assert.h>
+#include <math.h>
+
+#include "TokenBucket.h"
+
+TokenBucket::TokenBucket(double aBytesPerSecond,
+                         int64_t aBurst,
+                         int64_t aInitial,
+                         int64_t aNow)
+  : mRate(aBytesPerSecond / 1000000.0),
+    mBurst((double)aBurst),
+    mTokens((double)aInitial),
+    mLastRefill(aNow)
+{
+  assert(aBytesPerSecond > 0.0);
+  assert(aInitial <= aBurst);
+}
+
+void TokenBucket::Refill(int64_t aNow) {
+  if (aNow <= mLastRefill) {
+    return;
+  }
+  mTokens += (aNow - mLastRefill) * mRate;
+  if (mTokens > mBurst) {
+    mTokens = mBurst;
+  }
+  mLastRefill = aNow;
+}
+
+int64_t TokenBucket::Available(int64_t aNow) {
+  Refill(aNow);
+  return mTokens > 0.0 ? (int64_t)mTokens : 0;
+}
+
+void TokenBucket::Consume(int64_t aBytes) {
+  mTokens -= aBytes;
+}
+
+int64_t TokenBucket::WhenAvailable(int64_t aBytes) const {
+  double needed = aBytes - mTokens;
+  if (needed <= 0.0) {
+    return mLastRefill;
+  }
+  return mLastRefill + (int64_t)ceil(needed / mRate);
+}
+
+#ifdef _DEBUG
+void TokenBucket::Test() {
+  // 1000 bytes/s, so one byte per millisecond.
+  TokenBucket b(1000.0, 100, 10, 0);
+  assert(b.Available(0) == 10);
+  b.Consume(10);
+  assert(b.Available(0) == 0);
+  assert(b.WhenAvailable(5) == 5000);
+  assert(b.Available(5000) == 5);
+
+  // Tokens are capped at the burst size.
+  assert(b.Available(1000000) == 100);
+
+  // Overspending (e.g. a send larger than the tokens available) is repaid
+  // before more bytes are allowed.
+  b.Consume(150);
+  assert(b.Available(1000000) == 0);
+  assert(b.WhenAvailable(1) == 1051000);
+  assert(b.Available(1051000) == 1);
+
+  // Time running backwards doesn't mint tokens.
+  assert(b.Available(0) == 1);
+}
+#endif
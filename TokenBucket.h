@@ -0,0 +1,79 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef __TOKEN_BUCKET_H__
+#define __TOKEN_BUCKET_H__
+
+#include "Utils.h"
+
+// Rate limiter for a byte stream. Tokens (bytes) accumulate at a fixed
+// rate in real time, up to a burst limit, and are spent as bytes are
+// sent. Because tokens are earned by elapsed time and spent by bytes
+// actually sent, time spent sending, partial writes and late wakeups
+// don't skew the long term rate. Times are from GetMonotonicTime().
+class TokenBucket {
+public:
+  // aBytesPerSecond is the target rate, aBurst the most tokens which may
+  // accumulate, and aInitial the tokens available at time aNow.
+  TokenBucket(double aBytesPerSecond,
+              int64_t aBurst,
+              int64_t aInitial,
+              int64_t aNow);
+
+  // Returns the number of whole bytes which may be sent at time aNow.
+  int64_t Available(int64_t aNow);
+
+  // Records that aBytes were sent.
+  void Consume(int64_t aBytes);
+
+  // Returns the earliest time at which aBytes may be sent.
+  int64_t WhenAvailable(int64_t aBytes) const;
+
+  // Returns the target rate in bytes per second.
+  double Rate() const {
+    return mRate * 1000000;
+  }
+
+#ifdef _DEBUG
+  static void Test();
+#endif
+
+private:
+  void Refill(int64_t aNow);
+
+  // Tokens earned per microsecond.
+  double mRate;
+  double mBurst;
+  double mTokens;
+  int64_t mLastRefill;
+};
+
+#endif
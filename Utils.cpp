@@ -30,18 +30,78 @@
 */
 
 #include "Utils.h"
+#include <ctype.h>
 #include <stdio.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+unsigned FormatDecimal(int64_t aValue, char* aBuffer) {
+  // Work with the magnitude as unsigned, so the most negative value
+  // doesn't overflow.
+  uint64_t magnitude = aValue < 0 ? 0 - (uint64_t)aValue : (uint64_t)aValue;
+  char digits[20];
+  unsigned n = 0;
+  do {
+    digits[n++] = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude);
+  unsigned length = 0;
+  if (aValue < 0) {
+    aBuffer[length++] = '-';
+  }
+  while (n > 0) {
+    aBuffer[length++] = digits[--n];
+  }
+  return length;
+}
+
+void AppendDecimal(string& aOut, int64_t aValue) {
+  char buf[MAX_DECIMAL_LENGTH];
+  aOut.append(buf, FormatDecimal(aValue, buf));
+}
+
+void AppendHex(string& aOut, uint64_t aValue) {
+  char digits[16];
+  unsigned n = 0;
+  do {
+    digits[n++] = "0123456789abcdef"[aValue & 0xf];
+    aValue >>= 4;
+  } while (aValue);
+  while (n > 0) {
+    aOut += digits[--n];
+  }
+}
+
+void AppendJsonString(string& aOut, const string& aValue) {
+  aOut.push_back('"');
+  for (size_t i = 0; i < aValue.size(); i++) {
+    unsigned char c = (unsigned char)aValue[i];
+    if (c == '"' || c == '\\') {
+      aOut.push_back('\\');
+      aOut.push_back((char)c);
+    } else if (c < 0x20) {
+      aOut.append("\\u00");
+      aOut.push_back("0123456789abcdef"[c >> 4]);
+      aOut.push_back("0123456789abcdef"[c & 0xf]);
+    } else {
+      aOut.push_back((char)c);
+    }
+  }
+  aOut.push_back('"');
+}
+
 string ToString(int64_t i) {
-  char buf[256];
-  snprintf(buf, 256, "%lld", i);
-  return string(buf);
+  char buf[MAX_DECIMAL_LENGTH];
+  return string(buf, FormatDecimal(i, buf));
 }
 
 string ToString(int i) {
-  char buf[12];
-  snprintf(buf, 12, "%d", i);
-  return string(buf);
+  return ToString((int64_t)i);
 }
 
 string Flatten(const map<string, string>& m) {
@@ -62,10 +122,36 @@ string Flatten(const map<string, string>& m) {
   return s;
 }
 
-bool ContainsKey(const map<string,string> m, const string& key) {
+bool ContainsKey(const map<string,string>& m, const string& key) {
   return m.count(key) > 0;
 }
 
+#ifdef _WIN32
+
+int64_t GetMonotonicTime() {
+  static LARGE_INTEGER frequency = {0};
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (int64_t)(now.QuadPart * 1000000.0 / frequency.QuadPart);
+}
+
+#else
+
+int64_t GetMonotonicTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Sleep(int ms) {
+  usleep(ms * 1000);
+}
+
+#endif
+
 void Tokenize(const string& str,
               vector<string>& tokens,
               const string& delimiters)
@@ -57,9 +57,35 @@ using std::endl;
 string ToString(int64_t i);
 string ToString(int i);
 
+// Longest output of FormatDecimal().
+#define MAX_DECIMAL_LENGTH 20
+
+// Writes aValue in decimal to aBuffer, which must have room for
+// MAX_DECIMAL_LENGTH characters, and returns the number of characters
+// written. The output isn't null terminated.
+unsigned FormatDecimal(int64_t aValue, char* aBuffer);
+
+// Appends aValue in decimal to aOut.
+void AppendDecimal(string& aOut, int64_t aValue);
+
+// Appends aValue in lower case hexadecimal to aOut.
+void AppendHex(string& aOut, uint64_t aValue);
+
+// Appends aValue to aOut as a quoted JSON string.
+void AppendJsonString(string& aOut, const string& aValue);
+
 string Flatten(const map<string, string>& m);
 
-bool ContainsKey(const map<string,string> m, const string& key);
+bool ContainsKey(const map<string,string>& m, const string& key);
+
+// Returns a monotonically increasing timestamp in microseconds. Only
+// differences between two timestamps are meaningful.
+int64_t GetMonotonicTime();
+
+#ifndef _WIN32
+// Suspends the calling thread for ms milliseconds, as on Windows.
+void Sleep(int ms);
+#endif
 
 inline string& StrToLower(string& s) {
   std::transform(s.begin(), s.end(), s.begin(), ::tolower);
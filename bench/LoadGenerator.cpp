@@ -0,0 +1,566 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// HTTP load generator for measuring the server end to end over loopback.
+// Each connection is driven by its own thread, which sends requests one
+// after another on a keep-alive connection, reconnecting when the server
+// closes it. Requests are drawn from a mix of files, byte ranges and
+// rate=, delay= and live query parameters. At the end it reports
+// requests/s, Gb/s of body data, and percentiles of the time to first
+// and last byte, in microseconds. Linux only.
+//
+// Run it from the directory the server is serving, e.g.:
+//   ./LoadGenerator --connections=64 --sizes=64K,4M --range=25
+// See usage() for all options.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../Histogram.h"
+#include "../Thread.h"
+#include "../Utils.h"
+
+// Size of each connection's receive buffer.
+#define RECV_BUFLEN (64 * 1024)
+
+// How long a receive may block before checking whether the run is over,
+// in microseconds.
+#define RECV_TIMEOUT 200000
+
+struct Options {
+  Options()
+    : port(8080),
+      connections(16),
+      duration(10),
+      rangePercent(0),
+      rate(0),
+      ratePercent(0),
+      delay(0),
+      delayPercent(0),
+      livePercent(0)
+  {}
+  sockaddr_in address;
+  int port;
+  int connections;
+  int duration;
+  vector<string> files;
+  // Content length of each of files.
+  vector<int64_t> lengths;
+  int rangePercent;
+  // rate= in KB/s and delay= in ms, and the percentage of requests to add
+  // each to.
+  int rate;
+  int ratePercent;
+  int delay;
+  int delayPercent;
+  int livePercent;
+};
+
+// Outcome of a single request.
+struct Result {
+  Result() : status(0), contentLength(-1), bodyBytes(0), firstByte(0),
+             lastByte(0), keepAlive(false) {}
+  int status;
+  // Content-Length, or -1 if not given.
+  int64_t contentLength;
+  int64_t bodyBytes;
+  // Microseconds from sending the request.
+  int64_t firstByte;
+  int64_t lastByte;
+  bool keepAlive;
+};
+
+// Small, fast random numbers; each worker has its own.
+class Random {
+public:
+  Random(uint64_t aSeed) : mState(aSeed * 2654435761u + 1) {}
+  uint64_t Next() {
+    mState ^= mState << 13;
+    mState ^= mState >> 7;
+    mState ^= mState << 17;
+    return mState;
+  }
+  // Returns a number in [0, aLimit).
+  int64_t Below(int64_t aLimit) {
+    return aLimit > 0 ? (int64_t)(Next() % (uint64_t)aLimit) : 0;
+  }
+  bool Percent(int aPercent) {
+    return Below(100) < aPercent;
+  }
+private:
+  uint64_t mState;
+};
+
+static int Connect(const sockaddr_in& aAddress) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  timeval timeout;
+  timeout.tv_sec = RECV_TIMEOUT / 1000000;
+  timeout.tv_usec = RECV_TIMEOUT % 1000000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (connect(fd, (const sockaddr*)&aAddress, sizeof(aAddress)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool SendAll(int aFd, const string& aData) {
+  size_t sent = 0;
+  while (sent < aData.size()) {
+    ssize_t r = send(aFd, aData.c_str() + sent, aData.size() - sent,
+                     MSG_NOSIGNAL);
+    if (r <= 0) {
+      return false;
+    }
+    sent += r;
+  }
+  return true;
+}
+
+// Returns the value of header aName in aHeaders, or "" if absent.
+static string GetHeader(const string& aHeaders, const char* aName) {
+  size_t nameLength = strlen(aName);
+  size_t pos = aHeaders.find("\r\n");
+  while (pos != string::npos && pos + 2 < aHeaders.size()) {
+    const char* line = aHeaders.c_str() + pos + 2;
+    size_t end = aHeaders.find("\r\n", pos + 2);
+    if (strncasecmp(line, aName, nameLength) == 0 &&
+        line[nameLength] == ':') {
+      size_t start = pos + 2 + nameLength + 1;
+      while (start < end && aHeaders[start] == ' ') {
+        start++;
+      }
+      return aHeaders.substr(start, end - start);
+    }
+    pos = end;
+  }
+  return "";
+}
+
+// Sends aRequest on aFd and reads the response, discarding the body.
+// Returns false if the connection failed, or aDeadline passed first.
+static bool Exchange(int aFd,
+                     const string& aRequest,
+                     bool aHead,
+                     int64_t aDeadline,
+                     char* aBuffer,
+                     Result& aResult)
+{
+  int64_t start = GetMonotonicTime();
+  if (!SendAll(aFd, aRequest)) {
+    return false;
+  }
+  string headers;
+  int64_t contentLength = -1;
+  int64_t received = 0;
+  bool haveHeaders = false;
+  while (true) {
+    ssize_t r = recv(aFd, aBuffer, RECV_BUFLEN, 0);
+    int64_t now = GetMonotonicTime();
+    if (r < 0) {
+      if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) &&
+          now < aDeadline) {
+        continue;
+      }
+      return false;
+    }
+    if (r == 0) {
+      // The server closed the connection; that ends a response without a
+      // Content-Length.
+      if (haveHeaders && contentLength == -1) {
+        aResult.lastByte = now - start;
+        aResult.keepAlive = false;
+        return true;
+      }
+      return false;
+    }
+    if (!aResult.firstByte) {
+      aResult.firstByte = now - start;
+    }
+    size_t bodyStart = 0;
+    if (!haveHeaders) {
+      size_t old = headers.size();
+      headers.append(aBuffer, r);
+      size_t end = headers.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+      if (end == string::npos) {
+        continue;
+      }
+      haveHeaders = true;
+      bodyStart = end + 4 - old;
+      headers.resize(end + 2);
+      aResult.status = atoi(headers.c_str() + strlen("HTTP/1.1 "));
+      string length = GetHeader(headers, "Content-Length");
+      if (!length.empty()) {
+        contentLength = atoll(length.c_str());
+        aResult.contentLength = contentLength;
+      }
+      aResult.keepAlive =
+        strcasecmp(GetHeader(headers, "Connection").c_str(), "close") != 0;
+      if (aHead) {
+        contentLength = 0;
+      }
+    }
+    received += r - bodyStart;
+    aResult.bodyBytes = received;
+    if (contentLength != -1 && received >= contentLength) {
+      aResult.lastByte = now - start;
+      return true;
+    }
+    if (now >= aDeadline) {
+      return false;
+    }
+  }
+}
+
+class Worker : public Runnable {
+public:
+  Worker(const Options& aOptions, unsigned aIndex, int64_t aDeadline)
+    : mOptions(aOptions),
+      mRandom(aIndex + 1),
+      mDeadline(aDeadline),
+      mRequests(0),
+      mErrors(0),
+      mBytes(0)
+  {}
+
+  virtual void Run();
+
+  const Options& mOptions;
+  Random mRandom;
+  int64_t mDeadline;
+  int64_t mRequests;
+  int64_t mErrors;
+  int64_t mBytes;
+  Histogram mFirstByte;
+  Histogram mLastByte;
+};
+
+void Worker::Run() {
+  char* buffer = new char[RECV_BUFLEN];
+  int fd = -1;
+  while (GetMonotonicTime() < mDeadline) {
+    if (fd == -1) {
+      fd = Connect(mOptions.address);
+      if (fd == -1) {
+        mErrors++;
+        Sleep(10);
+        continue;
+      }
+    }
+
+    unsigned file = (unsigned)mRandom.Below(mOptions.files.size());
+    string query;
+    if (mRandom.Percent(mOptions.ratePercent)) {
+      query += "&rate=" + ToString(mOptions.rate);
+    }
+    if (mRandom.Percent(mOptions.delayPercent)) {
+      query += "&delay=" + ToString(mOptions.delay);
+    }
+    if (mRandom.Percent(mOptions.livePercent)) {
+      query += "&live";
+    }
+    string request = "GET /" + mOptions.files[file];
+    if (!query.empty()) {
+      query[0] = '?';
+      request += query;
+    }
+    request += " HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n";
+    if (mRandom.Percent(mOptions.rangePercent)) {
+      // Seek to a random offset, as a media element does.
+      int64_t start = mRandom.Below(mOptions.lengths[file]);
+      request += "Range: bytes=" + ToString(start) + "-\r\n";
+    }
+    request += "\r\n";
+
+    Result result;
+    bool ok = Exchange(fd, request, false, mDeadline, buffer, result);
+    if (!ok && GetMonotonicTime() >= mDeadline) {
+      // Cut short by the end of the run; not counted.
+      break;
+    }
+    if (!ok || result.status < 200 || result.status >= 300) {
+      mErrors++;
+    } else {
+      mRequests++;
+      mBytes += result.bodyBytes;
+      mFirstByte.Record(result.firstByte);
+      mLastByte.Record(result.lastByte);
+    }
+    if (!ok || !result.keepAlive) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  delete[] buffer;
+}
+
+// Parses a size such as 4096, 64K, 4M or 1G.
+static bool ParseSize(const string& aArg, int64_t& aSize) {
+  char* end = 0;
+  aSize = strtoll(aArg.c_str(), &end, 10);
+  switch (*end) {
+    case 'K': case 'k': aSize <<= 10; end++; break;
+    case 'M': case 'm': aSize <<= 20; end++; break;
+    case 'G': case 'g': aSize <<= 30; end++; break;
+  }
+  return end != aArg.c_str() && *end == 0 && aSize > 0;
+}
+
+// Writes a file of aSize bytes for the server to serve, unless one of
+// that size already exists.
+static bool CreateFile(const string& aName, int64_t aSize) {
+  FILE* f = fopen(aName.c_str(), "rb");
+  if (f) {
+    fseek(f, 0, SEEK_END);
+    bool exists = ftell(f) == aSize;
+    fclose(f);
+    if (exists) {
+      return true;
+    }
+  }
+  f = fopen(aName.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  char block[4096];
+  for (unsigned i = 0; i < sizeof(block); i++) {
+    block[i] = (char)i;
+  }
+  for (int64_t written = 0; written < aSize; written += sizeof(block)) {
+    size_t n = (size_t)std::min<int64_t>(sizeof(block), aSize - written);
+    if (fwrite(block, 1, n, f) != n) {
+      fclose(f);
+      return false;
+    }
+  }
+  return fclose(f) == 0;
+}
+
+// Asks the server for the length of each file, so ranges can be chosen.
+static bool GetLengths(Options& aOptions) {
+  char* buffer = new char[RECV_BUFLEN];
+  bool ok = true;
+  for (unsigned i = 0; ok && i < aOptions.files.size(); i++) {
+    int fd = Connect(aOptions.address);
+    if (fd == -1) {
+      fprintf(stderr, "Can't connect to the server\n");
+      ok = false;
+      break;
+    }
+    string request = "HEAD /" + aOptions.files[i] +
+                     " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    Result result;
+    if (!Exchange(fd, request, true, GetMonotonicTime() + 5000000, buffer,
+                  result) || result.status != 200) {
+      fprintf(stderr, "Can't get /%s\n", aOptions.files[i].c_str());
+      ok = false;
+    }
+    aOptions.lengths.push_back(std::max<int64_t>(result.contentLength, 0));
+    close(fd);
+  }
+  delete[] buffer;
+  return ok;
+}
+
+static void usage(const char* aName) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  --host=ADDR          server address (default 127.0.0.1)\n"
+    "  --port=N             server port (default 8080)\n"
+    "  --connections=N      concurrent connections (default 16)\n"
+    "  --duration=S         seconds to run for (default 10)\n"
+    "  --files=A,B,...      files to request, relative to the server's root\n"
+    "  --sizes=4K,1M,...    create files of these sizes in the current\n"
+    "                       directory and request them (default 1M)\n"
+    "  --range=P            percent of requests seeking to a random offset\n"
+    "  --rate=KB:P          percent of requests with rate=KB\n"
+    "  --delay=MS:P         percent of requests with delay=MS\n"
+    "  --live=P             percent of requests with live\n",
+    aName);
+}
+
+static bool ParseInt(const string& aArg, int& aValue, int aMin) {
+  char* end = 0;
+  long value = strtol(aArg.c_str(), &end, 10);
+  if (end == aArg.c_str() || *end || value < aMin || value > 1000000) {
+    return false;
+  }
+  aValue = (int)value;
+  return true;
+}
+
+static bool ParsePercent(const string& aArg, int& aPercent) {
+  return ParseInt(aArg, aPercent, 0) && aPercent <= 100;
+}
+
+// Parses "N:P" into aValue and aPercent.
+static bool ParseMix(const string& aArg, int& aValue, int& aPercent) {
+  size_t colon = aArg.find(':');
+  return colon != string::npos &&
+         ParseInt(aArg.substr(0, colon), aValue, 1) &&
+         ParsePercent(aArg.substr(colon + 1), aPercent);
+}
+
+static bool ParseArgs(int argc, char* argv[], Options& aOptions) {
+  string host = "127.0.0.1";
+  vector<string> sizes;
+  for (int i = 1; i < argc; i++) {
+    string arg(argv[i]);
+    size_t eq = arg.find('=');
+    string name = arg.substr(0, eq);
+    string value = eq == string::npos ? "" : arg.substr(eq + 1);
+    bool ok = true;
+    if (name == "--host") {
+      host = value;
+    } else if (name == "--port") {
+      ok = ParseInt(value, aOptions.port, 1);
+    } else if (name == "--connections") {
+      ok = ParseInt(value, aOptions.connections, 1);
+    } else if (name == "--duration") {
+      ok = ParseInt(value, aOptions.duration, 1);
+    } else if (name == "--files") {
+      Tokenize(value, aOptions.files, ",");
+    } else if (name == "--sizes") {
+      Tokenize(value, sizes, ",");
+    } else if (name == "--range") {
+      ok = ParsePercent(value, aOptions.rangePercent);
+    } else if (name == "--rate") {
+      ok = ParseMix(value, aOptions.rate, aOptions.ratePercent);
+    } else if (name == "--delay") {
+      ok = ParseMix(value, aOptions.delay, aOptions.delayPercent);
+    } else if (name == "--live") {
+      ok = ParsePercent(value, aOptions.livePercent);
+    } else if (name == "--help") {
+      return false;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+      return false;
+    }
+  }
+
+  if (aOptions.files.empty() && sizes.empty()) {
+    sizes.push_back("1M");
+  }
+  for (unsigned i = 0; i < sizes.size(); i++) {
+    int64_t size = 0;
+    if (!ParseSize(sizes[i], size)) {
+      fprintf(stderr, "Invalid size: %s\n", sizes[i].c_str());
+      return false;
+    }
+    string name = "loadgen-" + ToString(size) + ".bin";
+    if (!CreateFile(name, size)) {
+      fprintf(stderr, "Can't create %s\n", name.c_str());
+      return false;
+    }
+    aOptions.files.push_back(name);
+  }
+
+  memset(&aOptions.address, 0, sizeof(aOptions.address));
+  aOptions.address.sin_family = AF_INET;
+  aOptions.address.sin_port = htons((unsigned short)aOptions.port);
+  if (inet_pton(AF_INET, host.c_str(), &aOptions.address.sin_addr) != 1) {
+    hostent* entry = gethostbyname(host.c_str());
+    if (!entry || entry->h_addrtype != AF_INET) {
+      fprintf(stderr, "Unknown host: %s\n", host.c_str());
+      return false;
+    }
+    memcpy(&aOptions.address.sin_addr, entry->h_addr_list[0],
+           sizeof(aOptions.address.sin_addr));
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseArgs(argc, argv, options)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!GetLengths(options)) {
+    return 1;
+  }
+
+  int64_t start = GetMonotonicTime();
+  int64_t deadline = start + (int64_t)options.duration * 1000000;
+  vector<Worker*> workers;
+  vector<Thread*> threads;
+  for (int i = 0; i < options.connections; i++) {
+    workers.push_back(new Worker(options, i, deadline));
+    threads.push_back(Thread::Create(workers.back()));
+    threads.back()->Start();
+  }
+
+  int64_t requests = 0;
+  int64_t errors = 0;
+  int64_t bytes = 0;
+  Histogram firstByte;
+  Histogram lastByte;
+  for (unsigned i = 0; i < threads.size(); i++) {
+    threads[i]->Join();
+    delete threads[i];
+    requests += workers[i]->mRequests;
+    errors += workers[i]->mErrors;
+    bytes += workers[i]->mBytes;
+    firstByte.Add(workers[i]->mFirstByte);
+    lastByte.Add(workers[i]->mLastByte);
+    delete workers[i];
+  }
+  double seconds = (GetMonotonicTime() - start) / 1000000.0;
+
+  printf("requests:            %lld (%lld errors) in %.1fs\n",
+         (long long)requests, (long long)errors, seconds);
+  printf("requests/s:          %.1f\n", requests / seconds);
+  printf("throughput:          %.3f Gb/s\n", bytes * 8 / seconds / 1e9);
+  printf("first byte (us):     %s\n", firstByte.Summary().c_str());
+  printf("last byte (us):      %s\n", lastByte.Summary().c_str());
+  return 0;
+}
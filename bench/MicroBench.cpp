@@ -0,0 +1,277 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Microbenchmarks of the per-request helpers: request parsing, header
+// generation, and the string utilities they use. Each is run for long
+// enough to time reliably, and reports nanoseconds and heap allocations
+// per operation, so changes in per-function cost can be tracked over
+// time. Run it from a writable directory; it creates and removes a small
+// file to serve. Pass part of a benchmark's name to run only matching
+// benchmarks, e.g.:
+//   ./MicroBench RequestParser
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "../RequestParser.h"
+#include "../Response.h"
+#include "../Utils.h"
+
+// Each benchmark is repeated until it has run for at least this long, in
+// microseconds.
+#define MIN_TIME 200000
+
+#define BENCH_FILE "MicroBench.webm"
+
+static int64_t gAllocations = 0;
+
+void* operator new(size_t aSize) {
+  gAllocations++;
+  void* p = malloc(aSize ? aSize : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t aSize) {
+  return operator new(aSize);
+}
+
+void operator delete(void* aPtr) throw() {
+  free(aPtr);
+}
+
+void operator delete[](void* aPtr) throw() {
+  free(aPtr);
+}
+
+// Sized deallocation, used by C++14 compilers where the size is known.
+void operator delete(void* aPtr, size_t) throw() {
+  free(aPtr);
+}
+
+void operator delete[](void* aPtr, size_t) throw() {
+  free(aPtr);
+}
+
+// Keeps results alive, so the compiler can't discard the work.
+static volatile int64_t gSink = 0;
+
+static const char* gFirefoxRequest =
+  "GET /media/video.webm?rate=200 HTTP/1.1\r\n"
+  "Host: 192.168.1.20:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+    "Firefox/120.0\r\n"
+  "Accept: video/webm,video/ogg,video/*;q=0.9,application/ogg;q=0.7,"
+    "audio/*;q=0.6,*/*;q=0.5\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: identity\r\n"
+  "Range: bytes=1048576-\r\n"
+  "Connection: keep-alive\r\n"
+  "Referer: http://192.168.1.20:8080/media/\r\n"
+  "Sec-Fetch-Dest: video\r\n"
+  "Sec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "\r\n";
+
+static const char* gChromeRequest =
+  "GET /media/audio.ogg?live&delay=50 HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "Connection: keep-alive\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"120\", \"Not?A_Brand\";v=\"8\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 "
+    "Safari/537.36\r\n"
+  "sec-ch-ua-platform: \"Windows\"\r\n"
+  "Accept: */*\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Dest: audio\r\n"
+  "Referer: http://localhost:8080/\r\n"
+  "Accept-Encoding: identity;q=1, *;q=0\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "Range: bytes=0-\r\n"
+  "\r\n";
+
+class MicroBench {
+public:
+  static void ParseFirefoxRequest(unsigned aIterations);
+  static void ParseChromeRequest(unsigned aIterations);
+  static void ParseRange(unsigned aIterations);
+  static void ParseQueryParams(unsigned aIterations);
+  static void BuildHeaders(unsigned aIterations);
+  static void GetDate(unsigned aIterations);
+  static void ExtractContentType(unsigned aIterations);
+  static void Tokenize(unsigned aIterations);
+
+private:
+  static void ParseRequest(const char* aRequest, unsigned aIterations);
+};
+
+void MicroBench::ParseRequest(const char* aRequest, unsigned aIterations) {
+  unsigned length = (unsigned)strlen(aRequest);
+  RequestParser parser;
+  for (unsigned i = 0; i < aIterations; i++) {
+    parser.Add(aRequest, length);
+    gSink += parser.IsComplete();
+    parser.Reset();
+  }
+}
+
+void MicroBench::ParseFirefoxRequest(unsigned aIterations) {
+  ParseRequest(gFirefoxRequest, aIterations);
+}
+
+void MicroBench::ParseChromeRequest(unsigned aIterations) {
+  ParseRequest(gChromeRequest, aIterations);
+}
+
+void MicroBench::ParseRange(unsigned aIterations) {
+  static const char range[] = "bytes=1048576-2097151";
+  vector<ByteRange> ranges;
+  for (unsigned i = 0; i < aIterations; i++) {
+    RequestParser::ParseRange(range, range + sizeof(range) - 1, ranges);
+    gSink += ranges[0].first + ranges[0].last;
+  }
+}
+
+void MicroBench::ParseQueryParams(unsigned aIterations) {
+  static const char query[] = "rate=200&burst=1000&live&mime=video/webm";
+  map<string, string> params;
+  for (unsigned i = 0; i < aIterations; i++) {
+    params.clear();
+    RequestParser::ParseQueryParams(query, query + sizeof(query) - 1,
+                                    params);
+    gSink += params.size();
+  }
+}
+
+void MicroBench::BuildHeaders(unsigned aIterations) {
+  string request = string("GET /") + BENCH_FILE + " HTTP/1.1\r\n"
+                   "Range: bytes=1000-\r\n\r\n";
+  RequestParser parser;
+  parser.Add(request.c_str(), (unsigned)request.size());
+  Response response(parser);
+  for (unsigned i = 0; i < aIterations; i++) {
+    // Each response starts with an empty string.
+    string().swap(response.headers);
+    response.BuildHeaders();
+    gSink += response.headers.size();
+  }
+}
+
+void MicroBench::GetDate(unsigned aIterations) {
+  for (unsigned i = 0; i < aIterations; i++) {
+    gSink += strlen(Response::GetDate());
+  }
+}
+
+void MicroBench::ExtractContentType(unsigned aIterations) {
+  string path("media/video.webm");
+  for (unsigned i = 0; i < aIterations; i++) {
+    gSink += (int64_t)Response::ExtractContentType(path,
+                                                   Response::GET_ENTIRE_FILE);
+  }
+}
+
+void MicroBench::Tokenize(unsigned aIterations) {
+  string str("video/webm,video/ogg,video/*;q=0.9,application/ogg;q=0.7");
+  vector<string> tokens;
+  for (unsigned i = 0; i < aIterations; i++) {
+    tokens.clear();
+    ::Tokenize(str, tokens, ",");
+    gSink += tokens.size();
+  }
+}
+
+typedef void (*BenchmarkFunction)(unsigned aIterations);
+
+struct Benchmark {
+  const char* mName;
+  BenchmarkFunction mFunction;
+};
+
+static const Benchmark gBenchmarks[] = {
+  { "RequestParser::Add (Firefox)", MicroBench::ParseFirefoxRequest },
+  { "RequestParser::Add (Chrome)", MicroBench::ParseChromeRequest },
+  { "RequestParser::ParseRange", MicroBench::ParseRange },
+  { "RequestParser::ParseQueryParams", MicroBench::ParseQueryParams },
+  { "Response::BuildHeaders", MicroBench::BuildHeaders },
+  { "Response::GetDate", MicroBench::GetDate },
+  { "Response::ExtractContentType", MicroBench::ExtractContentType },
+  { "Tokenize", MicroBench::Tokenize }
+};
+
+// Runs aBenchmark with more and more iterations until it takes MIN_TIME,
+// and prints the cost of the last run.
+static void Run(const Benchmark& aBenchmark) {
+  unsigned iterations = 1;
+  while (true) {
+    int64_t allocations = gAllocations;
+    int64_t start = GetMonotonicTime();
+    aBenchmark.mFunction(iterations);
+    int64_t elapsed = GetMonotonicTime() - start;
+    allocations = gAllocations - allocations;
+    if (elapsed >= MIN_TIME || iterations >= (1u << 30)) {
+      printf("%-36s %10.1f %10.2f\n", aBenchmark.mName,
+             elapsed * 1000.0 / iterations,
+             (double)allocations / iterations);
+      return;
+    }
+    iterations *= 2;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  FILE* f = fopen(BENCH_FILE, "wb");
+  if (!f) {
+    fprintf(stderr, "Can't create %s\n", BENCH_FILE);
+    return 1;
+  }
+  static char data[64 * 1024];
+  fwrite(data, 1, sizeof(data), f);
+  fclose(f);
+
+  printf("%-36s %10s %10s\n", "benchmark", "ns/op", "allocs/op");
+  for (unsigned i = 0; i < ARRAY_LENGTH(gBenchmarks); i++) {
+    if (argc > 1 && !strstr(gBenchmarks[i].mName, argv[1])) {
+      continue;
+    }
+    Run(gBenchmarks[i]);
+  }
+  remove(BENCH_FILE);
+  return 0;
+}
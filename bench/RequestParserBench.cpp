@@ -0,0 +1,92 @@
+/*
+   Copyright (c) 2011, Chris Pearce
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+
+   - Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+   - Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+   - Neither the name of Chris Pearce nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+   PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE ORGANISATION OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Measures how many requests per second RequestParser parses, for a
+// typical media element request, delivered whole and split across reads.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../RequestParser.h"
+#include "../Utils.h"
+
+static const char* gRequest =
+  "GET /media/video.webm?rate=200&live HTTP/1.1\r\n"
+  "Host: 192.168.1.20:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+    "Firefox/120.0\r\n"
+  "Accept: video/webm,video/ogg,video/*;q=0.9,application/ogg;q=0.7,"
+    "audio/*;q=0.6,*/*;q=0.5\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Range: bytes=1048576-\r\n"
+  "Connection: keep-alive\r\n"
+  "Referer: http://192.168.1.20:8080/media/\r\n"
+  "\r\n";
+
+// Parses aIterations requests, delivering each in pieces of aPiece bytes,
+// and returns the rate in requests per second.
+static double Run(unsigned aIterations, unsigned aPiece) {
+  unsigned length = (unsigned)strlen(gRequest);
+  RequestParser parser;
+  int64_t sum = 0;
+  int64_t start = GetMonotonicTime();
+  for (unsigned i = 0; i < aIterations; i++) {
+    for (unsigned offset = 0; offset < length; offset += aPiece) {
+      unsigned n = length - offset < aPiece ? length - offset : aPiece;
+      parser.Add(gRequest + offset, n);
+    }
+    if (!parser.IsComplete()) {
+      fprintf(stderr, "Request not parsed\n");
+      return 0;
+    }
+    sum += parser.GetRanges()[0].first + parser.GetTarget().size();
+    parser.Reset();
+  }
+  int64_t elapsed = GetMonotonicTime() - start;
+  if (sum == 0) {
+    fprintf(stderr, "Range not parsed\n");
+  }
+  return aIterations * 1000000.0 / (elapsed > 0 ? elapsed : 1);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned iterations = 1000000;
+  if (argc > 1) {
+    iterations = (unsigned)atoi(argv[1]);
+  }
+  // Warm up.
+  Run(iterations / 10, 4096);
+  double whole = Run(iterations, 4096);
+  double split = Run(iterations, 100);
+  fprintf(stderr, "whole requests:   %10.0f requests/s\n", whole);
+  fprintf(stderr, "100 byte reads:   %10.0f requests/s\n", split);
+  return 0;
+}
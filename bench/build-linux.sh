@@ -0,0 +1,3 @@
+g++ -O2 RequestParserBench.cpp ../RequestParser.cpp ../Log.cpp ../Thread.cpp ../Utils.cpp -o RequestParserBench -lpthread
+g++ -O2 MicroBench.cpp `ls ../*.cpp | grep -v HttpMediaServer.cpp` -o MicroBench -lpthread
+g++ -O2 LoadGenerator.cpp ../Histogram.cpp ../Thread.cpp ../Utils.cpp -o LoadGenerator -lpthread